@@ -59,12 +59,14 @@ build('targets/ivs')
 build('targets/ivs-ctl')
 build('targets/tcam-benchmark')
 build('targets/l2table-benchmark')
+build('targets/kflow-benchmark')
+build('targets/stats-benchmark')
 build('targets/upcall-throughput-benchmark')
 build('targets/upcall-latency-benchmark')
 
 # Unit tests
 utestsdir = 'targets/utests'
-utests = ['tcam', 'l2table', 'xbuf']
+utests = ['tcam', 'l2table', 'xbuf', 'log_histogram', 'taghash', 'slab', 'stats', 'telemetry']
 for utest in utests:
     build(os.path.join(utestsdir, utest), toolchains=['gcc-local'])
     test(utest, "make -C %s" % os.path.join(utestsdir, utest))
@@ -33,3 +33,7 @@ stats_BASEDIR := $(BASEDIR)/stats
 pipeline_reflect_BASEDIR := $(BASEDIR)/pipeline_reflect
 shared_debug_counter_BASEDIR := $(BASEDIR)/shared_debug_counter
 packet_trace_BASEDIR := $(BASEDIR)/packet_trace
+log_histogram_BASEDIR := $(BASEDIR)/log_histogram
+taghash_BASEDIR := $(BASEDIR)/taghash
+slab_BASEDIR := $(BASEDIR)/slab
+telemetry_BASEDIR := $(BASEDIR)/telemetry
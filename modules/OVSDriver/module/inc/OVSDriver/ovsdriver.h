@@ -29,4 +29,23 @@ void ind_ovs_enable(void);
 void ind_ovs_uplink_add(const char *name);
 indigo_error_t ind_ovs_port_add_internal(const char *port_name);
 
+/*
+ * Override the kflow install policy for packets received on a port.
+ * A kflow is requested once a key has been seen 'packets' times within
+ * roughly 'window_ms' milliseconds. Zero restores the global default.
+ */
+indigo_error_t ind_ovs_port_kflow_install_policy_set(const char *port_name, uint32_t packets, uint32_t window_ms);
+
+/*
+ * Set the share of its upcall process a port gets when several ports have
+ * upcalls queued. Zero restores the default weight of 1.
+ */
+indigo_error_t ind_ovs_port_upcall_weight_set(const char *port_name, uint32_t weight);
+
+/*
+ * Override the maximum number of kflows with the port as their input port.
+ * Zero restores the global default.
+ */
+indigo_error_t ind_ovs_port_kflow_limit_set(const char *port_name, uint32_t limit);
+
 #endif
@@ -105,7 +105,7 @@
 
 
 #ifndef OVSDRIVER_CONFIG_INCLUDE_UCLI
-#define OVSDRIVER_CONFIG_INCLUDE_UCLI 0
+#define OVSDRIVER_CONFIG_INCLUDE_UCLI 1
 #endif
 
 
@@ -24,6 +24,14 @@
  * schedules a kflow revalidation to run the next time the given connection
  * receives a barrier request. This allows multiple flow-mods (for example) to
  * share the expensive revalidation processing.
+ *
+ * Revalidation runs as a SocketManager task in time slices (see kflow.c). A
+ * blocked connection is unblocked once a revalidation pass covering all
+ * changes made before its barrier has completed.
+ *
+ * Pipelines that track dependencies use
+ * 'ind_ovs_barrier_defer_revalidation_object' instead, which limits the
+ * revalidation to kflows that consulted the changed object.
  */
 
 #include "ovs_driver_int.h"
@@ -37,9 +45,12 @@
 struct blocked_cxn {
     indigo_cxn_id_t cxn_id;
     indigo_cxn_barrier_blocker_t blocker;
+    bool waiting; /* revalidation started, waiting for it to complete */
+    uint64_t generation; /* kflow generation that unblocks this cxn */
 };
 
 static void revalidate(void);
+static void defer_revalidation(indigo_cxn_id_t cxn_id);
 static void barrier_timer(void *cookie);
 
 /* Map from cxn_id to a barrier blocker */
@@ -53,6 +64,26 @@ DEBUG_COUNTER(timer_expired, "ovsdriver.barrier.timer_expired",
 
 void
 ind_ovs_barrier_defer_revalidation(indigo_cxn_id_t cxn_id)
+{
+    ind_ovs_kflow_mark_all_dirty();
+    defer_revalidation(cxn_id);
+}
+
+/*
+ * Schedule revalidation of the kflows that depend on 'object'
+ *
+ * 'object' must have been recorded with pipeline_add_dependency.
+ */
+void
+ind_ovs_barrier_defer_revalidation_object(indigo_cxn_id_t cxn_id,
+                                          const void *object)
+{
+    ind_ovs_kflow_mark_dirty(object);
+    defer_revalidation(cxn_id);
+}
+
+static void
+defer_revalidation(indigo_cxn_id_t cxn_id)
 {
     /* If invalid cxn_id is passed, revalidate all flows */
     if (INDIGO_CXN_INVALID(cxn_id)) {
@@ -65,7 +96,7 @@ ind_ovs_barrier_defer_revalidation(indigo_cxn_id_t cxn_id)
 
     int i;
     for (i = 0; i < MAX_BLOCKED_CXNS; i++) {
-        if (blocked_cxns[i].cxn_id == cxn_id) {
+        if (blocked_cxns[i].cxn_id == cxn_id && !blocked_cxns[i].waiting) {
             AIM_LOG_TRACE("cxn %d already blocked", cxn_id);
             return;
         } else if (blocked_cxns[i].cxn_id == INDIGO_CXN_ID_UNSPECIFIED) {
@@ -77,13 +108,15 @@ ind_ovs_barrier_defer_revalidation(indigo_cxn_id_t cxn_id)
         debug_counter_inc(&blocked_cxns_full);
         AIM_LOG_WARN("blocked connection table full");
         revalidate();
+        ind_ovs_kflow_invalidate_all();
         /* blocked_cxns table empty, retry */
-        ind_ovs_barrier_defer_revalidation(cxn_id);
+        defer_revalidation(cxn_id);
         return;
     }
 
     AIM_LOG_TRACE("blocking cxn %d", cxn_id);
     blocked_cxn->cxn_id = cxn_id;
+    blocked_cxn->waiting = false;
     indigo_cxn_block_barrier(cxn_id, &blocked_cxn->blocker);
 
     if (!barrier_timer_active) {
@@ -104,6 +137,8 @@ ind_ovs_barrier_defer_revalidation(indigo_cxn_id_t cxn_id)
 void
 ind_ovs_barrier_defer_revalidation_internal(void)
 {
+    ind_ovs_kflow_mark_all_dirty();
+
     if (!barrier_timer_active) {
         ind_soc_timer_event_register_with_priority(barrier_timer, NULL, 100,
                                                    IND_SOC_LOWEST_PRIORITY);
@@ -114,17 +149,17 @@ ind_ovs_barrier_defer_revalidation_internal(void)
 static void
 revalidate(void)
 {
-    AIM_LOG_TRACE("revalidating all kernel flows");
+    AIM_LOG_TRACE("revalidating kernel flows");
 
-    ind_ovs_kflow_invalidate_all();
-    ind_ovs_upcall_respawn();
+    /* Changes made so far are covered by the revalidation started below */
+    uint64_t generation = ind_ovs_kflow_generation();
 
     int i;
     for (i = 0; i < MAX_BLOCKED_CXNS; i++) {
-        if (blocked_cxns[i].cxn_id != INDIGO_CXN_ID_UNSPECIFIED) {
-            AIM_LOG_TRACE("unblocking cxn %d", blocked_cxns[i].cxn_id);
-            indigo_cxn_unblock_barrier(&blocked_cxns[i].blocker);
-            blocked_cxns[i].cxn_id = INDIGO_CXN_ID_UNSPECIFIED;
+        if (blocked_cxns[i].cxn_id != INDIGO_CXN_ID_UNSPECIFIED &&
+                !blocked_cxns[i].waiting) {
+            blocked_cxns[i].waiting = true;
+            blocked_cxns[i].generation = generation;
         }
     }
 
@@ -132,6 +167,30 @@ revalidate(void)
         ind_soc_timer_event_unregister(barrier_timer, NULL);
         barrier_timer_active = false;
     }
+
+    ind_ovs_upcall_respawn();
+    ind_ovs_kflow_revalidate();
+}
+
+/*
+ * Called by the kflow module when a revalidation pass completes
+ *
+ * Unblocks connections whose changes were all covered by the pass.
+ */
+void
+ind_ovs_barrier_revalidation_complete(uint64_t generation)
+{
+    int i;
+    for (i = 0; i < MAX_BLOCKED_CXNS; i++) {
+        if (blocked_cxns[i].cxn_id != INDIGO_CXN_ID_UNSPECIFIED &&
+                blocked_cxns[i].waiting &&
+                blocked_cxns[i].generation <= generation) {
+            AIM_LOG_TRACE("unblocking cxn %d", blocked_cxns[i].cxn_id);
+            indigo_cxn_unblock_barrier(&blocked_cxns[i].blocker);
+            blocked_cxns[i].cxn_id = INDIGO_CXN_ID_UNSPECIFIED;
+            blocked_cxns[i].waiting = false;
+        }
+    }
 }
 
 /*
@@ -156,7 +215,7 @@ barrier_received(indigo_cxn_id_t cxn_id, void *cookie)
 {
     int i;
     for (i = 0; i < MAX_BLOCKED_CXNS; i++) {
-        if (blocked_cxns[i].cxn_id == cxn_id) {
+        if (blocked_cxns[i].cxn_id == cxn_id && !blocked_cxns[i].waiting) {
             revalidate();
             return;
         }
@@ -171,6 +230,7 @@ ind_ovs_barrier_init(void)
     int i;
     for (i = 0; i < MAX_BLOCKED_CXNS; i++) {
         blocked_cxns[i].cxn_id = INDIGO_CXN_ID_UNSPECIFIED;
+        blocked_cxns[i].waiting = false;
     }
 
     indigo_cxn_barrier_notify_register(barrier_received, NULL);
@@ -32,18 +32,17 @@
  * The controller sends this message to tell us that it has finished pushing
  * OpenFlow table entries and we're ready to manage the existing flows.
  *
- * Currently this just flushes the kernel flowtable and relies on the upcall
- * threads to figure out what should go back into the kernel flowtable.
- * Future work is to read the flows from the kernel, validate them against the
- * new userspace forwarding state, and modify them if necessary.
+ * The existing kernel flows are read back and revalidated against the new
+ * userspace forwarding state. Only those whose actions changed are modified
+ * or deleted, so established traffic doesn't fall back to the upcall path.
  */
 static void
 handle_takeover(indigo_cxn_id_t cxn_id, of_object_t *msg)
 {
     if (ind_ovs_hitless) {
         AIM_LOG_INFO("Received takeover message");
-        ind_ovs_kflow_flush();
         ind_ovs_hitless = false;
+        ind_ovs_kflow_adopt();
     } else {
         AIM_LOG_VERBOSE("Not in hitless restart mode, ignoring takeover message");
     }
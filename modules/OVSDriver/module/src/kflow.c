@@ -22,9 +22,154 @@
 #include <pthread.h>
 #include <SocketManager/socketmanager.h>
 #include <tcam/tcam.h>
+#include <taghash/taghash.h>
+#include <slab/slab.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 
 #define IND_OVS_KFLOW_EXPIRATION_MS 2345
-#define NUM_KFLOW_BUCKETS 8192
+
+/*
+ * Lifetime of the drop kflows installed by overloaded upcall processes.
+ * Rounded up to the next expiration pass.
+ */
+#define IND_OVS_KFLOW_DROP_TIMEOUT_MS 1000
+
+/*
+ * Kflows are looked up by key hash in a taghash, which grows with the number
+ * of kflows. They are allocated from slabs, one per KFLOW_SLAB_GRANULARITY
+ * bytes of key length. Kflows with longer keys than the largest class use
+ * malloc.
+ */
+#define KFLOW_TABLE_MIN_SLOTS 8192
+#define KFLOW_SLAB_GRANULARITY 64
+#define NUM_KFLOW_SLABS 8
+
+/*
+ * Adaptive idle expiration
+ *
+ * A kflow's idle timeout starts at IND_OVS_KFLOW_EXPIRATION_MS and is:
+ *  - cut to KFLOW_IDLE_MIN_MS while the kflow has seen only a few packets,
+ *    as for a DNS request and response;
+ *  - doubled each time its key is reinstalled within
+ *    KFLOW_REINSTALL_WINDOW_MS of expiring, up to KFLOW_IDLE_MAX_SHIFT times,
+ *    so periodic flows such as heartbeats stay in the kernel;
+ *  - scaled down towards KFLOW_IDLE_MIN_MS as the in_port's share of kflows
+ *    fills past half.
+ *
+ * Recently expired keys are remembered in a direct-mapped table of
+ * NUM_KFLOW_EXPIRED_SLOTS entries. A collision only loses history.
+ */
+#define KFLOW_IDLE_MIN_MS 500
+#define KFLOW_IDLE_FEW_PACKETS 2
+#define KFLOW_IDLE_MAX_SHIFT 4
+#define KFLOW_REINSTALL_WINDOW_MS 30000
+#define NUM_KFLOW_EXPIRED_SLOTS 4096
+
+/*
+ * Incremental expiration
+ *
+ * Every IND_OVS_KFLOW_EXPIRE_INTERVAL_MS the expire task visits the next
+ * slice of the kflow list, resuming where the previous slice stopped. Only
+ * kflows whose last_used time as known to userspace is older than their idle
+ * timeout are candidates. Those are fetched from the kernel with batched
+ * OVS_FLOW_CMD_GET requests to learn the real last_used time, and deleted if
+ * they really are idle. At most KFLOW_EXPIRE_MAX_FETCH kflows are fetched per
+ * tick.
+ *
+ * The slice is sized so that a cycle over the whole list takes
+ * IND_OVS_KFLOW_EXPIRATION_MS while the ports are mostly empty, shrinking
+ * towards KFLOW_IDLE_MIN_MS as the fullest port approaches its kflow limit,
+ * which is when idle timeouts shrink too.
+ */
+#define KFLOW_EXPIRE_BATCH_SIZE 64
+#define KFLOW_EXPIRE_MAX_FETCH 1024
+#define KFLOW_EXPIRE_MIN_SLICE 256
+
+/*
+ * Bulk stats synchronization
+ *
+ * Every KFLOW_STATS_REFRESH_MS the expiration timer starts kflow_stats_task,
+ * which dumps the datapath flow table and applies the deltas of every kflow
+ * instead of a GET per kflow. The task reads the dump a part at a time and
+ * yields like the expire task, so the main thread never blocks on it. The
+ * dump also carries the kernel's last used times, so the idle kflows it
+ * finds are expired on behalf of the expiration scan once the dump is done.
+ * Readers of OpenFlow stats get the counts of the last dump and never wait
+ * for one.
+ *
+ * Stats are read through ind_ovs_stats_get and ind_ovs_stats_get_batch.
+ * Once the reads since the last dump exceed 1/KFLOW_STATS_SNAPSHOT_RATIO of
+ * the allocated stats slots, every slot is aggregated into a snapshot in one
+ * sequential pass and the remaining reads until the next dump are served from
+ * it. A flow stats reply for many flows then costs one pass over the writers'
+ * arrays instead of a scattered read per flow and writer. A flow-mod discards
+ * the snapshot, so a stats request right after it sees the counts of the new
+ * flows, including packets forwarded by the upcall threads since.
+ */
+#define KFLOW_STATS_REFRESH_MS 1000
+#define KFLOW_STATS_SNAPSHOT_RATIO 16
+
+/*
+ * Eviction
+ *
+ * A new kflow on a port at its kflow limit evicts one of the port's kflows
+ * instead of being refused. The victim is chosen by a CLOCK sweep over the
+ * kflow list: kflow_sync_stats marks a kflow referenced when its packet count
+ * grows, and the hand clears the mark on each of the port's kflows it passes,
+ * stopping at the first one that was already clear. New kflows start
+ * unreferenced, so the kflows left by a port scan go before ones that have
+ * carried traffic since the hand last passed. The marks come from the last
+ * stats dump, which runs in the background every KFLOW_STATS_REFRESH_MS.
+ *
+ * The hand visits at most KFLOW_EVICT_MAX_SCAN kflows per eviction.
+ */
+#define KFLOW_EVICT_MAX_SCAN 8192
+
+/*
+ * Mask budget
+ *
+ * The kernel tries each distinct megaflow mask in turn for every packet that
+ * misses its exact match cache, so the number of masks bounds the cost of a
+ * kernel flow lookup. Masks in use are kept in kflow_masks with a count of
+ * the kflows using each. Once there are ind_ovs_kflow_mask_budget of them, a
+ * new kflow whose mask isn't among them takes the existing mask that matches
+ * the same attributes and covers all of its bits with the fewest extra bits.
+ * A more specific mask only makes the kflow match a subset of the packets the
+ * pipeline said it could, so its actions stay correct. If no such mask
+ * exists the budget is exceeded.
+ *
+ * kflow_mask_table indexes the masks by hash, so linking a kflow doesn't
+ * scan them. Only a kflow over budget walks the list.
+ */
+#define KFLOW_MASK_BUDGET 64
+#define KFLOW_MASK_TABLE_MIN_SLOTS 128
+
+/*
+ * Warm start
+ *
+ * If IVS_KFLOW_CHECKPOINT names a file, the kflows used in the last
+ * IND_OVS_KFLOW_EXPIRATION_MS are written to it on shutdown with the name of
+ * their input port, their mask and a hash of their actions. After a restart
+ * without hitless takeover they are reinstalled from the checkpoint in bulk
+ * instead of one upcall at a time. Each key is run through the pipeline as
+ * for an upcall, and only installed if the pipeline now produces the same
+ * actions and a mask covered by the checkpointed one. So a kflow is only
+ * installed once the controller has pushed the state it depends on.
+ *
+ * The remaining kflows are retried after every revalidation pass, which
+ * follows the controller's barriers, until KFLOW_CHECKPOINT_TIMEOUT_MS after
+ * startup.
+ */
+#define KFLOW_CHECKPOINT_MAGIC 0x4b464c57
+#define KFLOW_CHECKPOINT_VERSION 1
+#define KFLOW_CHECKPOINT_TIMEOUT_MS 60000
 
 #ifndef NDEBUG
 #define NUM_KFLOW_MASK_TESTS 2
@@ -32,33 +177,278 @@
 #define NUM_KFLOW_MASK_TESTS 0
 #endif
 
+/*
+ * Asynchronous kflow installation
+ *
+ * OVS_FLOW_CMD_NEW requests are queued in kflow_install_buf and sent to the
+ * kernel in a single sendmsg, either once KFLOW_INSTALL_BATCH_SIZE requests
+ * are queued or from a task at the end of the current event loop iteration.
+ * Only the last request in a batch asks for an ACK. The kernel processes a
+ * batch in order and replies with an error for each request that fails, so
+ * the reply for a sequence number completes every earlier request.
+ *
+ * A kflow is added to the userspace tables when its request is queued, so
+ * duplicate requests are suppressed while the install is in flight. If the
+ * kernel rejects the request the kflow is removed again.
+ *
+ * Revalidation sends its OVS_FLOW_CMD_SET and OVS_FLOW_CMD_DEL requests the
+ * same way, so they are ordered after the kflow's install without waiting
+ * for it. A kflow is removed from the userspace tables when its DEL is
+ * queued. A request that moves a kflow's stats to new stats handles, or
+ * deletes it, takes the old stats handles along and asks for an echo of the
+ * flow, whose stats complete the old handles when it arrives.
+ */
+#define KFLOW_INSTALL_BATCH_SIZE 64
+#define KFLOW_INSTALL_MAX_IN_FLIGHT 1024
+
+/*
+ * Pipeline objects changed since the last revalidation
+ *
+ * Objects are hashed into a bitmap. Collisions only cause extra kflows to be
+ * revalidated. kflow_all_dirty is set when a change can't be attributed to
+ * an object, for example a port status change or a pipeline that doesn't
+ * track dependencies.
+ */
+#define KFLOW_DIRTY_BITS (64*1024)
+
+/*
+ * Large revalidation passes are split across forked worker processes. Each
+ * worker runs the pipeline for every Nth kflow of the pass and streams the
+ * results back over a pipe. The main process applies them to the kernel.
+ * Smaller passes aren't worth the fork.
+ */
+#define KFLOW_REVALIDATE_MAX_WORKERS 16
+#define KFLOW_REVALIDATE_KFLOWS_PER_WORKER 2048
+#define KFLOW_REVALIDATE_WRITE_SIZE (64*1024)
+#define KFLOW_REVALIDATE_PIPE_SIZE (1024*1024)
+
+struct kflow_dirty_set {
+    uint64_t bits[KFLOW_DIRTY_BITS/64];
+    bool all; /* every kflow is dirty */
+    bool any; /* some bit is set */
+};
+
+/* Result of revalidating one kflow in a worker process */
+enum kflow_revalidate_result {
+    KFLOW_REVALIDATE_SKIP, /* no dependency changed */
+    KFLOW_REVALIDATE_DELETE, /* pipeline error or drop kflow */
+    KFLOW_REVALIDATE_UPDATE, /* followed by the pipeline output */
+};
+
+/*
+ * Header of a worker result record
+ *
+ * An update is followed by the dependencies, mask, stats handles and
+ * actions. Records are padded to 8 bytes.
+ */
+struct kflow_revalidate_record {
+    uint32_t len; /* including this header */
+    uint32_t index; /* into kflow_revalidate_array */
+    uint32_t num_deps;
+    uint16_t actions_len;
+    uint16_t num_stats_handles;
+    uint8_t result; /* enum kflow_revalidate_result */
+    uint8_t pad[7]; /* keep the dependencies aligned */
+};
+
+struct kflow_revalidate_worker {
+    pid_t pid;
+    int fd; /* read end of the result pipe, or -1 */
+    struct xbuf buf; /* partial records */
+};
+
+struct kflow_expired_entry {
+    uint32_t hash; /* key_hash of the expired kflow */
+    uint8_t idle_shift;
+    uint64_t time; /* monotonic time in ms, zero if unused */
+};
+
+struct kflow_checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fingerprint; /* see kflow_checkpoint_fingerprint */
+    uint32_t count; /* records that follow */
+};
+
+/* A checkpointed kflow, followed by its key and padded to 8 bytes */
+struct kflow_checkpoint_record {
+    uint32_t len; /* including this header */
+    uint32_t actions_hash;
+    bool done; /* installed or given up on, only used in memory */
+    char ifname[IFNAMSIZ]; /* input port */
+    struct ind_ovs_parsed_key mask;
+};
+
+/* A distinct kflow mask, see the mask budget */
+struct ind_ovs_kflow_mask {
+    struct list_links links; /* kflow_masks */
+    uint32_t hash; /* key in kflow_mask_table */
+    uint32_t refcount; /* kflows using this mask */
+    struct ind_ovs_parsed_key mask;
+};
+
+struct kflow_install_request {
+    uint32_t seq;
+    uint8_t cmd; /* OVS_FLOW_CMD_* */
+    uint16_t num_stats_handles; /* size of stats_handles array */
+    struct ind_ovs_kflow *kflow; /* NULL if the kflow was deleted */
+    struct stats stats; /* counted into stats_handles so far */
+    struct stats_handle *stats_handles; /* replaced or deleted, or NULL */
+};
+
 static void test_kflow_mask(struct ind_ovs_kflow *kflow);
+static bool kflow_install_reserve(void);
+static void kflow_install_queue(struct nl_msg *msg, struct ind_ovs_kflow *kflow);
+static void kflow_install_kick(void);
+static void kflow_install_flush(void);
+static void kflow_install_detach(struct ind_ovs_kflow *kflow);
+static void kflow_delete_async(struct ind_ovs_kflow *kflow);
+static void kflow_forget(struct ind_ovs_kflow *kflow);
+static bool kflow_evict(uint32_t in_port);
+static void ind_ovs_kflow_delete(struct ind_ovs_kflow *kflow);
+static bool kflow_checkpoint_matches(const struct kflow_checkpoint_record *record,
+                                     const struct nlattr *actions,
+                                     const struct ind_ovs_parsed_key *mask);
+static void kflow_checkpoint_kick(void);
+static uint8_t kflow_reinstall_check(uint32_t hash, uint64_t now);
+static void kflow_expire_flush(void);
+static ind_soc_task_status_t kflow_install_task(void *cookie);
+static ind_soc_task_status_t kflow_revalidate_task(void *cookie);
+static void kflow_revalidate_worker_ready(int fd, void *cookie, int read_ready, int write_ready, int error_seen);
+static void kflow_stats_snapshot_invalidate(void);
 
 static struct list_head ind_ovs_kflows;
-static struct list_head ind_ovs_kflow_buckets[NUM_KFLOW_BUCKETS];
+static struct taghash kflow_table;
+static struct slab *kflow_slabs[NUM_KFLOW_SLABS];
 static struct xbuf ind_ovs_kflow_stats_xbuf;
 static struct stats_writer *ind_ovs_kflow_stats_writer;
 static struct nl_sock *kflow_expire_socket;
+static struct nl_sock *kflow_stats_socket;
+static uint64_t kflow_stats_refresh_time; /* monotonic time in ms of the last dump */
+static bool kflow_stats_task_running;
+static bool kflow_stats_dump_running; /* replies to the dump still coming */
+static uint32_t kflow_stats_dump_seq;
+static struct xbuf kflow_stats_expire_keys; /* kflows to check once the dump is done */
+static uint32_t kflow_stats_expire_offset; /* next key to check */
+static struct stats_snapshot *kflow_stats_snapshot;
+static bool kflow_stats_snapshot_valid; /* taken since the last dump or flow-mod */
+static uint64_t kflow_stats_snapshot_tick; /* kflow_stats_refresh_time when taken */
+static uint32_t kflow_stats_reads; /* handles read since the last dump or flow-mod */
 static struct tcam *megaflow_tcam;
+static struct list_head kflow_masks;
+static struct taghash kflow_mask_table;
+static uint32_t kflow_num_masks;
 
 static bool kflow_expire_task_running;
+static struct list_links *kflow_expire_cursor; /* next kflow to visit, NULL between cycles */
+static struct xbuf kflow_expire_buf; /* queued GET requests */
+static struct ind_ovs_kflow *kflow_expire_batch[KFLOW_EXPIRE_BATCH_SIZE]; /* NULL once answered */
+static int kflow_expire_batch_len;
+static uint32_t kflow_expire_seq; /* sequence number of kflow_expire_batch[0] */
+static uint32_t kflow_expire_fetch_budget; /* fetches left in this tick */
+static struct ind_ovs_kflow_expire_status kflow_expire_status;
+
+static struct list_links *kflow_evict_hand; /* next kflow to visit, or NULL */
+
+static const char *kflow_checkpoint_path;
+static struct xbuf kflow_checkpoint_buf; /* records loaded at startup */
+static uint32_t kflow_checkpoint_file_fingerprint;
+static uint32_t kflow_checkpoint_count; /* records loaded */
+static uint32_t kflow_checkpoint_remaining; /* records not done */
+static uint32_t kflow_checkpoint_offset; /* next record for the warm start task */
+static uint64_t kflow_checkpoint_start_time; /* monotonic time in ms of startup */
+static bool kflow_checkpoint_task_registered;
+
+static struct nl_sock *kflow_install_socket;
+static struct xbuf kflow_install_buf;
+static int kflow_install_queued; /* requests in kflow_install_buf */
+static uint32_t kflow_install_last; /* offset of the last queued request */
+static uint32_t kflow_install_seq;
+static bool kflow_install_task_registered;
+
+static struct xbuf kflow_deps_xbuf;
+
+static struct kflow_expired_entry kflow_expired[NUM_KFLOW_EXPIRED_SLOTS];
+
+/*
+ * Revalidation state
+ *
+ * kflow_generation is incremented by every change. A pass takes over the
+ * changes made so far by moving them from kflow_dirty to
+ * kflow_revalidate_dirty, and queues every kflow. Changes made while the
+ * pass runs go into kflow_dirty and are picked up by a following pass.
+ */
+static struct kflow_dirty_set kflow_dirty;
+static struct kflow_dirty_set kflow_revalidate_dirty;
+static uint64_t kflow_generation;
+static struct ind_ovs_kflow **kflow_revalidate_array; /* NULL once visited */
+static uint32_t kflow_revalidate_array_size; /* allocated slots */
+static uint32_t kflow_revalidate_cursor; /* next slot to visit locally */
+static struct kflow_revalidate_worker kflow_revalidate_workers[KFLOW_REVALIDATE_MAX_WORKERS];
+static bool kflow_revalidate_running;
+static bool kflow_revalidate_requested; /* start another pass when done */
+static bool kflow_revalidate_task_registered;
+static struct ind_ovs_kflow_revalidate_status kflow_revalidate_status;
+
+uint32_t ind_ovs_kflow_revalidate_workers = 0;
+uint32_t ind_ovs_kflow_limit = IND_OVS_MAX_KFLOWS_PER_PORT;
+uint32_t ind_ovs_kflow_mask_budget = KFLOW_MASK_BUDGET;
+
+/* Requests sent or queued, oldest first. Indexed modulo the array size. */
+static struct kflow_install_request kflow_install_requests[KFLOW_INSTALL_MAX_IN_FLIGHT];
+static uint32_t kflow_install_head, kflow_install_tail;
 
 DEBUG_COUNTER(add, "ovsdriver.kflow.add", "Kernel flow added");
 DEBUG_COUNTER(add_invalid_port, "ovsdriver.kflow.add_invalid_port",
               "Kernel flow add failed due to invalid port number");
 DEBUG_COUNTER(add_kflow_limit, "ovsdriver.kflow.add_kflow_limit",
               "Kernel flow add failed due to per-port limit");
+DEBUG_COUNTER(evict, "ovsdriver.kflow.evict",
+              "Kernel flow evicted to make room on a port at its limit");
 DEBUG_COUNTER(add_exists, "ovsdriver.kflow.add_exists",
               "Kernel flow add skipped because it already exists");
 DEBUG_COUNTER(add_pipeline_failed, "ovsdriver.kflow.add_pipeline_failed",
               "Kernel flow add failed due an error from the forwarding pipeline");
 DEBUG_COUNTER(add_kernel_failed, "ovsdriver.kflow.add_kernel_failed",
               "Kernel flow add failed due an error from the kernel");
+DEBUG_COUNTER(add_drop, "ovsdriver.kflow.add_drop",
+              "Drop kernel flow added for an overloaded upcall process");
+DEBUG_COUNTER(install_batch, "ovsdriver.kflow.install_batch",
+              "Batch of kernel flow installs sent to the kernel");
+DEBUG_COUNTER(install_backlog_full, "ovsdriver.kflow.install_backlog_full",
+              "Kernel flow add dropped because too many installs were in flight");
+DEBUG_COUNTER(install_reply_lost, "ovsdriver.kflow.install_reply_lost",
+              "Replies to kernel flow installs were lost and the kflows rechecked");
 DEBUG_COUNTER(sync_stats, "ovsdriver.kflow.sync_stats",
               "Synchronized statistics from a kernel flow");
 DEBUG_COUNTER(sync_stats_failed, "ovsdriver.kflow.sync_stats_failed",
               "Failed to synchronize statistics from a kernel flow");
+DEBUG_COUNTER(stats_dump, "ovsdriver.kflow.stats_dump",
+              "Kernel flow table dumped to synchronize statistics");
+DEBUG_COUNTER(stats_dump_time, "ovsdriver.kflow.stats_dump_time",
+              "Time in microseconds spent dumping kernel flow statistics");
+DEBUG_COUNTER(stats_snapshot, "ovsdriver.kflow.stats_snapshot",
+              "Stats slots aggregated into a snapshot for bulk reads");
+DEBUG_COUNTER(stats_snapshot_time, "ovsdriver.kflow.stats_snapshot_time",
+              "Time in microseconds spent aggregating stats snapshots");
 DEBUG_COUNTER(delete, "ovsdriver.kflow.delete", "Kernel flow deleted");
+DEBUG_COUNTER(expire, "ovsdriver.kflow.expire", "Kernel flow expired after being idle");
+DEBUG_COUNTER(expire_premature, "ovsdriver.kflow.expire_premature",
+              "Kernel flow reinstalled soon after it expired");
+DEBUG_COUNTER(expire_cycle, "ovsdriver.kflow.expire_cycle",
+              "Expiration scan visited every kernel flow");
+DEBUG_COUNTER(expire_batch, "ovsdriver.kflow.expire_batch",
+              "Batch of idle kernel flows fetched by the expiration scan");
+DEBUG_COUNTER(expire_missing, "ovsdriver.kflow.expire_missing",
+              "Kernel flow forgotten because the kernel no longer had it");
+DEBUG_COUNTER(adopt, "ovsdriver.kflow.adopt",
+              "Kernel flow adopted from a previous instance during takeover");
+DEBUG_COUNTER(adopt_rejected, "ovsdriver.kflow.adopt_rejected",
+              "Kernel flow deleted during takeover because it could not be adopted");
+DEBUG_COUNTER(warm_start, "ovsdriver.kflow.warm_start",
+              "Kernel flow reinstalled from the warm start checkpoint");
+DEBUG_COUNTER(warm_start_mismatch, "ovsdriver.kflow.warm_start_mismatch",
+              "Checkpointed kernel flow not reinstalled because the pipeline output differs");
 DEBUG_COUNTER(revalidate, "ovsdriver.kflow.revalidate", "Kernel flow revalidated");
 DEBUG_COUNTER(revalidate_mask_changed, "ovsdriver.kflow.revalidate_mask_changed",
               "Kernel flow mask changed when revalidating");
@@ -66,13 +456,89 @@ DEBUG_COUNTER(revalidate_actions_changed, "ovsdriver.kflow.revalidate_actions_ch
               "Kernel flow actions changed when revalidating");
 DEBUG_COUNTER(revalidate_kernel_failed, "ovsdriver.kflow.revalidate_kernel_failed",
               "Revalidating a kernel flow add failed due an error from the kernel");
+DEBUG_COUNTER(revalidate_redo, "ovsdriver.kflow.revalidate_redo",
+              "Kernel flow revalidated again because the pipeline changed after its worker forked");
+DEBUG_COUNTER(revalidate_skipped, "ovsdriver.kflow.revalidate_skipped",
+              "Kernel flow skipped during revalidation because none of its dependencies changed");
 DEBUG_COUNTER(revalidate_time, "ovsdriver.kflow.revalidate_time",
               "Time in microseconds spent revalidating kernel flows");
+DEBUG_COUNTER(revalidate_pass, "ovsdriver.kflow.revalidate_pass",
+              "Kernel flow revalidation pass completed");
+DEBUG_COUNTER(revalidate_coalesced, "ovsdriver.kflow.revalidate_coalesced",
+              "Revalidation requested while a pass was running");
 DEBUG_COUNTER(hit, "ovsdriver.kflow.hit", "Packet hit in the kernel flow table");
 DEBUG_COUNTER(missed, "ovsdriver.kflow.missed", "Packet missed in the kernel flow table");
 DEBUG_COUNTER(lost, "ovsdriver.kflow.lost", "Packet lost due to full upcall socket");
 DEBUG_COUNTER(mask_hit, "ovsdriver.kflow.mask_hit", "Mask used for flow lookup");
 DEBUG_COUNTER(masks, "ovsdriver.kflow.masks", "Number of kernel flow masks");
+DEBUG_COUNTER(mask_widened, "ovsdriver.kflow.mask_widened",
+              "Kernel flow given an existing, more specific mask to stay within the mask budget");
+DEBUG_COUNTER(mask_over_budget, "ovsdriver.kflow.mask_over_budget",
+              "Kernel flow added a mask past the mask budget");
+
+static inline uint32_t
+dirty_bit(const void *object)
+{
+    uintptr_t x = (uintptr_t)object;
+    return murmur_hash(&x, sizeof(x), ind_ovs_salt) % KFLOW_DIRTY_BITS;
+}
+
+/* Check whether any of the given objects changed in 'dirty' */
+static bool
+kflow_deps_dirty(const struct kflow_dirty_set *dirty,
+                 const void * const *deps, uint32_t num_deps)
+{
+    if (dirty->all) {
+        return true;
+    }
+
+    if (!dirty->any) {
+        return false;
+    }
+
+    uint32_t i;
+    for (i = 0; i < num_deps; i++) {
+        uint32_t bit = dirty_bit(deps[i]);
+        if (dirty->bits[bit/64] & (1ULL << (bit % 64))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+kflow_is_dirty(const struct ind_ovs_kflow *kflow)
+{
+    /* Drop kflows don't come from the pipeline and are always deleted */
+    if (kflow->hard_timeout) {
+        return true;
+    }
+
+    return kflow_deps_dirty(&kflow_revalidate_dirty, kflow->deps, kflow->num_deps);
+}
+
+static void
+kflow_dirty_clear(struct kflow_dirty_set *dirty)
+{
+    if (dirty->any) {
+        memset(dirty->bits, 0, sizeof(dirty->bits));
+        dirty->any = false;
+    }
+    dirty->all = false;
+}
+
+/*
+ * Replace the kflow's dependencies with those collected in kflow_deps_xbuf
+ */
+static void
+kflow_set_deps(struct ind_ovs_kflow *kflow)
+{
+    uint32_t num_deps = xbuf_length(&kflow_deps_xbuf) / sizeof(void *);
+    kflow->deps = aim_realloc(kflow->deps, num_deps * sizeof(void *));
+    memcpy(kflow->deps, xbuf_data(&kflow_deps_xbuf), num_deps * sizeof(void *));
+    kflow->num_deps = num_deps;
+}
 
 static inline uint32_t
 key_hash(const struct nlattr *key)
@@ -85,10 +551,10 @@ kflow_lookup(const struct nlattr *key)
 {
     uint32_t hash = key_hash(key);
 
-    struct list_head *bucket = &ind_ovs_kflow_buckets[hash % NUM_KFLOW_BUCKETS];
-    struct list_links *cur;
-    LIST_FOREACH(bucket, cur) {
-        struct ind_ovs_kflow *kflow = container_of(cur, bucket_links, struct ind_ovs_kflow);
+    struct taghash_cursor cursor;
+    struct ind_ovs_kflow *kflow;
+    for (kflow = taghash_first(&kflow_table, hash, &cursor); kflow;
+            kflow = taghash_next(&kflow_table, &cursor)) {
         if (nla_len(kflow->key) == nla_len(key) &&
             memcmp(nla_data(kflow->key), nla_data(key), nla_len(key)) == 0) {
             return kflow;
@@ -98,6 +564,187 @@ kflow_lookup(const struct nlattr *key)
     return NULL;
 }
 
+/* Slab class for a key attribute of the given length, or -1 for malloc */
+static inline int
+kflow_slab_class(uint16_t key_len)
+{
+    int class = (key_len + KFLOW_SLAB_GRANULARITY - 1) / KFLOW_SLAB_GRANULARITY - 1;
+    return class < NUM_KFLOW_SLABS ? class : -1;
+}
+
+/* Allocate a zeroed kflow holding a copy of 'key' */
+static struct ind_ovs_kflow *
+kflow_alloc(const struct nlattr *key)
+{
+    struct ind_ovs_kflow *kflow;
+    int class = kflow_slab_class(key->nla_len);
+    if (class >= 0) {
+        kflow = slab_alloc(kflow_slabs[class]);
+        memset(kflow, 0, sizeof(*kflow));
+    } else {
+        kflow = aim_zmalloc(sizeof(*kflow) + key->nla_len);
+    }
+
+    memcpy(kflow->key, key, key->nla_len);
+    kflow->hash = key_hash(key);
+    kflow->revalidate_index = UINT32_MAX;
+    return kflow;
+}
+
+static void
+kflow_free(struct ind_ovs_kflow *kflow)
+{
+    int class = kflow_slab_class(kflow->key->nla_len);
+    if (class >= 0) {
+        slab_free(kflow_slabs[class], kflow);
+    } else {
+        aim_free(kflow);
+    }
+}
+
+/*
+ * Check that every bit of 'needed' is also set in 'mask'
+ *
+ * A kflow is still correct if its mask is at least as specific as the
+ * pipeline requires. This is the case for kflows adopted from a different
+ * pipeline and for those widened to stay within the mask budget.
+ */
+static bool
+kflow_mask_covers(const struct ind_ovs_parsed_key *mask,
+                  const struct ind_ovs_parsed_key *needed)
+{
+    const uint8_t *a = (const uint8_t *)mask;
+    const uint8_t *b = (const uint8_t *)needed;
+    int i;
+
+    for (i = offsetof(struct ind_ovs_parsed_key, priority); i < sizeof(*mask); i++) {
+        if (b[i] & ~a[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Number of bits set in 'mask' but not in 'needed' */
+static int
+kflow_mask_extra_bits(const struct ind_ovs_parsed_key *mask,
+                      const struct ind_ovs_parsed_key *needed)
+{
+    const uint8_t *a = (const uint8_t *)mask;
+    const uint8_t *b = (const uint8_t *)needed;
+    int i, bits = 0;
+
+    for (i = offsetof(struct ind_ovs_parsed_key, priority); i < sizeof(*mask); i++) {
+        bits += __builtin_popcount(a[i] & ~b[i]);
+    }
+
+    return bits;
+}
+
+static struct ind_ovs_kflow_mask *
+kflow_mask_find(const struct ind_ovs_parsed_key *mask, uint32_t hash)
+{
+    struct taghash_cursor cursor;
+    struct ind_ovs_kflow_mask *entry;
+    for (entry = taghash_first(&kflow_mask_table, hash, &cursor); entry;
+            entry = taghash_next(&kflow_mask_table, &cursor)) {
+        if (!memcmp(&entry->mask, mask, sizeof(*mask))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Keep a new kflow's mask within the mask budget
+ *
+ * If the budget is full and 'mask' is not in use, replaces it with the
+ * narrowest mask in use that covers it. Returns true if the mask was replaced.
+ */
+static bool
+kflow_mask_budget(struct ind_ovs_parsed_key *mask)
+{
+    if (ind_ovs_kflow_mask_budget == 0 ||
+            kflow_num_masks < ind_ovs_kflow_mask_budget) {
+        return false;
+    }
+
+    uint32_t hash = murmur_hash(mask, sizeof(*mask), ind_ovs_salt);
+    if (kflow_mask_find(mask, hash) != NULL) {
+        return false;
+    }
+
+    struct ind_ovs_kflow_mask *best = NULL;
+    int best_extra_bits = INT_MAX;
+
+    struct list_links *cur;
+    LIST_FOREACH(&kflow_masks, cur) {
+        struct ind_ovs_kflow_mask *entry =
+            container_of(cur, links, struct ind_ovs_kflow_mask);
+        /* The kernel rejects masks for attributes missing from the key */
+        if (entry->mask.populated != mask->populated ||
+                !kflow_mask_covers(&entry->mask, mask)) {
+            continue;
+        }
+        int extra_bits = kflow_mask_extra_bits(&entry->mask, mask);
+        if (extra_bits < best_extra_bits) {
+            best = entry;
+            best_extra_bits = extra_bits;
+        }
+    }
+
+    if (best == NULL) {
+        debug_counter_inc(&mask_over_budget);
+        return false;
+    }
+
+    *mask = best->mask;
+    debug_counter_inc(&mask_widened);
+    return true;
+}
+
+static void
+kflow_mask_ref(struct ind_ovs_kflow *kflow)
+{
+    uint32_t hash = murmur_hash(&kflow->mask, sizeof(kflow->mask), ind_ovs_salt);
+    struct ind_ovs_kflow_mask *entry = kflow_mask_find(&kflow->mask, hash);
+    if (entry == NULL) {
+        entry = aim_zmalloc(sizeof(*entry));
+        entry->hash = hash;
+        entry->mask = kflow->mask;
+        list_push(&kflow_masks, &entry->links);
+        taghash_insert(&kflow_mask_table, hash, entry);
+        kflow_num_masks++;
+    }
+
+    entry->refcount++;
+    kflow->mask_entry = entry;
+}
+
+static void
+kflow_mask_unref(struct ind_ovs_kflow *kflow)
+{
+    struct ind_ovs_kflow_mask *entry = kflow->mask_entry;
+    if (--entry->refcount == 0) {
+        list_remove(&entry->links);
+        taghash_remove(&kflow_mask_table, entry->hash, entry);
+        kflow_num_masks--;
+        aim_free(entry);
+    }
+}
+
+/* Add a kflow to the lookup structures */
+static void
+kflow_link(struct ind_ovs_kflow *kflow, const struct ind_ovs_parsed_key *pkey)
+{
+    kflow_mask_ref(kflow);
+    list_push(&ind_ovs_kflows, &kflow->global_links);
+    taghash_insert(&kflow_table, kflow->hash, kflow);
+    tcam_insert(megaflow_tcam, &kflow->tcam_entry, pkey, &kflow->mask, 0);
+}
+
 /* Find the kflow that would match the given key */
 static struct ind_ovs_kflow *
 kflow_match(const struct ind_ovs_parsed_key *key)
@@ -110,8 +757,15 @@ kflow_match(const struct ind_ovs_parsed_key *key)
     return container_of(tcam_entry, tcam_entry, struct ind_ovs_kflow);
 }
 
-indigo_error_t
-ind_ovs_kflow_add(const struct nlattr *key)
+/*
+ * Build and install a kflow for 'key'
+ *
+ * If 'expected' is given the kflow is only installed if the pipeline
+ * output matches the checkpointed kflow, otherwise INDIGO_ERROR_COMPAT is
+ * returned.
+ */
+static indigo_error_t
+kflow_add(const struct nlattr *key, const struct kflow_checkpoint_record *expected)
 {
     if (ind_ovs_hitless) {
         AIM_LOG_VERBOSE("Skipping kflow add during hitless restart");
@@ -131,12 +785,6 @@ ind_ovs_kflow_add(const struct nlattr *key)
         return INDIGO_ERROR_NONE;
     }
 
-    if (!ind_ovs_benchmark_mode && port->num_kflows >= IND_OVS_MAX_KFLOWS_PER_PORT) {
-        LOG_WARN("port %d (%s) exceeded allowed number of kernel flows", in_port, port->ifname);
-        debug_counter_inc(&add_kflow_limit);
-        return INDIGO_ERROR_RESOURCE;
-    }
-
     struct ind_ovs_parsed_key pkey;
     ind_ovs_parse_key((struct nlattr *)key, &pkey);
 
@@ -154,7 +802,7 @@ ind_ovs_kflow_add(const struct nlattr *key)
     struct ind_ovs_parsed_key mask;
     memset(&mask, 0, sizeof(mask));
 
-    struct ind_ovs_kflow *kflow = aim_malloc(sizeof(*kflow) + key->nla_len);
+    struct ind_ovs_kflow *kflow = kflow_alloc(key);
 
     struct xbuf *stats = &ind_ovs_kflow_stats_xbuf;
     xbuf_reset(stats);
@@ -166,9 +814,12 @@ ind_ovs_kflow_add(const struct nlattr *key)
     struct action_context actx;
     action_context_init(&actx, &pkey, &mask, msg);
 
+    xbuf_reset(&kflow_deps_xbuf);
+    pipeline_dependencies_set(&kflow_deps_xbuf);
     indigo_error_t err = pipeline_process(&pkey, &mask, stats, &actx);
+    pipeline_dependencies_set(NULL);
     if (err < 0) {
-        aim_free(kflow);
+        kflow_free(kflow);
         ind_ovs_nlmsg_freelist_free(msg);
         debug_counter_inc(&add_pipeline_failed);
         return err;
@@ -176,93 +827,190 @@ ind_ovs_kflow_add(const struct nlattr *key)
 
     ind_ovs_nla_nest_end(msg, actions);
 
+    if (expected && !kflow_checkpoint_matches(expected, actions, &mask)) {
+        kflow_free(kflow);
+        ind_ovs_nlmsg_freelist_free(msg);
+        debug_counter_inc(&warm_start_mismatch);
+        return INDIGO_ERROR_COMPAT;
+    }
+
+    /*
+     * Only make room once the kflow is known to be installable, so that a
+     * checkpointed kflow the pipeline no longer agrees with doesn't evict
+     * anything. Neither step touches the pipeline output above.
+     */
+    if (!ind_ovs_benchmark_mode &&
+            port->num_kflows >= ind_ovs_port_kflow_limit(port) &&
+            !kflow_evict(in_port)) {
+        kflow_free(kflow);
+        ind_ovs_nlmsg_freelist_free(msg);
+        LOG_WARN("port %d (%s) exceeded allowed number of kernel flows", in_port, port->ifname);
+        debug_counter_inc(&add_kflow_limit);
+        return INDIGO_ERROR_RESOURCE;
+    }
+
+    if (!kflow_install_reserve()) {
+        kflow_free(kflow);
+        ind_ovs_nlmsg_freelist_free(msg);
+        return INDIGO_ERROR_RESOURCE;
+    }
+
     if (!ind_ovs_disable_megaflows) {
+        kflow->mask_widened = kflow_mask_budget(&mask);
         struct nlattr *mask_attr = nla_nest_start(msg, OVS_FLOW_ATTR_MASK);
         assert(ATTR_BITMAP_TEST(mask.populated, OVS_KEY_ATTR_ETHERTYPE));
         ind_ovs_emit_key(&mask, msg, true);
         ind_ovs_nla_nest_end(msg, mask_attr);
     }
 
-    /* Copy actions before ind_ovs_transact() frees msg */
+    /* Copy actions before kflow_install_queue() frees msg */
     kflow->actions = aim_malloc(nla_len(actions));
     memcpy(kflow->actions, nla_data(actions), nla_len(actions));
     kflow->actions_len = nla_len(actions);
 
-    if (ind_ovs_transact(msg) < 0) {
-        AIM_LOG_ERROR("Failed to insert kernel flow");
-        debug_counter_inc(&add_kernel_failed);
-        aim_free(kflow->actions);
-        aim_free(kflow);
-        return INDIGO_ERROR_UNKNOWN;
-    }
+    kflow_install_queue(msg, kflow);
 
     kflow->last_used = monotonic_us()/1000;
+    kflow->hard_timeout = 0;
     kflow->in_port = in_port;
     kflow->stats.packets = 0;
     kflow->stats.bytes = 0;
     kflow->mask = mask;
 
-    memcpy(kflow->key, key, key->nla_len);
-
     struct stats_handle *stats_handles = xbuf_data(stats);
     int num_stats_handles = xbuf_length(stats) / sizeof(*stats_handles);
 
     kflow->num_stats_handles = num_stats_handles;
     kflow->stats_handles = aim_memdup(stats_handles, num_stats_handles * sizeof(*stats_handles));
 
-    uint32_t hash = key_hash(key);
-    struct list_head *bucket = &ind_ovs_kflow_buckets[hash % NUM_KFLOW_BUCKETS];
+    kflow_set_deps(kflow);
 
-    list_push(&ind_ovs_kflows, &kflow->global_links);
-    list_push(bucket, &kflow->bucket_links);
+    kflow->idle_shift = kflow_reinstall_check(kflow->hash, kflow->last_used);
 
-    tcam_insert(megaflow_tcam, &kflow->tcam_entry, &pkey, &mask, 0);
+    kflow_link(kflow, &pkey);
 
     port->num_kflows++;
 
     test_kflow_mask(kflow);
 
+    kflow_install_kick();
+
     return INDIGO_ERROR_NONE;
 }
 
-static void
-kflow_sync_stats(struct ind_ovs_kflow *kflow, struct nlattr *stats_attr,
-                 struct nlattr *used_attr)
+indigo_error_t
+ind_ovs_kflow_add(const struct nlattr *key)
 {
-    debug_counter_inc(&sync_stats);
-
-    if (stats_attr) {
-        struct ovs_flow_stats *stats = nla_data(stats_attr);
+    return kflow_add(key, NULL);
+}
 
-        uint64_t packet_diff = stats->n_packets - kflow->stats.packets;
-        uint64_t byte_diff = stats->n_bytes - kflow->stats.bytes;
+/*
+ * Install an exact match kflow with no actions for the given key
+ *
+ * Used by overloaded upcall processes to shed load from a port in the kernel.
+ * The kflow is deleted after IND_OVS_KFLOW_DROP_TIMEOUT_MS or when it is
+ * revalidated, whichever comes first.
+ */
+indigo_error_t
+ind_ovs_kflow_add_drop(const struct nlattr *key)
+{
+    if (ind_ovs_hitless) {
+        AIM_LOG_VERBOSE("Skipping kflow add during hitless restart");
+        return INDIGO_ERROR_NONE;
+    }
 
-        if (packet_diff > 0 || byte_diff > 0) {
-            int i;
-            for (i = 0; i < kflow->num_stats_handles; i++) {
-                stats_inc(ind_ovs_kflow_stats_writer,
-                          &kflow->stats_handles[i],
-                          packet_diff, byte_diff);
-            }
+    debug_counter_inc(&add_drop);
 
-            kflow->stats.packets = stats->n_packets;
-            kflow->stats.bytes = stats->n_bytes;
-        }
+    struct nlattr *in_port_attr = nla_find(nla_data(key), nla_len(key), OVS_KEY_ATTR_IN_PORT);
+    assert(in_port_attr);
+    uint32_t in_port = nla_get_u32(in_port_attr);
+    struct ind_ovs_port *port = ind_ovs_ports[in_port];
+    if (port == NULL) {
+        debug_counter_inc(&add_invalid_port);
+        return INDIGO_ERROR_NONE;
     }
 
-    if (used_attr) {
-        uint64_t used = nla_get_u64(used_attr);
-        if (used > kflow->last_used) {
-            kflow->last_used = used;
-        }
+    /* Don't evict kflows carrying traffic to make room for drops */
+    if (port->num_kflows >= ind_ovs_port_kflow_limit(port)) {
+        debug_counter_inc(&add_kflow_limit);
+        return INDIGO_ERROR_RESOURCE;
     }
-}
 
-void
-ind_ovs_kflow_sync_stats(struct ind_ovs_kflow *kflow)
-{
-    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_GET);
-    nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
+    struct ind_ovs_parsed_key pkey;
+    ind_ovs_parse_key((struct nlattr *)key, &pkey);
+
+    if (kflow_match(&pkey) != NULL) {
+        debug_counter_inc(&add_exists);
+        return INDIGO_ERROR_NONE;
+    }
+
+    if (!kflow_install_reserve()) {
+        return INDIGO_ERROR_RESOURCE;
+    }
+
+    /* No mask attribute, so the kernel treats this as an exact match */
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_NEW);
+    nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(key), nla_data(key));
+    struct nlattr *actions = nla_nest_start(msg, OVS_FLOW_ATTR_ACTIONS);
+    ind_ovs_nla_nest_end(msg, actions);
+
+    struct ind_ovs_kflow *kflow = kflow_alloc(key);
+    kflow_install_queue(msg, kflow);
+
+    kflow->last_used = monotonic_us()/1000;
+    kflow->hard_timeout = kflow->last_used + IND_OVS_KFLOW_DROP_TIMEOUT_MS;
+    kflow->in_port = in_port;
+    memset(&kflow->mask, 0xff, sizeof(kflow->mask));
+
+    kflow_link(kflow, &pkey);
+
+    port->num_kflows++;
+
+    kflow_install_kick();
+
+    return INDIGO_ERROR_NONE;
+}
+
+static void
+kflow_sync_stats(struct ind_ovs_kflow *kflow, struct nlattr *stats_attr,
+                 struct nlattr *used_attr)
+{
+    debug_counter_inc(&sync_stats);
+
+    if (stats_attr) {
+        struct ovs_flow_stats *stats = nla_data(stats_attr);
+
+        uint64_t packet_diff = stats->n_packets - kflow->stats.packets;
+        uint64_t byte_diff = stats->n_bytes - kflow->stats.bytes;
+
+        if (packet_diff > 0 || byte_diff > 0) {
+            int i;
+            for (i = 0; i < kflow->num_stats_handles; i++) {
+                stats_inc(ind_ovs_kflow_stats_writer,
+                          &kflow->stats_handles[i],
+                          packet_diff, byte_diff);
+            }
+
+            kflow->referenced = true;
+
+            kflow->stats.packets = stats->n_packets;
+            kflow->stats.bytes = stats->n_bytes;
+        }
+    }
+
+    if (used_attr) {
+        uint64_t used = nla_get_u64(used_attr);
+        if (used > kflow->last_used) {
+            kflow->last_used = used;
+        }
+    }
+}
+
+void
+ind_ovs_kflow_sync_stats(struct ind_ovs_kflow *kflow)
+{
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_GET);
+    nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
 
     struct nlmsghdr *reply;
     if (ind_ovs_transact_reply(msg, &reply) < 0) {
@@ -293,10 +1041,12 @@ ind_ovs_kflow_sync_stats(struct ind_ovs_kflow *kflow)
 static void
 ind_ovs_kflow_delete(struct ind_ovs_kflow *kflow)
 {
-    struct ind_ovs_port *port = ind_ovs_ports[kflow->in_port];
-    if (port) {
-        port->num_kflows--;
-    }
+    /*
+     * The GET and DEL below go out on another socket and could overtake a
+     * request still in flight on the install socket. Callers skip such
+     * kflows; revalidation uses kflow_delete_async instead.
+     */
+    AIM_ASSERT(!kflow->install_pending);
 
     /*
      * Packets could match the kernel flow in the time between syncing stats
@@ -308,186 +1058,1813 @@ ind_ovs_kflow_delete(struct ind_ovs_kflow *kflow)
     nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
     (void) ind_ovs_transact(msg);
 
+    kflow_forget(kflow);
+
+    debug_counter_inc(&delete);
+}
+
+/*
+ * Remove the given kflow from the userspace tables and free it, without
+ * touching the kernel flow table.
+ */
+static void
+kflow_forget(struct ind_ovs_kflow *kflow)
+{
+    struct ind_ovs_port *port = ind_ovs_ports[kflow->in_port];
+    if (port) {
+        port->num_kflows--;
+    }
+
+    if (kflow->revalidate_index != UINT32_MAX) {
+        kflow_revalidate_array[kflow->revalidate_index] = NULL;
+        kflow_revalidate_status.remaining--;
+    }
+
+    if (kflow_expire_cursor == &kflow->global_links) {
+        kflow_expire_cursor = kflow->global_links.next;
+    }
+
+    if (kflow_evict_hand == &kflow->global_links) {
+        kflow_evict_hand = kflow->global_links.next;
+    }
+
+    int i;
+    for (i = 0; i < kflow_expire_batch_len; i++) {
+        if (kflow_expire_batch[i] == kflow) {
+            kflow_expire_batch[i] = NULL;
+        }
+    }
+
+    kflow_mask_unref(kflow);
     list_remove(&kflow->global_links);
-    list_remove(&kflow->bucket_links);
+    taghash_remove(&kflow_table, kflow->hash, kflow);
     tcam_remove(megaflow_tcam, &kflow->tcam_entry);
     aim_free(kflow->actions);
     aim_free(kflow->stats_handles);
-    aim_free(kflow);
-
-    debug_counter_inc(&delete);
+    aim_free(kflow->deps);
+    kflow_free(kflow);
 }
 
 /*
- * Run the given kflow's key through the flowtable. If it matches a flow
- * then update the actions, otherwise delete it.
+ * Advance the eviction hand to the next victim with the given input port and
+ * delete it. Returns false if none was found.
  */
-void
-ind_ovs_kflow_invalidate(struct ind_ovs_kflow *kflow)
+static bool
+kflow_evict_one(uint32_t in_port)
 {
-    debug_counter_inc(&revalidate);
+    struct list_links *head = &ind_ovs_kflows.links;
+    struct list_links *cur = kflow_evict_hand ? kflow_evict_hand : head->next;
 
-    struct ind_ovs_parsed_key pkey;
-    ind_ovs_parse_key(kflow->key, &pkey);
-
-    struct ind_ovs_parsed_key mask;
-    memset(&mask, 0, sizeof(mask));
+    int i;
+    for (i = 0; i < KFLOW_EVICT_MAX_SCAN; i++) {
+        if (cur == head) {
+            cur = head->next;
+            if (cur == head) {
+                break;
+            }
+        }
 
-    struct xbuf *stats = &ind_ovs_kflow_stats_xbuf;
-    xbuf_reset(stats);
+        struct ind_ovs_kflow *kflow = container_of(cur, global_links, struct ind_ovs_kflow);
+        cur = cur->next;
 
-    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_SET);
-    nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
-    struct nlattr *actions = nla_nest_start(msg, OVS_FLOW_ATTR_ACTIONS);
+        if (kflow->in_port != in_port || kflow->install_pending) {
+            continue;
+        }
 
-    struct action_context actx;
-    action_context_init(&actx, &pkey, &mask, msg);
+        if (kflow->referenced) {
+            kflow->referenced = false;
+            continue;
+        }
 
-    indigo_error_t err = pipeline_process(&pkey, &mask, stats, &actx);
-    if (err < 0) {
+        kflow_evict_hand = cur;
         ind_ovs_kflow_delete(kflow);
-        ind_ovs_nlmsg_freelist_free(msg);
-        return;
+        debug_counter_inc(&evict);
+        return true;
     }
 
-    ind_ovs_nla_nest_end(msg, actions);
+    kflow_evict_hand = cur;
+    return false;
+}
 
-    if (memcmp(&mask, &kflow->mask, sizeof(mask))) {
-        LOG_VERBOSE("Mask changed, deleting kernel flow");
-        debug_counter_inc(&revalidate_mask_changed);
-        ind_ovs_nlmsg_freelist_free(msg);
-        ind_ovs_kflow_delete(kflow);
-        return;
+/*
+ * Make room for a new kflow with the given input port, which is at its kflow
+ * limit. Returns false if no kflow could be evicted.
+ *
+ * See the description of eviction at the top of this file.
+ */
+static bool
+kflow_evict(uint32_t in_port)
+{
+    struct ind_ovs_port *port = ind_ovs_ports[in_port];
+    if (port->num_kflows < ind_ovs_port_kflow_limit(port)) {
+        return true;
     }
 
-    struct stats_handle *stats_handles = xbuf_data(stats);
-    int num_stats_handles = xbuf_length(stats) / sizeof(*stats_handles);
-    size_t stats_handles_len = num_stats_handles * sizeof(*stats_handles);
-    if (num_stats_handles != kflow->num_stats_handles ||
-            memcmp(stats_handles, kflow->stats_handles, stats_handles_len)) {
-        /* Synchronize stats to previous OpenFlow flows */
-        ind_ovs_kflow_sync_stats(kflow);
-        if (num_stats_handles != kflow->num_stats_handles) {
-            kflow->num_stats_handles = num_stats_handles;
-            kflow->stats_handles = aim_realloc(kflow->stats_handles, stats_handles_len);
-        }
-        memcpy(kflow->stats_handles, stats_handles, stats_handles_len);
+    if (!kflow_evict_one(in_port)) {
+        return false;
     }
 
-    bool actions_changed = nla_len(actions) != kflow->actions_len ||
-        memcmp(nla_data(actions), kflow->actions, nla_len(actions));
+    /* Converge on a lowered limit by evicting an extra kflow */
+    if (port->num_kflows >= ind_ovs_port_kflow_limit(port)) {
+        (void) kflow_evict_one(in_port);
+    }
 
-    if (actions_changed) {
-        debug_counter_inc(&revalidate_actions_changed);
+    return true;
+}
 
-        if (!ind_ovs_disable_megaflows) {
-            struct nlattr *mask_attr = nla_nest_start(msg, OVS_FLOW_ATTR_MASK);
-            assert(ATTR_BITMAP_TEST(mask.populated, OVS_KEY_ATTR_ETHERTYPE));
-            ind_ovs_emit_key(&mask, msg, true);
-            ind_ovs_nla_nest_end(msg, mask_attr);
-        }
+/* Number of requests sent or queued that haven't been completed */
+static inline uint32_t
+kflow_install_in_flight(void)
+{
+    return kflow_install_tail - kflow_install_head;
+}
 
-        if (ind_ovs_transact(msg) < 0) {
-            LOG_ERROR("Failed to modify kernel flow, deleting it");
-            debug_counter_inc(&revalidate_kernel_failed);
-            ind_ovs_kflow_delete(kflow);
-            return;
+/*
+ * Make room for a new install request
+ *
+ * Must be called before linking a new kflow or taking an existing one from
+ * the tables, since flushing may remove failed kflows from the tables.
+ * Returns false if too many requests are in flight.
+ */
+static bool
+kflow_install_reserve(void)
+{
+    if (kflow_install_in_flight() >= KFLOW_INSTALL_MAX_IN_FLIGHT) {
+        kflow_install_flush();
+        if (kflow_install_in_flight() >= KFLOW_INSTALL_MAX_IN_FLIGHT) {
+            debug_counter_inc(&install_backlog_full);
+            return false;
         }
+    }
+
+    return true;
+}
+
+/* Add a request to the batch and the ring. Frees msg. */
+static struct kflow_install_request *
+kflow_install_append(struct nl_msg *msg)
+{
+    AIM_ASSERT(kflow_install_in_flight() < KFLOW_INSTALL_MAX_IN_FLIGHT);
 
-        if (actions_changed) {
-            kflow->actions = aim_realloc(kflow->actions, nla_len(actions));
-            memcpy(kflow->actions, nla_data(actions), nla_len(actions));
-            kflow->actions_len = nla_len(actions);
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    nlh->nlmsg_seq = ++kflow_install_seq;
+    nlh->nlmsg_pid = nl_socket_get_local_port(kflow_install_socket);
+    nlh->nlmsg_flags |= NLM_F_REQUEST;
+
+    struct kflow_install_request *req =
+        &kflow_install_requests[kflow_install_tail++ % KFLOW_INSTALL_MAX_IN_FLIGHT];
+    memset(req, 0, sizeof(*req));
+    req->seq = kflow_install_seq;
+    req->cmd = ((struct genlmsghdr *)nlmsg_data(nlh))->cmd;
+
+    kflow_install_last = xbuf_length(&kflow_install_buf);
+    xbuf_append(&kflow_install_buf, nlh, NLMSG_ALIGN(nlh->nlmsg_len));
+    ind_ovs_nlmsg_freelist_free(msg);
+    kflow_install_queued++;
+
+    if (!kflow_install_task_registered) {
+        if (ind_soc_task_register(kflow_install_task, NULL, IND_SOC_NORMAL_PRIORITY) < 0) {
+            AIM_DIE("Failed to create long running task for kflow installation");
         }
-    } else {
-        ind_ovs_nlmsg_freelist_free(msg);
+        kflow_install_task_registered = true;
     }
 
-    test_kflow_mask(kflow);
+    return req;
 }
 
 /*
- * Invalidate all kernel flows
+ * Queue an OVS_FLOW_CMD_NEW, SET or GET request for the given kflow. Frees
+ * msg.
+ *
+ * The request is sent by kflow_install_kick or the install task, so the
+ * caller can finish setting up the kflow first.
  */
-void
-ind_ovs_kflow_invalidate_all(void)
+static void
+kflow_install_queue(struct nl_msg *msg, struct ind_ovs_kflow *kflow)
 {
-    if (ind_ovs_hitless) {
-        AIM_LOG_VERBOSE("Skipping kflow revalidation during hitless restart");
-        return;
+    struct kflow_install_request *req = kflow_install_append(msg);
+    req->kflow = kflow;
+    kflow->install_pending = true;
+}
+
+/*
+ * Queue a request that echoes the kflow's flow and move the kflow's stats
+ * handles to it, so the stats counted since the last sync still go to them.
+ * The caller links the request to the kflow, if it stays. Frees msg.
+ */
+static struct kflow_install_request *
+kflow_install_queue_echo(struct nl_msg *msg, struct ind_ovs_kflow *kflow)
+{
+    nlmsg_hdr(msg)->nlmsg_flags |= NLM_F_ECHO;
+
+    struct kflow_install_request *req = kflow_install_append(msg);
+    req->stats = kflow->stats;
+    req->num_stats_handles = kflow->num_stats_handles;
+    req->stats_handles = kflow->stats_handles;
+    kflow->num_stats_handles = 0;
+    kflow->stats_handles = NULL;
+
+    return req;
+}
+
+/* Send the queued requests if there are enough for a full batch */
+static void
+kflow_install_kick(void)
+{
+    if (kflow_install_queued >= KFLOW_INSTALL_BATCH_SIZE) {
+        kflow_install_flush();
     }
+}
 
-    if (list_empty(&ind_ovs_kflows)) {
+/*
+ * Add the stats counted since the request was queued to the stats handles
+ * it took over, using the flow echoed in 'nlh'
+ */
+static void
+kflow_install_sync_stats(struct kflow_install_request *req, struct nlmsghdr *nlh)
+{
+    struct nlattr *attrs[OVS_FLOW_ATTR_MAX+1];
+    if (genlmsg_parse(nlh, sizeof(struct ovs_header),
+                      attrs, OVS_FLOW_ATTR_MAX, NULL) < 0 ||
+            attrs[OVS_FLOW_ATTR_STATS] == NULL) {
+        debug_counter_inc(&sync_stats_failed);
         return;
     }
 
-    uint64_t start_time = monotonic_us();
-    int count = 0;
-    struct list_links *cur, *next;
-    LIST_FOREACH_SAFE(&ind_ovs_kflows, cur, next) {
-        struct ind_ovs_kflow *kflow = container_of(cur, global_links, struct ind_ovs_kflow);
-        ind_ovs_kflow_invalidate(kflow);
-        count++;
+    struct ovs_flow_stats *stats = nla_data(attrs[OVS_FLOW_ATTR_STATS]);
+    struct ind_ovs_kflow *kflow = req->kflow;
+
+    if (kflow) {
+        if (kflow->stats.packets != req->stats.packets ||
+                kflow->stats.bytes != req->stats.bytes) {
+            /* Synced meanwhile, the packets went to the new handles */
+            return;
+        }
+        kflow->stats.packets = stats->n_packets;
+        kflow->stats.bytes = stats->n_bytes;
+    }
+
+    debug_counter_inc(&sync_stats);
+
+    uint64_t packet_diff = stats->n_packets - req->stats.packets;
+    uint64_t byte_diff = stats->n_bytes - req->stats.bytes;
+
+    int i;
+    for (i = 0; i < req->num_stats_handles; i++) {
+        stats_inc(ind_ovs_kflow_stats_writer, &req->stats_handles[i],
+                  packet_diff, byte_diff);
     }
-    uint64_t end_time = monotonic_us();
-    uint64_t elapsed = end_time - start_time;
-    LOG_VERBOSE("invalidated %d kernel flows in %d us (%.3f us/flow)",
-                count, elapsed, (float)elapsed/count);
-    debug_counter_add(&revalidate_time, elapsed);
 }
 
-static int
-kflow_expire(struct nl_msg *msg, void *arg)
+/* Handle an error from the kernel for the given request */
+static void
+kflow_install_failed(struct kflow_install_request *req, int err)
 {
-    uint64_t cur_time = monotonic_us()/1000;
+    struct ind_ovs_kflow *kflow = req->kflow;
+
+    if (req->cmd == OVS_FLOW_CMD_SET) {
+        /* The kernel flow may still have its old actions */
+        AIM_LOG_ERROR("Failed to modify kernel flow, deleting it: %s", strerror(-err));
+        debug_counter_inc(&revalidate_kernel_failed);
+        kflow_delete_async(kflow);
+    } else {
+        AIM_LOG_ERROR("Failed to insert kernel flow: %s", strerror(-err));
+        debug_counter_inc(&add_kernel_failed);
+        kflow_install_detach(kflow);
+        kflow_forget(kflow);
+    }
+}
+
+/*
+ * Complete all requests up to and including 'seq'. 'err' is the result of
+ * 'seq' itself; earlier requests succeeded, or we'd have seen their errors.
+ * 'nlh' is the flow echoed in reply to 'seq', if any.
+ */
+static void
+kflow_install_complete(uint32_t seq, int err, struct nlmsghdr *nlh)
+{
+    while (kflow_install_in_flight() > 0) {
+        struct kflow_install_request *req =
+            &kflow_install_requests[kflow_install_head % KFLOW_INSTALL_MAX_IN_FLIGHT];
+        if ((int32_t)(req->seq - seq) > 0) {
+            break;
+        }
+
+        kflow_install_head++;
+
+        if (req->stats_handles) {
+            if (req->seq == seq && nlh) {
+                kflow_install_sync_stats(req, nlh);
+            }
+            aim_free(req->stats_handles);
+            req->stats_handles = NULL;
+        }
+
+        if (req->kflow == NULL) {
+            continue;
+        }
+
+        req->kflow->install_pending = false;
+
+        if (req->seq == seq && err < 0) {
+            kflow_install_failed(req, err);
+        }
+    }
+}
+
+/*
+ * Give up on a request that was never sent. 'nlh' is the request itself.
+ *
+ * Only an install never reached the kernel; for the other requests the
+ * kernel flow is deleted so that it doesn't outlive the kflow.
+ */
+static void
+kflow_install_drop(struct kflow_install_request *req, struct nlmsghdr *nlh)
+{
+    aim_free(req->stats_handles);
+    req->stats_handles = NULL;
+
+    if (req->kflow) {
+        debug_counter_inc(&add_kernel_failed);
+        struct ind_ovs_kflow *kflow = req->kflow;
+        kflow_install_detach(kflow);
+        kflow_forget(kflow);
+    }
+
+    if (req->cmd == OVS_FLOW_CMD_NEW) {
+        return;
+    }
 
-    struct nlmsghdr *nlh = nlmsg_hdr(msg);
     struct nlattr *attrs[OVS_FLOW_ATTR_MAX+1];
     if (genlmsg_parse(nlh, sizeof(struct ovs_header),
-                      attrs, OVS_FLOW_ATTR_MAX, NULL) < 0) {
-        abort();
+                      attrs, OVS_FLOW_ATTR_MAX, NULL) < 0 ||
+            attrs[OVS_FLOW_ATTR_KEY] == NULL) {
+        return;
     }
 
-    struct ind_ovs_kflow *kflow = kflow_lookup(attrs[OVS_FLOW_ATTR_KEY]);
-    if (kflow) {
-        /* Might have expired, ask the kernel for the real last_used time. */
-        kflow_sync_stats(kflow, attrs[OVS_FLOW_ATTR_STATS], attrs[OVS_FLOW_ATTR_USED]);
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_DEL);
+    nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(attrs[OVS_FLOW_ATTR_KEY]),
+            nla_data(attrs[OVS_FLOW_ATTR_KEY]));
+    (void) ind_ovs_transact(msg);
+}
 
-        if ((cur_time - kflow->last_used) >= IND_OVS_KFLOW_EXPIRATION_MS) {
-            LOG_VERBOSE("expiring kflow");
-            ind_ovs_kflow_delete(kflow);
+/*
+ * Replies were dropped because the socket buffer was full. Ask the kernel
+ * about each kflow whose request was sent instead.
+ *
+ * The GET requests are queued on the install socket behind any requests not
+ * sent yet, and go out as one batch. Each GET is answered by either the flow
+ * or an error, which completes it like the reply to an install request. If
+ * those replies are lost too the remaining kflows are asked about again.
+ */
+static void
+kflow_install_recheck(void)
+{
+    debug_counter_inc(&install_reply_lost);
+
+    uint32_t num_sent = kflow_install_in_flight() - kflow_install_queued;
+    struct ind_ovs_kflow *kflows[num_sent ? num_sent : 1];
+    uint32_t num_kflows = 0;
+    uint32_t i;
+
+    for (i = 0; i < num_sent; i++) {
+        struct kflow_install_request *req =
+            &kflow_install_requests[kflow_install_head++ % KFLOW_INSTALL_MAX_IN_FLIGHT];
+        /* The kernel processed the request, only its stats echo is lost */
+        aim_free(req->stats_handles);
+        req->stats_handles = NULL;
+        if (req->kflow != NULL) {
+            kflows[num_kflows++] = req->kflow;
         }
     }
 
-    return NL_OK;
+    /* Requests not sent yet are now at the head, so the ring stays in order */
+    for (i = 0; i < num_kflows; i++) {
+        struct ind_ovs_kflow *kflow = kflows[i];
+        struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_GET);
+        nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
+        kflow_install_queue(msg, kflow);
+    }
 }
 
-static int
-kflow_expire_recv(struct nl_sock *sk, struct sockaddr_nl *nla,
-                  unsigned char **buf, struct ucred **creds)
+/* Process replies to install requests */
+static void
+kflow_install_recv(void)
+{
+    static char buf[IND_OVS_DEFAULT_MSG_SIZE];
+    int fd = nl_socket_get_fd(kflow_install_socket);
+
+    while (kflow_install_in_flight() > kflow_install_queued) {
+        int n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            } else if (err == ENOBUFS) {
+                kflow_install_recheck();
+            } else if (err != EAGAIN) {
+                AIM_LOG_ERROR("Error on kflow install socket: %s", strerror(err));
+            }
+            break;
+        }
+
+        struct nlmsghdr *nlh = (void *)buf;
+        while (nlmsg_ok(nlh, n)) {
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = nlmsg_data(nlh);
+                kflow_install_complete(nlh->nlmsg_seq, err->error, NULL);
+            } else if (nlh->nlmsg_type == ovs_flow_family) {
+                /* Answer to a GET or an echo of a SET or DEL */
+                kflow_install_complete(nlh->nlmsg_seq, 0, nlh);
+            }
+            nlh = nlmsg_next(nlh, &n);
+        }
+    }
+}
+
+/* Send all queued install requests and process the replies */
+static void
+kflow_install_flush(void)
+{
+    if (kflow_install_queued > 0) {
+        struct nlmsghdr *last = xbuf_data(&kflow_install_buf) + kflow_install_last;
+        last->nlmsg_flags |= NLM_F_ACK;
+
+        debug_counter_inc(&install_batch);
+
+        /*
+         * The kernel processes the whole batch before send returns, so the
+         * replies are normally ready to read below.
+         */
+        int fd = nl_socket_get_fd(kflow_install_socket);
+        if (send(fd, xbuf_data(&kflow_install_buf), xbuf_length(&kflow_install_buf), 0) < 0) {
+            AIM_LOG_ERROR("Failed to send kflow install batch: %s", strerror(errno));
+            /* The batch is the newest requests, drop them */
+            struct nlmsghdr *nlh = xbuf_data(&kflow_install_buf);
+            int len = xbuf_length(&kflow_install_buf);
+            uint32_t first = kflow_install_tail - kflow_install_queued;
+            uint32_t i;
+            for (i = first; i != kflow_install_tail; i++) {
+                kflow_install_drop(
+                    &kflow_install_requests[i % KFLOW_INSTALL_MAX_IN_FLIGHT], nlh);
+                nlh = nlmsg_next(nlh, &len);
+            }
+            kflow_install_tail = first;
+        }
+
+        xbuf_reset(&kflow_install_buf);
+        kflow_install_queued = 0;
+    }
+
+    kflow_install_recv();
+}
+
+static ind_soc_task_status_t
+kflow_install_task(void *cookie)
+{
+    kflow_install_task_registered = false;
+    kflow_install_flush();
+    return IND_SOC_TASK_FINISHED;
+}
+
+static void
+kflow_install_sock_ready(int fd, void *cookie,
+                         int read_ready, int write_ready, int error_seen)
+{
+    kflow_install_recv();
+}
+
+/*
+ * Stop tracking every request sent or queued, assuming they succeeded
+ *
+ * Kflows whose install actually failed are left in the userspace tables.
+ * Callers must be prepared to find them missing from the kernel.
+ */
+static void
+kflow_install_abandon(void)
+{
+    while (kflow_install_in_flight() > 0) {
+        struct kflow_install_request *req =
+            &kflow_install_requests[kflow_install_head++ % KFLOW_INSTALL_MAX_IN_FLIGHT];
+        aim_free(req->stats_handles);
+        req->stats_handles = NULL;
+        if (req->kflow) {
+            req->kflow->install_pending = false;
+        }
+    }
+}
+
+/* Stop tracking the requests in flight for this kflow */
+static void
+kflow_install_detach(struct ind_ovs_kflow *kflow)
+{
+    uint32_t i;
+    for (i = kflow_install_head; i != kflow_install_tail; i++) {
+        struct kflow_install_request *req =
+            &kflow_install_requests[i % KFLOW_INSTALL_MAX_IN_FLIGHT];
+        if (req->kflow == kflow) {
+            req->kflow = NULL;
+        }
+    }
+    kflow->install_pending = false;
+}
+
+/*
+ * Delete the kflow with an OVS_FLOW_CMD_DEL on the install socket and remove
+ * it from the userspace tables without waiting for the kernel. The caller
+ * must have made room with kflow_install_reserve.
+ */
+static void
+kflow_delete_async(struct ind_ovs_kflow *kflow)
+{
+    /* Requests already queued for it go out first */
+    kflow_install_detach(kflow);
+
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_DEL);
+    nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
+    (void) kflow_install_queue_echo(msg, kflow);
+
+    kflow_forget(kflow);
+
+    debug_counter_inc(&delete);
+}
+
+/*
+ * Run the given kflow's key through the pipeline
+ *
+ * The actions are written to 'msg' and the stats handles and dependencies
+ * are left in ind_ovs_kflow_stats_xbuf and kflow_deps_xbuf.
+ */
+static indigo_error_t
+kflow_revalidate_compute(struct ind_ovs_kflow *kflow,
+                         struct ind_ovs_parsed_key *mask,
+                         struct nl_msg *msg, struct nlattr **actions)
+{
+    struct ind_ovs_parsed_key pkey;
+    ind_ovs_parse_key(kflow->key, &pkey);
+
+    memset(mask, 0, sizeof(*mask));
+
+    xbuf_reset(&ind_ovs_kflow_stats_xbuf);
+    xbuf_reset(&kflow_deps_xbuf);
+
+    *actions = nla_nest_start(msg, OVS_FLOW_ATTR_ACTIONS);
+
+    struct action_context actx;
+    action_context_init(&actx, &pkey, mask, msg);
+
+    pipeline_dependencies_set(&kflow_deps_xbuf);
+    indigo_error_t err = pipeline_process(&pkey, mask, &ind_ovs_kflow_stats_xbuf, &actx);
+    pipeline_dependencies_set(NULL);
+    if (err < 0) {
+        return err;
+    }
+
+    ind_ovs_nla_nest_end(msg, *actions);
+
+    return INDIGO_ERROR_NONE;
+}
+
+/*
+ * Apply the result of running a kflow's key through the pipeline
+ *
+ * Deletes the kflow if the mask changed, otherwise updates its actions and
+ * stats handles. The kernel is updated through the install socket, and the
+ * caller must have made room with kflow_install_reserve.
+ */
+static void
+kflow_revalidate_update(struct ind_ovs_kflow *kflow,
+                        const struct ind_ovs_parsed_key *mask,
+                        const void *actions, int actions_len,
+                        const struct stats_handle *stats_handles, int num_stats_handles,
+                        const void * const *deps, uint32_t num_deps)
+{
+    bool mask_changed = kflow->adopted || kflow->mask_widened ?
+        !kflow_mask_covers(&kflow->mask, mask) :
+        memcmp(mask, &kflow->mask, sizeof(*mask)) != 0;
+
+    if (mask_changed) {
+        LOG_VERBOSE("Mask changed, deleting kernel flow");
+        debug_counter_inc(&revalidate_mask_changed);
+        kflow_delete_async(kflow);
+        return;
+    }
+
+    kflow->deps = aim_realloc(kflow->deps, num_deps * sizeof(*deps));
+    memcpy(kflow->deps, deps, num_deps * sizeof(*deps));
+    kflow->num_deps = num_deps;
+
+    size_t stats_handles_len = num_stats_handles * sizeof(*stats_handles);
+    bool stats_handles_changed = num_stats_handles != kflow->num_stats_handles ||
+        memcmp(stats_handles, kflow->stats_handles, stats_handles_len);
+
+    bool actions_changed = actions_len != kflow->actions_len ||
+        memcmp(actions, kflow->actions, actions_len);
+
+    struct nl_msg *msg = NULL;
+
+    if (actions_changed) {
+        debug_counter_inc(&revalidate_actions_changed);
+
+        msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_SET);
+        nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
+        nla_put(msg, OVS_FLOW_ATTR_ACTIONS, actions_len, actions);
+
+        if (!ind_ovs_disable_megaflows) {
+            struct nlattr *mask_attr = nla_nest_start(msg, OVS_FLOW_ATTR_MASK);
+            assert(ATTR_BITMAP_TEST(mask->populated, OVS_KEY_ATTR_ETHERTYPE));
+            ind_ovs_emit_key(mask, msg, true);
+            ind_ovs_nla_nest_end(msg, mask_attr);
+        }
+
+        kflow->actions = aim_realloc(kflow->actions, actions_len);
+        memcpy(kflow->actions, actions, actions_len);
+        kflow->actions_len = actions_len;
+    } else if (stats_handles_changed) {
+        msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_GET);
+        nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
+    }
+
+    if (stats_handles_changed) {
+        /* The echo synchronizes stats to previous OpenFlow flows */
+        struct kflow_install_request *req = kflow_install_queue_echo(msg, kflow);
+        req->kflow = kflow;
+        kflow->install_pending = true;
+        kflow->num_stats_handles = num_stats_handles;
+        kflow->stats_handles = aim_memdup((void *)stats_handles, stats_handles_len);
+    } else if (msg) {
+        kflow_install_queue(msg, kflow);
+    }
+
+    test_kflow_mask(kflow);
+}
+
+/*
+ * Run the given kflow's key through the flowtable. If it matches a flow
+ * then update the actions, otherwise delete it.
+ *
+ * The caller must have made room with kflow_install_reserve.
+ */
+void
+ind_ovs_kflow_invalidate(struct ind_ovs_kflow *kflow)
+{
+    debug_counter_inc(&revalidate);
+
+    /* Drop kflows don't come from the pipeline, let the upcall path decide */
+    if (kflow->hard_timeout) {
+        kflow_delete_async(kflow);
+        return;
+    }
+
+    struct ind_ovs_parsed_key mask;
+    struct nlattr *actions;
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_SET);
+
+    if (kflow_revalidate_compute(kflow, &mask, msg, &actions) < 0) {
+        kflow_delete_async(kflow);
+        ind_ovs_nlmsg_freelist_free(msg);
+        return;
+    }
+
+    kflow_revalidate_update(kflow, &mask, nla_data(actions), nla_len(actions),
+                            xbuf_data(&ind_ovs_kflow_stats_xbuf),
+                            xbuf_length(&ind_ovs_kflow_stats_xbuf) / sizeof(struct stats_handle),
+                            xbuf_data(&kflow_deps_xbuf),
+                            xbuf_length(&kflow_deps_xbuf) / sizeof(void *));
+
+    ind_ovs_nlmsg_freelist_free(msg);
+}
+
+/*
+ * Record that 'object' changed, see pipeline_add_dependency
+ */
+void
+ind_ovs_kflow_mark_dirty(const void *object)
+{
+    uint32_t bit = dirty_bit(object);
+    kflow_dirty.bits[bit/64] |= 1ULL << (bit % 64);
+    kflow_dirty.any = true;
+    kflow_generation++;
+    kflow_stats_snapshot_invalidate();
+}
+
+/*
+ * Record a change that may affect any kflow
+ */
+void
+ind_ovs_kflow_mark_all_dirty(void)
+{
+    kflow_dirty.all = true;
+    kflow_generation++;
+    kflow_stats_snapshot_invalidate();
+}
+
+uint64_t
+ind_ovs_kflow_generation(void)
+{
+    return kflow_generation;
+}
+
+static void
+kflow_revalidate_schedule(void)
+{
+    if (kflow_revalidate_running && !kflow_revalidate_task_registered &&
+            kflow_revalidate_status.workers_active == 0) {
+        if (ind_soc_task_register(kflow_revalidate_task, NULL,
+                                  IND_SOC_NORMAL_PRIORITY) < 0) {
+            AIM_DIE("Failed to create long running task for kflow revalidation");
+        }
+        kflow_revalidate_task_registered = true;
+    }
+}
+
+static void
+kflow_revalidate_write(int fd, struct xbuf *buf)
+{
+    char *data = xbuf_data(buf);
+    uint32_t len = xbuf_length(buf);
+
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* The main process will revalidate the rest itself */
+            _exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+
+    xbuf_reset(buf);
+}
+
+/*
+ * Worker process: revalidate every 'stride'th kflow starting at 'first'
+ *
+ * Runs in a fork of the main process, so the kflows and pipeline are a
+ * snapshot taken at the start of the pass. Nothing here may touch the
+ * kernel flow table.
+ */
+static void
+kflow_revalidate_worker_main(int index, int fd, uint32_t first, uint32_t stride)
+{
+    char threadname[16];
+    snprintf(threadname, sizeof(threadname), "ivs reval %d", index);
+    pthread_setname_np(pthread_self(), threadname);
+
+    /* Ask the kernel to send us a SIGKILL if the main process dies */
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0) < 0) {
+        _exit(1);
+    }
+
+    struct xbuf out;
+    xbuf_init(&out);
+
+    uint32_t i;
+    for (i = first; i < kflow_revalidate_status.queued; i += stride) {
+        struct ind_ovs_kflow *kflow = kflow_revalidate_array[i];
+        if (kflow == NULL) {
+            continue;
+        }
+
+        uint32_t offset = xbuf_length(&out);
+        struct kflow_revalidate_record *record = xbuf_reserve(&out, sizeof(*record));
+        memset(record, 0, sizeof(*record));
+        record->index = i;
+
+        if (!kflow_is_dirty(kflow)) {
+            record->result = KFLOW_REVALIDATE_SKIP;
+        } else if (kflow->hard_timeout) {
+            record->result = KFLOW_REVALIDATE_DELETE;
+        } else {
+            struct ind_ovs_parsed_key mask;
+            struct nlattr *actions;
+            struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_SET);
+            if (kflow_revalidate_compute(kflow, &mask, msg, &actions) < 0) {
+                record->result = KFLOW_REVALIDATE_DELETE;
+            } else {
+                record->result = KFLOW_REVALIDATE_UPDATE;
+                record->actions_len = nla_len(actions);
+                record->num_stats_handles = xbuf_length(&ind_ovs_kflow_stats_xbuf) / sizeof(struct stats_handle);
+                record->num_deps = xbuf_length(&kflow_deps_xbuf) / sizeof(void *);
+                xbuf_append(&out, xbuf_data(&kflow_deps_xbuf),
+                            xbuf_length(&kflow_deps_xbuf));
+                xbuf_append(&out, &mask, sizeof(mask));
+                xbuf_append(&out, xbuf_data(&ind_ovs_kflow_stats_xbuf),
+                            xbuf_length(&ind_ovs_kflow_stats_xbuf));
+                xbuf_append(&out, nla_data(actions), nla_len(actions));
+            }
+            ind_ovs_nlmsg_freelist_free(msg);
+        }
+
+        uint32_t len = xbuf_length(&out) - offset;
+        xbuf_append_zeroes(&out, ((len + 7) & ~7) - len);
+
+        /* The xbuf may have moved */
+        record = (struct kflow_revalidate_record *)((char *)xbuf_data(&out) + offset);
+        record->len = xbuf_length(&out) - offset;
+
+        if (xbuf_length(&out) >= KFLOW_REVALIDATE_WRITE_SIZE) {
+            kflow_revalidate_write(fd, &out);
+        }
+    }
+
+    kflow_revalidate_write(fd, &out);
+    _exit(0);
+}
+
+/*
+ * Fork worker processes for the current pass
+ *
+ * Kflows not reported by a worker (for example because it failed to fork
+ * or crashed) are left in kflow_revalidate_array and revalidated locally.
+ */
+static void
+kflow_revalidate_spawn_workers(int num_workers)
+{
+    struct ind_ovs_kflow_revalidate_status *status = &kflow_revalidate_status;
+    int i;
+
+    for (i = 0; i < num_workers; i++) {
+        struct kflow_revalidate_worker *worker = &kflow_revalidate_workers[i];
+
+        int fds[2];
+        if (pipe(fds) < 0) {
+            LOG_ERROR("Failed to create revalidation pipe: %s", strerror(errno));
+            break;
+        }
+
+        /* Fewer wakeups of the worker, best effort */
+        (void) fcntl(fds[1], F_SETPIPE_SZ, KFLOW_REVALIDATE_PIPE_SIZE);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            LOG_ERROR("Failed to spawn revalidation process: %s", strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        } else if (pid == 0) {
+            close(fds[0]);
+            kflow_revalidate_worker_main(i, fds[1], i, num_workers);
+        }
+
+        close(fds[1]);
+
+        if (ind_soc_socket_register(fds[0], kflow_revalidate_worker_ready, worker) < 0) {
+            AIM_DIE("Failed to register revalidation pipe with SocketManager");
+        }
+
+        worker->pid = pid;
+        worker->fd = fds[0];
+        xbuf_reset(&worker->buf);
+        status->workers++;
+        status->workers_active++;
+    }
+}
+
+/*
+ * Make room for the kernel requests of one more revalidated kflow
+ *
+ * Sending queued requests may remove kflows whose install failed, so this
+ * must be called before taking a kflow from kflow_revalidate_array.
+ */
+static bool
+kflow_revalidate_reserve(void)
+{
+    kflow_install_kick();
+    return kflow_install_reserve();
+}
+
+/*
+ * Apply one result from a worker
+ *
+ * The worker ran the pipeline as it was when the pass started. If any
+ * object the result depends on changed since, such as a flow whose stats
+ * handle was freed, the result is discarded and the kflow is revalidated
+ * again by the main process along with those the workers didn't report.
+ */
+static void
+kflow_revalidate_apply(const struct kflow_revalidate_record *record)
+{
+    struct ind_ovs_kflow_revalidate_status *status = &kflow_revalidate_status;
+
+    if (record->index >= status->queued) {
+        return;
+    }
+
+    const char *data = (const char *)(record + 1);
+    const void * const *deps = (const void *)data;
+    data += record->num_deps * sizeof(*deps);
+    const struct ind_ovs_parsed_key *mask = (const void *)data;
+    data += sizeof(*mask);
+    const struct stats_handle *stats_handles = (const void *)data;
+    data += record->num_stats_handles * sizeof(*stats_handles);
+
+    if (record->result == KFLOW_REVALIDATE_UPDATE &&
+            kflow_deps_dirty(&kflow_dirty, deps, record->num_deps)) {
+        debug_counter_inc(&revalidate_redo);
+        return;
+    }
+
+    if (record->result != KFLOW_REVALIDATE_SKIP && !kflow_revalidate_reserve()) {
+        /* Left for the main process */
+        return;
+    }
+
+    struct ind_ovs_kflow *kflow = kflow_revalidate_array[record->index];
+    if (kflow == NULL) {
+        /* Deleted since the pass started */
+        return;
+    }
+
+    kflow_revalidate_array[record->index] = NULL;
+    kflow->revalidate_index = UINT32_MAX;
+    status->remaining--;
+
+    if (record->result == KFLOW_REVALIDATE_SKIP) {
+        debug_counter_inc(&revalidate_skipped);
+        status->skipped++;
+        return;
+    }
+
+    debug_counter_inc(&revalidate);
+    status->revalidated++;
+
+    if (record->result != KFLOW_REVALIDATE_UPDATE) {
+        kflow_delete_async(kflow);
+        return;
+    }
+
+    kflow_revalidate_update(kflow, mask, data, record->actions_len,
+                            stats_handles, record->num_stats_handles,
+                            deps, record->num_deps);
+}
+
+static void
+kflow_revalidate_worker_done(struct kflow_revalidate_worker *worker)
+{
+    struct ind_ovs_kflow_revalidate_status *status = &kflow_revalidate_status;
+
+    ind_soc_socket_unregister(worker->fd);
+    close(worker->fd);
+    worker->fd = -1;
+
+    /* Normally it has already exited, which closed the pipe */
+    kill(worker->pid, SIGKILL);
+    while (waitpid(worker->pid, NULL, 0) < 0 && errno == EINTR);
+
+    if (xbuf_length(&worker->buf) > 0) {
+        LOG_ERROR("Revalidation process exited with a partial result");
+        xbuf_reset(&worker->buf);
+    }
+
+    status->workers_active--;
+    if (status->workers_active == 0) {
+        /* Pick up anything the workers didn't report */
+        kflow_revalidate_schedule();
+    }
+}
+
+static void
+kflow_revalidate_worker_ready(int fd, void *cookie,
+                              int read_ready, int write_ready, int error_seen)
+{
+    static char buf[KFLOW_REVALIDATE_WRITE_SIZE];
+    struct kflow_revalidate_worker *worker = cookie;
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return;
+        }
+        LOG_ERROR("Failed to read from revalidation process: %s", strerror(errno));
+        kflow_revalidate_worker_done(worker);
+        return;
+    } else if (n == 0) {
+        kflow_revalidate_worker_done(worker);
+        return;
+    }
+
+    uint64_t start_time = monotonic_us();
+
+    xbuf_append(&worker->buf, buf, n);
+
+    char *data = xbuf_data(&worker->buf);
+    uint32_t len = xbuf_length(&worker->buf);
+    uint32_t offset = 0;
+
+    while (len - offset >= sizeof(struct kflow_revalidate_record)) {
+        struct kflow_revalidate_record *record = (void *)(data + offset);
+        if (len - offset < record->len) {
+            break;
+        }
+        kflow_revalidate_apply(record);
+        offset += record->len;
+    }
+
+    /* Keep the partial record at the start of the buffer */
+    memmove(data, data + offset, len - offset);
+    worker->buf.length = len - offset;
+
+    uint64_t elapsed = monotonic_us() - start_time;
+    kflow_revalidate_status.busy_time += elapsed;
+    kflow_revalidate_status.slices++;
+    debug_counter_add(&revalidate_time, elapsed);
+}
+
+/*
+ * Start a revalidation pass covering all changes made so far
+ *
+ * Returns false if there is nothing to revalidate, in which case the pass
+ * is already complete.
+ */
+static bool
+kflow_revalidate_begin(void)
+{
+    struct ind_ovs_kflow_revalidate_status *status = &kflow_revalidate_status;
+
+    status->pass_generation = kflow_generation;
+    status->start_time = monotonic_us();
+    status->end_time = 0;
+    status->busy_time = 0;
+    status->slices = 0;
+    status->queued = 0;
+    status->remaining = 0;
+    status->revalidated = 0;
+    status->skipped = 0;
+    status->workers = 0;
+
+    if (ind_ovs_hitless) {
+        /* Leave kflow_dirty alone so the changes are revalidated later */
+        AIM_LOG_VERBOSE("Skipping kflow revalidation during hitless restart");
+        return false;
+    }
+
+    kflow_revalidate_dirty = kflow_dirty;
+    kflow_dirty_clear(&kflow_dirty);
+
+    if (list_empty(&ind_ovs_kflows)) {
+        return false;
+    }
+
+    /*
+     * Complete all installs first so that their replies don't have to be
+     * waited for one kflow at a time. Any that are still unanswered are
+     * assumed to have succeeded; revalidation deletes them if not.
+     */
+    kflow_install_flush();
+    kflow_install_abandon();
+
+    struct list_links *cur;
+    LIST_FOREACH(&ind_ovs_kflows, cur) {
+        struct ind_ovs_kflow *kflow = container_of(cur, global_links, struct ind_ovs_kflow);
+        if (status->queued == kflow_revalidate_array_size) {
+            kflow_revalidate_array_size = kflow_revalidate_array_size * 2 + 1024;
+            kflow_revalidate_array = aim_realloc(
+                kflow_revalidate_array,
+                kflow_revalidate_array_size * sizeof(*kflow_revalidate_array));
+        }
+        kflow->revalidate_index = status->queued;
+        kflow_revalidate_array[status->queued++] = kflow;
+    }
+    status->remaining = status->queued;
+    kflow_revalidate_cursor = 0;
+
+    int num_workers = ind_ovs_kflow_revalidate_workers;
+    if (num_workers == 0) {
+        num_workers = ind_ovs_upcall_num_threads();
+    }
+    if (num_workers > status->queued / KFLOW_REVALIDATE_KFLOWS_PER_WORKER) {
+        num_workers = status->queued / KFLOW_REVALIDATE_KFLOWS_PER_WORKER;
+    }
+    if (num_workers > KFLOW_REVALIDATE_MAX_WORKERS) {
+        num_workers = KFLOW_REVALIDATE_MAX_WORKERS;
+    }
+    if (num_workers > 1) {
+        kflow_revalidate_spawn_workers(num_workers);
+    }
+
+    return true;
+}
+
+static void
+kflow_revalidate_finish(void)
+{
+    struct ind_ovs_kflow_revalidate_status *status = &kflow_revalidate_status;
+
+    /* The kernel must have the changes before the barrier is answered */
+    kflow_install_flush();
+
+    kflow_dirty_clear(&kflow_revalidate_dirty);
+
+    status->completed_generation = status->pass_generation;
+    status->passes++;
+    debug_counter_inc(&revalidate_pass);
+
+    status->end_time = monotonic_us();
+    uint64_t elapsed = status->end_time - status->start_time;
+    LOG_VERBOSE("revalidated %u kernel flows in %"PRIu64" us (%"PRIu64" us busy, %u slices, %u workers), skipped %u",
+                status->revalidated, elapsed, status->busy_time,
+                status->slices, status->workers, status->skipped);
+
+    ind_ovs_barrier_revalidation_complete(status->completed_generation);
+
+    kflow_checkpoint_kick();
+}
+
+/*
+ * Start passes until one has kflows to revalidate or no more are requested
+ */
+static void
+kflow_revalidate_next(void)
+{
+    do {
+        kflow_revalidate_requested = false;
+        if (kflow_revalidate_begin()) {
+            return;
+        }
+        kflow_revalidate_finish();
+    } while (kflow_revalidate_requested);
+
+    kflow_revalidate_running = false;
+}
+
+/*
+ * Revalidate the kflows of the current pass not handled by a worker, until
+ * they are done or, if 'yield' is set, the SocketManager wants to run
+ * something else
+ */
+static void
+kflow_revalidate_step(bool yield)
+{
+    struct ind_ovs_kflow_revalidate_status *status = &kflow_revalidate_status;
+    uint64_t start_time = monotonic_us();
+
+    status->slices++;
+
+    while (kflow_revalidate_cursor < status->queued) {
+        if (kflow_revalidate_array[kflow_revalidate_cursor] != NULL &&
+                !kflow_revalidate_reserve()) {
+            /* Too many kernel requests in flight, try again later */
+            break;
+        }
+
+        struct ind_ovs_kflow *kflow = kflow_revalidate_array[kflow_revalidate_cursor++];
+        if (kflow == NULL) {
+            continue;
+        }
+
+        kflow_revalidate_array[kflow->revalidate_index] = NULL;
+        kflow->revalidate_index = UINT32_MAX;
+        status->remaining--;
+
+        if (kflow_is_dirty(kflow)) {
+            ind_ovs_kflow_invalidate(kflow);
+            status->revalidated++;
+        } else {
+            debug_counter_inc(&revalidate_skipped);
+            status->skipped++;
+        }
+
+        if (yield && ind_soc_should_yield()) {
+            break;
+        }
+    }
+
+    uint64_t elapsed = monotonic_us() - start_time;
+    status->busy_time += elapsed;
+    debug_counter_add(&revalidate_time, elapsed);
+
+    if (kflow_revalidate_cursor < status->queued) {
+        return;
+    }
+
+    kflow_revalidate_finish();
+
+    if (kflow_revalidate_requested) {
+        kflow_revalidate_next();
+    } else {
+        kflow_revalidate_running = false;
+    }
+}
+
+static ind_soc_task_status_t
+kflow_revalidate_task(void *cookie)
+{
+    if (kflow_revalidate_running && kflow_revalidate_status.workers_active == 0) {
+        kflow_revalidate_step(true);
+    }
+
+    if (kflow_revalidate_running && kflow_revalidate_status.workers_active == 0) {
+        return IND_SOC_TASK_CONTINUE;
+    }
+
+    /* Rescheduled when the workers finish */
+    kflow_revalidate_task_registered = false;
+    return IND_SOC_TASK_FINISHED;
+}
+
+/*
+ * Revalidate the kflows affected by changes made so far
+ *
+ * The work is done in time slices by a SocketManager task, or for large
+ * passes by worker processes, so that OpenFlow messages and packet-ins are
+ * still handled. If a pass is already running another one is started when
+ * it completes, covering all changes made in the meantime.
+ * ind_ovs_barrier_revalidation_complete is called at the end of each pass.
+ */
+void
+ind_ovs_kflow_revalidate(void)
+{
+    if (kflow_revalidate_running) {
+        if (kflow_generation != kflow_revalidate_status.pass_generation &&
+                !kflow_revalidate_requested) {
+            debug_counter_inc(&revalidate_coalesced);
+            kflow_revalidate_requested = true;
+        }
+        return;
+    }
+
+    kflow_revalidate_running = true;
+    kflow_revalidate_next();
+    kflow_revalidate_schedule();
+}
+
+/*
+ * Revalidate the kflows affected by changes made so far without yielding
+ */
+void
+ind_ovs_kflow_invalidate_all(void)
+{
+    ind_ovs_kflow_revalidate();
+
+    while (kflow_revalidate_running) {
+        /* Blocks until each worker has written results or exited */
+        int i;
+        for (i = 0; i < KFLOW_REVALIDATE_MAX_WORKERS; i++) {
+            struct kflow_revalidate_worker *worker = &kflow_revalidate_workers[i];
+            while (worker->fd >= 0) {
+                kflow_revalidate_worker_ready(worker->fd, worker, 1, 0, 0);
+            }
+        }
+
+        kflow_revalidate_step(false);
+    }
+}
+
+void
+ind_ovs_kflow_revalidate_status_get(struct ind_ovs_kflow_revalidate_status *status)
+{
+    *status = kflow_revalidate_status;
+    status->running = kflow_revalidate_running;
+    status->generation = kflow_generation;
+}
+
+/*
+ * Return the idle timeout in ms for the given kflow
+ */
+static uint64_t
+kflow_idle_timeout(const struct ind_ovs_kflow *kflow)
+{
+    uint64_t timeout = (uint64_t)IND_OVS_KFLOW_EXPIRATION_MS << kflow->idle_shift;
+
+    if (kflow->idle_shift == 0 && kflow->stats.packets <= KFLOW_IDLE_FEW_PACKETS) {
+        timeout = KFLOW_IDLE_MIN_MS;
+    }
+
+    struct ind_ovs_port *port = ind_ovs_ports[kflow->in_port];
+    uint32_t limit = port ? ind_ovs_port_kflow_limit(port) : 0;
+    if (port && limit >= 2 && port->num_kflows > limit / 2) {
+        uint32_t free = port->num_kflows < limit ? limit - port->num_kflows : 0;
+        timeout = timeout * free / (limit / 2);
+    }
+
+    return timeout < KFLOW_IDLE_MIN_MS ? KFLOW_IDLE_MIN_MS : timeout;
+}
+
+/*
+ * Remember an idle-expired kflow in case its key comes back
+ */
+static void
+kflow_expired_record(const struct ind_ovs_kflow *kflow, uint64_t now)
+{
+    struct kflow_expired_entry *entry = &kflow_expired[kflow->hash % NUM_KFLOW_EXPIRED_SLOTS];
+    entry->hash = kflow->hash;
+    entry->idle_shift = kflow->idle_shift;
+    entry->time = now;
+}
+
+/*
+ * Return the idle_shift for a new kflow with the given key hash
+ */
+static uint8_t
+kflow_reinstall_check(uint32_t hash, uint64_t now)
+{
+    struct kflow_expired_entry *entry = &kflow_expired[hash % NUM_KFLOW_EXPIRED_SLOTS];
+    if (entry->time == 0 || entry->hash != hash) {
+        return 0;
+    }
+
+    uint64_t expired_time = entry->time;
+    uint8_t idle_shift = entry->idle_shift;
+    entry->time = 0;
+
+    if (now - expired_time >= KFLOW_REINSTALL_WINDOW_MS) {
+        return 0;
+    }
+
+    debug_counter_inc(&expire_premature);
+    return idle_shift < KFLOW_IDLE_MAX_SHIFT ? idle_shift + 1 : KFLOW_IDLE_MAX_SHIFT;
+}
+
+/*
+ * Delete the kflow if it has been idle for longer than its timeout
+ * (see kflow_idle_timeout) or its hard timeout has passed
+ */
+static void
+kflow_expire_check(struct ind_ovs_kflow *kflow, uint64_t now)
+{
+    if (kflow->last_used < now &&
+            now - kflow->last_used >= kflow_idle_timeout(kflow)) {
+        LOG_VERBOSE("expiring kflow");
+        debug_counter_inc(&expire);
+        if (!kflow->hard_timeout) {
+            kflow_expired_record(kflow, now);
+        }
+        kflow_expire_status.current.expired++;
+        ind_ovs_kflow_delete(kflow);
+    } else if (kflow->hard_timeout && now >= kflow->hard_timeout) {
+        LOG_VERBOSE("expiring drop kflow");
+        kflow_expire_status.current.expired++;
+        ind_ovs_kflow_delete(kflow);
+    }
+}
+
+/* Handle the kernel's reply to a GET request from kflow_expire_fetch */
+static void
+kflow_expire_reply(struct ind_ovs_kflow *kflow, struct nlmsghdr *nlh)
+{
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+        int err = ((struct nlmsgerr *)nlmsg_data(nlh))->error;
+        if (err == -ENOENT) {
+            /* Nothing left to expire, stop tracking it */
+            debug_counter_inc(&expire_missing);
+            kflow_forget(kflow);
+        } else {
+            debug_counter_inc(&sync_stats_failed);
+        }
+        return;
+    }
+
+    struct nlattr *attrs[OVS_FLOW_ATTR_MAX+1];
+    if (genlmsg_parse(nlh, sizeof(struct ovs_header),
+                      attrs, OVS_FLOW_ATTR_MAX, NULL) < 0) {
+        LOG_ERROR("failed to parse datapath message");
+        abort();
+    }
+
+    /* Might have expired, check the real last_used time */
+    kflow_sync_stats(kflow, attrs[OVS_FLOW_ATTR_STATS], attrs[OVS_FLOW_ATTR_USED]);
+    if (!kflow->install_pending) {
+        kflow_expire_check(kflow, monotonic_us()/1000);
+    }
+}
+
+/*
+ * Queue a GET request for an expiration candidate
+ *
+ * The caller must not be holding an install request for the kflow in
+ * flight, since the reply would race with it.
+ */
+static void
+kflow_expire_fetch(struct ind_ovs_kflow *kflow)
+{
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_GET);
+    nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(kflow->key), nla_data(kflow->key));
+
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    nlh->nlmsg_seq = kflow_expire_seq + kflow_expire_batch_len;
+    nlh->nlmsg_pid = nl_socket_get_local_port(kflow_expire_socket);
+    nlh->nlmsg_flags |= NLM_F_REQUEST;
+
+    xbuf_append(&kflow_expire_buf, nlh, NLMSG_ALIGN(nlh->nlmsg_len));
+    ind_ovs_nlmsg_freelist_free(msg);
+
+    kflow_expire_batch[kflow_expire_batch_len++] = kflow;
+    kflow_expire_status.current.fetched++;
+    kflow_expire_fetch_budget--;
+
+    if (kflow_expire_batch_len == KFLOW_EXPIRE_BATCH_SIZE) {
+        kflow_expire_flush();
+    }
+}
+
+/*
+ * Send the queued GET requests and process the replies
+ *
+ * Replies that can't be read, for example because the socket buffer
+ * overflowed, are ignored. Those kflows are fetched again next cycle.
+ */
+static void
+kflow_expire_flush(void)
+{
+    static char buf[IND_OVS_DEFAULT_MSG_SIZE];
+
+    if (kflow_expire_batch_len == 0) {
+        return;
+    }
+
+    debug_counter_inc(&expire_batch);
+    kflow_expire_status.current.batches++;
+
+    int fd = nl_socket_get_fd(kflow_expire_socket);
+    int pending = kflow_expire_batch_len;
+
+    /* The kernel processes the whole batch before send returns */
+    if (send(fd, xbuf_data(&kflow_expire_buf), xbuf_length(&kflow_expire_buf), 0) < 0) {
+        AIM_LOG_ERROR("Failed to send kflow expiration batch: %s", strerror(errno));
+        pending = 0;
+    }
+
+    while (pending > 0) {
+        int n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            } else if (err != EAGAIN) {
+                AIM_LOG_ERROR("Error on kflow expiration socket: %s", strerror(err));
+            }
+            break;
+        }
+
+        struct nlmsghdr *nlh = (void *)buf;
+        while (nlmsg_ok(nlh, n)) {
+            /* Stale replies from an earlier batch fall outside the range */
+            uint32_t i = nlh->nlmsg_seq - kflow_expire_seq;
+            if (i < kflow_expire_batch_len) {
+                struct ind_ovs_kflow *kflow = kflow_expire_batch[i];
+                kflow_expire_batch[i] = NULL;
+                pending--;
+                if (kflow) {
+                    kflow_expire_reply(kflow, nlh);
+                }
+            }
+            nlh = nlmsg_next(nlh, &n);
+        }
+    }
+
+    xbuf_reset(&kflow_expire_buf);
+    kflow_expire_batch_len = 0;
+    kflow_expire_seq += KFLOW_EXPIRE_BATCH_SIZE;
+}
+
+/*
+ * Start a cycle over the whole kflow list and size its slices
+ */
+static void
+kflow_expire_cycle_begin(void)
+{
+    struct ind_ovs_kflow_expire_status *status = &kflow_expire_status;
+    uint32_t kflows = 0;
+    uint64_t max_occupancy = 0; /* 1024ths of the fullest port's limit */
+
+    int i;
+    for (i = 0; i < IND_OVS_MAX_PORTS; i++) {
+        struct ind_ovs_port *port = ind_ovs_ports[i];
+        if (port) {
+            kflows += port->num_kflows;
+            uint32_t limit = ind_ovs_port_kflow_limit(port);
+            uint64_t occupancy = limit ? (uint64_t)port->num_kflows * 1024 / limit : 1024;
+            if (occupancy > max_occupancy) {
+                max_occupancy = occupancy;
+            }
+        }
+    }
+
+    if (max_occupancy > 1024) {
+        max_occupancy = 1024;
+    }
+
+    status->cycle_ms = IND_OVS_KFLOW_EXPIRATION_MS -
+        (IND_OVS_KFLOW_EXPIRATION_MS - KFLOW_IDLE_MIN_MS) * max_occupancy / 1024;
+
+    uint32_t ticks = (status->cycle_ms + IND_OVS_KFLOW_EXPIRE_INTERVAL_MS - 1) /
+        IND_OVS_KFLOW_EXPIRE_INTERVAL_MS;
+    status->slice = (kflows + ticks - 1) / ticks;
+    if (status->slice < KFLOW_EXPIRE_MIN_SLICE) {
+        status->slice = KFLOW_EXPIRE_MIN_SLICE;
+    }
+    status->budget = 0;
+
+    memset(&status->current, 0, sizeof(status->current));
+    status->current.start_time = monotonic_us();
+    status->current.kflows = kflows;
+
+    kflow_expire_cursor = ind_ovs_kflows.links.next;
+}
+
+static void
+kflow_expire_cycle_finish(void)
+{
+    struct ind_ovs_kflow_expire_status *status = &kflow_expire_status;
+
+    status->current.end_time = monotonic_us();
+    status->last = status->current;
+    status->cycles++;
+    status->budget = 0;
+    debug_counter_inc(&expire_cycle);
+
+    LOG_VERBOSE("expiration cycle visited %u kflows in %"PRIu64" us (%"PRIu64" us busy, %u ticks), fetched %u, expired %u",
+                status->last.visited,
+                status->last.end_time - status->last.start_time,
+                status->last.busy_time, status->last.ticks,
+                status->last.fetched, status->last.expired);
+
+    kflow_expire_cursor = NULL;
+}
+
+/*
+ * Visit the rest of this tick's slice of the kflow list
+ *
+ * This has the side effect of synchronizing stats for the kflows fetched.
+ */
+static ind_soc_task_status_t
+kflow_expire_task(void *cookie)
+{
+    struct ind_ovs_kflow_expire_status *status = &kflow_expire_status;
+    uint64_t start_time = monotonic_us();
+    uint64_t now = start_time/1000;
+
+    while (kflow_expire_cursor && status->budget > 0 &&
+            kflow_expire_fetch_budget > 0) {
+        if (kflow_expire_cursor == &ind_ovs_kflows.links) {
+            kflow_expire_flush();
+            kflow_expire_cycle_finish();
+            break;
+        }
+
+        struct ind_ovs_kflow *kflow =
+            container_of(kflow_expire_cursor, global_links, struct ind_ovs_kflow);
+        kflow_expire_cursor = kflow_expire_cursor->next;
+        status->budget--;
+        status->current.visited++;
+
+        if (kflow->install_pending) {
+            /* Not in the kernel yet */
+        } else if (kflow->hard_timeout && now >= kflow->hard_timeout) {
+            kflow_expire_check(kflow, now);
+        } else if (kflow->last_used < now &&
+                   now - kflow->last_used >= kflow_idle_timeout(kflow)) {
+            kflow_expire_fetch(kflow);
+        }
+
+        if (ind_soc_should_yield()) {
+            break;
+        }
+    }
+
+    kflow_expire_flush();
+
+    status->current.busy_time += monotonic_us() - start_time;
+
+    if (kflow_expire_cursor && status->budget > 0 &&
+            kflow_expire_fetch_budget > 0) {
+        return IND_SOC_TASK_CONTINUE;
+    }
+
+    kflow_expire_task_running = false;
+    return IND_SOC_TASK_FINISHED;
+}
+
+/* Handle one flow from the stats dump */
+static void
+kflow_stats_dump_flow(struct nlmsghdr *nlh)
+{
+    struct nlattr *attrs[OVS_FLOW_ATTR_MAX+1];
+    if (genlmsg_parse(nlh, sizeof(struct ovs_header),
+                      attrs, OVS_FLOW_ATTR_MAX, NULL) < 0) {
+        LOG_ERROR("Failed to parse kernel flow");
+        return;
+    }
+
+    struct nlattr *key = attrs[OVS_FLOW_ATTR_KEY];
+    if (key == NULL) {
+        return;
+    }
+
+    struct ind_ovs_kflow *kflow = kflow_lookup(key);
+    if (kflow) {
+        kflow_sync_stats(kflow, attrs[OVS_FLOW_ATTR_STATS], attrs[OVS_FLOW_ATTR_USED]);
+        if (!kflow->install_pending) {
+            /* Deleting now could make the kernel skip flows in the dump */
+            xbuf_append_attr(&kflow_stats_expire_keys, OVS_FLOW_ATTR_KEY,
+                             nla_data(key), nla_len(key));
+        }
+    }
+}
+
+/*
+ * Read the next part of the stats dump. Returns false once the dump is
+ * done or failed.
+ */
+static bool
+kflow_stats_dump_recv(void)
+{
+    static char buf[IND_OVS_DEFAULT_MSG_SIZE];
+    int fd = nl_socket_get_fd(kflow_stats_socket);
+
+    int n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0) {
+        int err = errno;
+        if (err == EINTR || err == EAGAIN) {
+            return true;
+        }
+        AIM_LOG_ERROR("Error on kflow stats socket: %s", strerror(err));
+        debug_counter_inc(&sync_stats_failed);
+        return false;
+    }
+
+    struct nlmsghdr *nlh = (void *)buf;
+    while (nlmsg_ok(nlh, n)) {
+        if (nlh->nlmsg_seq != kflow_stats_dump_seq) {
+            /* Left over from an earlier dump that failed */
+        } else if (nlh->nlmsg_type == NLMSG_DONE) {
+            return false;
+        } else if (nlh->nlmsg_type == NLMSG_ERROR) {
+            struct nlmsgerr *err = nlmsg_data(nlh);
+            AIM_LOG_ERROR("Failed to dump kernel flow stats: %s", strerror(-err->error));
+            debug_counter_inc(&sync_stats_failed);
+            return false;
+        } else if (nlh->nlmsg_type == ovs_flow_family) {
+            kflow_stats_dump_flow(nlh);
+        }
+        nlh = nlmsg_next(nlh, &n);
+    }
+
+    return true;
+}
+
+/*
+ * Long running task that synchronizes the stats of all kflows from a single
+ * dump of the kernel flow table, then expires the kflows the dump found idle
+ */
+static ind_soc_task_status_t
+kflow_stats_task(void *cookie)
+{
+    uint64_t start_time = monotonic_us();
+    ind_soc_task_status_t status = IND_SOC_TASK_CONTINUE;
+
+    while (kflow_stats_dump_running) {
+        kflow_stats_dump_running = kflow_stats_dump_recv();
+        if (kflow_stats_dump_running && ind_soc_should_yield()) {
+            goto out;
+        }
+    }
+
+    uint64_t now = start_time/1000;
+    while (kflow_stats_expire_offset < xbuf_length(&kflow_stats_expire_keys)) {
+        struct nlattr *key = xbuf_data(&kflow_stats_expire_keys) + kflow_stats_expire_offset;
+        kflow_stats_expire_offset += nla_total_size(nla_len(key));
+
+        struct ind_ovs_kflow *kflow = kflow_lookup(key);
+        if (kflow && !kflow->install_pending) {
+            kflow_expire_check(kflow, now);
+        }
+
+        if (ind_soc_should_yield()) {
+            goto out;
+        }
+    }
+
+    xbuf_reset(&kflow_stats_expire_keys);
+    kflow_stats_expire_offset = 0;
+    kflow_stats_task_running = false;
+    kflow_stats_snapshot_invalidate();
+    status = IND_SOC_TASK_FINISHED;
+
+out:
+    debug_counter_add(&stats_dump_time, monotonic_us() - start_time);
+    return status;
+}
+
+/*
+ * Start a dump of the kernel flow table to synchronize the stats of all
+ * kflows, unless one was started in the last KFLOW_STATS_REFRESH_MS
+ */
+static void
+kflow_stats_dump_begin(void)
+{
+    uint64_t now = monotonic_us()/1000;
+
+    if (kflow_stats_task_running ||
+            now - kflow_stats_refresh_time < KFLOW_STATS_REFRESH_MS) {
+        return;
+    }
+
+    kflow_stats_refresh_time = now;
+
+    /* Even without a dump the upcall threads' counts must become visible */
+    kflow_stats_snapshot_invalidate();
+
+    if (ind_ovs_hitless || list_empty(&ind_ovs_kflows)) {
+        return;
+    }
+
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_GET);
+    nlmsg_hdr(msg)->nlmsg_flags |= NLM_F_DUMP;
+
+    bool ok = nl_send_auto(kflow_stats_socket, msg) >= 0;
+    kflow_stats_dump_seq = nlmsg_hdr(msg)->nlmsg_seq;
+    ind_ovs_nlmsg_freelist_free(msg);
+
+    if (!ok) {
+        LOG_ERROR("Failed to dump kernel flow stats");
+        debug_counter_inc(&sync_stats_failed);
+        return;
+    }
+
+    if (ind_soc_task_register(kflow_stats_task, NULL, IND_SOC_NORMAL_PRIORITY) < 0) {
+        AIM_DIE("Failed to create long running task for kflow stats");
+    }
+
+    debug_counter_inc(&stats_dump);
+    kflow_stats_dump_running = true;
+    kflow_stats_task_running = true;
+}
+
+/*
+ * Serve the following reads from the stats writers until enough of them
+ * justify a new snapshot
+ */
+static void
+kflow_stats_snapshot_invalidate(void)
+{
+    kflow_stats_snapshot_valid = false;
+    kflow_stats_reads = 0;
+}
+
+/*
+ * Decide whether the reads of 'count' more handles should use the snapshot
+ */
+static bool
+kflow_stats_use_snapshot(uint32_t count)
+{
+    if (kflow_stats_snapshot_valid) {
+        /* Every refresh tick discards the snapshot, dump or not */
+        AIM_ASSERT(kflow_stats_snapshot_tick == kflow_stats_refresh_time);
+        return true;
+    }
+
+    kflow_stats_reads += count;
+
+    struct stats_usage usage;
+    stats_usage_get(&usage);
+    if ((uint64_t)kflow_stats_reads * KFLOW_STATS_SNAPSHOT_RATIO <= usage.allocated) {
+        return false;
+    }
+
+    uint64_t start_time = monotonic_us();
+    stats_snapshot_update(kflow_stats_snapshot);
+    kflow_stats_snapshot_valid = true;
+    kflow_stats_snapshot_tick = kflow_stats_refresh_time;
+    debug_counter_inc(&stats_snapshot);
+    debug_counter_add(&stats_snapshot_time, monotonic_us() - start_time);
+    return true;
+}
+
+/*
+ * Read OpenFlow stats, including the latest kflow stats
+ */
+void
+ind_ovs_stats_get(const struct stats_handle *handle, struct stats *result)
 {
-    if (ind_soc_should_yield()) {
-        return -NLE_AGAIN;
+    if (kflow_stats_use_snapshot(1)) {
+        stats_snapshot_get(kflow_stats_snapshot, handle, result);
+    } else {
+        stats_get(handle, result);
     }
-
-    return nl_recv(sk, nla, buf, creds);
 }
 
 /*
- * Delete all kflows that haven't been used in more than
- * IND_OVS_KFLOW_EXPIRATION_MS milliseconds.
+ * Read OpenFlow stats for many handles, including the latest kflow stats
  *
- * This has the side effect of synchronizing stats.
+ * Stores the result for handles[i] in results[i].
  */
-static ind_soc_task_status_t
-kflow_expire_task(void *cookie)
+void
+ind_ovs_stats_get_batch(const struct stats_handle *const handles[],
+                        struct stats results[], uint32_t count)
 {
-    if (nl_recvmsgs_report(kflow_expire_socket, nl_socket_get_cb(kflow_expire_socket)) == -NLE_AGAIN) {
-        return IND_SOC_TASK_CONTINUE;
+    if (kflow_stats_use_snapshot(count)) {
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            stats_snapshot_get(kflow_stats_snapshot, handles[i], &results[i]);
+        }
+    } else {
+        stats_get_batch(handles, results, count);
     }
-
-    kflow_expire_task_running = false;
-    return IND_SOC_TASK_FINISHED;
 }
 
 static void
@@ -526,20 +2903,36 @@ update_datapath_stats(void)
 }
 
 /*
- * Register a long running task to delete expired kflows.
+ * Called every IND_OVS_KFLOW_EXPIRE_INTERVAL_MS. Schedules the next slice of
+ * the expiration scan.
  */
 void
 ind_ovs_kflow_expire(void)
 {
-    /* Check if a previous task is already running */
-    if (kflow_expire_task_running) {
-        return;
+    struct ind_ovs_kflow_expire_status *status = &kflow_expire_status;
+
+    kflow_stats_dump_begin();
+
+    if (kflow_expire_cursor == NULL) {
+        update_datapath_stats();
+
+        if (ind_ovs_hitless) {
+            AIM_LOG_VERBOSE("Skipping kflow expiration during hitless restart");
+            return;
+        }
+
+        kflow_expire_cycle_begin();
     }
 
-    update_datapath_stats();
+    /* Part of a slice left over from the last tick is carried forward */
+    status->budget += status->slice;
+    if (status->budget > status->slice * 2) {
+        status->budget = status->slice * 2;
+    }
+    status->current.ticks++;
+    kflow_expire_fetch_budget = KFLOW_EXPIRE_MAX_FETCH;
 
-    if (ind_ovs_hitless) {
-        AIM_LOG_VERBOSE("Skipping kflow expiration during hitless restart");
+    if (kflow_expire_task_running) {
         return;
     }
 
@@ -547,25 +2940,59 @@ ind_ovs_kflow_expire(void)
         AIM_DIE("Failed to create long running task for kflow expiration");
     }
 
-    AIM_ASSERT(kflow_expire_socket != NULL);
+    kflow_expire_task_running = true;
+}
 
-    struct nl_msg *msg = nlmsg_alloc();
-    struct ovs_header *hdr = genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ,
-                                         ovs_flow_family, sizeof(*hdr),
-                                         NLM_F_DUMP, OVS_FLOW_CMD_GET,
-                                         OVS_FLOW_VERSION);
-    hdr->dp_ifindex = ind_ovs_dp_ifindex;
-    if (nl_send_auto(kflow_expire_socket, msg) < 0) {
-        abort();
+void
+ind_ovs_kflow_expire_status_get(struct ind_ovs_kflow_expire_status *status)
+{
+    *status = kflow_expire_status;
+}
+
+void
+ind_ovs_kflow_mask_status_get(struct ind_ovs_kflow_mask_status *status)
+{
+    memset(status, 0, sizeof(*status));
+    status->masks = kflow_num_masks;
+    status->budget = ind_ovs_kflow_mask_budget;
+    status->widened = mask_widened.value;
+    status->over_budget = mask_over_budget.value;
+
+    struct list_links *cur;
+    LIST_FOREACH(&kflow_masks, cur) {
+        struct ind_ovs_kflow_mask *entry =
+            container_of(cur, links, struct ind_ovs_kflow_mask);
+        int bucket = 31 - __builtin_clz(entry->refcount);
+        if (bucket >= IND_OVS_KFLOW_MASK_HISTOGRAM_BUCKETS) {
+            bucket = IND_OVS_KFLOW_MASK_HISTOGRAM_BUCKETS - 1;
+        }
+        status->histogram[bucket]++;
+    }
+}
+
+uint32_t
+ind_ovs_port_kflow_limit(const struct ind_ovs_port *port)
+{
+    return port->kflow_limit ? port->kflow_limit : ind_ovs_kflow_limit;
+}
+
+/*
+ * Kflows over a lowered limit are not deleted immediately. Each new kflow on
+ * the port evicts two until the port is back under its limit.
+ */
+indigo_error_t
+ind_ovs_port_kflow_limit_set(const char *port_name, uint32_t limit)
+{
+    struct ind_ovs_port *port = ind_ovs_port_lookup_by_name(port_name);
+    if (port == NULL) {
+        return INDIGO_ERROR_NOT_FOUND;
     }
 
-    nlmsg_free(msg);
+    AIM_LOG_VERBOSE("Setting kflow limit on port %s to %u", port->ifname, limit);
 
-    nl_socket_modify_cb(kflow_expire_socket, NL_CB_VALID, NL_CB_CUSTOM,
-                        kflow_expire, NULL);
-    nl_cb_overwrite_recv(nl_socket_get_cb(kflow_expire_socket), kflow_expire_recv);
+    port->kflow_limit = limit;
 
-    kflow_expire_task_running = true;
+    return INDIGO_ERROR_NONE;
 }
 
 /* Overwrite the bits in 'key' where 'mask' is 0 with random values */
@@ -591,6 +3018,11 @@ randomize_unmasked(char *key, const char *mask, int len)
 static void
 test_kflow_mask(struct ind_ovs_kflow *kflow)
 {
+    /* The kernel mask of an adopted kflow may be more specific than ours */
+    if (kflow->adopted) {
+        return;
+    }
+
     int i;
     for (i = 0; i < NUM_KFLOW_MASK_TESTS; i++) {
         LOG_VERBOSE("Testing kflow mask (iteration %d)", i);
@@ -626,7 +3058,11 @@ test_kflow_mask(struct ind_ovs_kflow *kflow)
 
         assert(nla_len(actions) == kflow->actions_len);
         assert(!memcmp(nla_data(actions), kflow->actions, nla_len(actions)));
-        assert(!memcmp(&mask, &kflow->mask, sizeof(mask)));
+        if (kflow->mask_widened) {
+            assert(kflow_mask_covers(&kflow->mask, &mask));
+        } else {
+            assert(!memcmp(&mask, &kflow->mask, sizeof(mask)));
+        }
         assert(xbuf_length(stats) == kflow->num_stats_handles * sizeof(struct stats_handle));
         assert(!memcmp(xbuf_data(stats), kflow->stats_handles, xbuf_length(stats)));
 
@@ -634,6 +3070,145 @@ test_kflow_mask(struct ind_ovs_kflow *kflow)
     }
 }
 
+struct kflow_adopt_state {
+    int count;
+    struct xbuf rejects; /* keys of kernel flows to delete after the dump */
+};
+
+/*
+ * Delete the kernel flows rejected during the dump
+ *
+ * Deleting while the dump is in progress would shift the kernel's position
+ * in its flow table and skip flows.
+ */
+static void
+kflow_adopt_delete_rejects(struct xbuf *rejects)
+{
+    struct nlattr *key;
+    XBUF_FOREACH2(rejects, key) {
+        struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_DEL);
+        nla_put(msg, OVS_FLOW_ATTR_KEY, nla_len(key), nla_data(key));
+        (void) ind_ovs_transact(msg);
+    }
+}
+
+static int
+kflow_adopt_iterator(struct nl_msg *msg, void *arg)
+{
+    struct kflow_adopt_state *state = arg;
+
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    struct nlattr *attrs[OVS_FLOW_ATTR_MAX+1];
+    if (genlmsg_parse(nlh, sizeof(struct ovs_header),
+                      attrs, OVS_FLOW_ATTR_MAX, NULL) < 0) {
+        LOG_ERROR("Failed to parse kernel flow");
+        return NL_SKIP;
+    }
+
+    struct nlattr *key = attrs[OVS_FLOW_ATTR_KEY];
+    if (key == NULL) {
+        return NL_SKIP;
+    }
+
+    struct nlattr *in_port_attr = nla_find(nla_data(key), nla_len(key), OVS_KEY_ATTR_IN_PORT);
+    uint32_t in_port = in_port_attr ? nla_get_u32(in_port_attr) : IND_OVS_MAX_PORTS;
+    struct ind_ovs_port *port = in_port < IND_OVS_MAX_PORTS ? ind_ovs_ports[in_port] : NULL;
+    if (port == NULL || port->num_kflows >= ind_ovs_port_kflow_limit(port) ||
+            kflow_lookup(key) != NULL) {
+        debug_counter_inc(&adopt_rejected);
+        xbuf_append_attr(&state->rejects, OVS_FLOW_ATTR_KEY, nla_data(key), nla_len(key));
+        return NL_OK;
+    }
+
+    struct ind_ovs_parsed_key pkey;
+    ind_ovs_parse_key(key, &pkey);
+
+    struct nlattr *actions = attrs[OVS_FLOW_ATTR_ACTIONS];
+    int actions_len = actions ? nla_len(actions) : 0;
+
+    struct ind_ovs_kflow *kflow = kflow_alloc(key);
+
+    if (attrs[OVS_FLOW_ATTR_MASK]) {
+        ind_ovs_parse_key(attrs[OVS_FLOW_ATTR_MASK], &kflow->mask);
+    } else {
+        /* Exact match */
+        memset(&kflow->mask, 0xff, sizeof(kflow->mask));
+    }
+
+    kflow->adopted = true;
+    kflow->in_port = in_port;
+    kflow->last_used = monotonic_us()/1000;
+    kflow->actions = aim_malloc(actions_len);
+    if (actions) {
+        memcpy(kflow->actions, nla_data(actions), actions_len);
+    }
+    kflow->actions_len = actions_len;
+
+    /* Traffic before the takeover was counted by the previous instance */
+    kflow_sync_stats(kflow, attrs[OVS_FLOW_ATTR_STATS], attrs[OVS_FLOW_ATTR_USED]);
+
+    kflow_link(kflow, &pkey);
+
+    port->num_kflows++;
+    debug_counter_inc(&adopt);
+    state->count++;
+
+    return NL_OK;
+}
+
+/*
+ * Take over the kernel flows left by a previous instance of IVS
+ *
+ * Each kernel flow becomes a kflow with the actions and mask it was
+ * installed with, and then all of them are revalidated against the current
+ * pipeline. Only kernel flows whose actions changed are modified, and only
+ * those with a mask too broad for the current pipeline are deleted.
+ *
+ * If the dump fails the kernel flow table is flushed instead.
+ */
+void
+ind_ovs_kflow_adopt(void)
+{
+    AIM_ASSERT(list_empty(&ind_ovs_kflows));
+
+    struct kflow_adopt_state state = { .count = 0 };
+    xbuf_init(&state.rejects);
+
+    struct nl_sock *sk = ind_ovs_create_nlsock();
+    struct nl_msg *msg = ind_ovs_create_nlmsg(ovs_flow_family, OVS_FLOW_CMD_GET);
+    nlmsg_hdr(msg)->nlmsg_flags |= NLM_F_DUMP;
+
+    bool ok = nl_send_auto(sk, msg) >= 0;
+    ind_ovs_nlmsg_freelist_free(msg);
+
+    if (ok) {
+        nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM,
+                            kflow_adopt_iterator, &state);
+        ok = nl_recvmsgs_default(sk) >= 0;
+    }
+
+    nl_socket_free(sk);
+
+    if (!ok) {
+        LOG_ERROR("Failed to dump kernel flows, flushing them instead");
+        struct list_links *cur, *next;
+        LIST_FOREACH_SAFE(&ind_ovs_kflows, cur, next) {
+            kflow_forget(container_of(cur, global_links, struct ind_ovs_kflow));
+        }
+        ind_ovs_kflow_flush();
+        xbuf_cleanup(&state.rejects);
+        return;
+    }
+
+    kflow_adopt_delete_rejects(&state.rejects);
+    xbuf_cleanup(&state.rejects);
+
+    LOG_INFO("Adopted %d kernel flows, revalidating", state.count);
+
+    ind_ovs_kflow_mark_all_dirty();
+    ind_ovs_kflow_revalidate();
+}
+
 /* Delete all flows from the kernel datapath */
 void
 ind_ovs_kflow_flush(void)
@@ -645,22 +3220,369 @@ ind_ovs_kflow_flush(void)
     }
 }
 
+/*
+ * Identify the pipeline and key layout a checkpoint was written with
+ */
+static uint32_t
+kflow_checkpoint_fingerprint(void)
+{
+    const char *name = pipeline_get();
+    if (name == NULL) {
+        name = "";
+    }
+
+    return murmur_hash(name, strlen(name), sizeof(struct ind_ovs_parsed_key));
+}
+
+static uint32_t
+kflow_checkpoint_actions_hash(const void *actions, int len)
+{
+    /* Not salted, the hash must be the same after a restart */
+    return murmur_hash(actions, len, 0);
+}
+
+static bool
+kflow_checkpoint_matches(const struct kflow_checkpoint_record *record,
+                         const struct nlattr *actions,
+                         const struct ind_ovs_parsed_key *mask)
+{
+    return record->actions_hash ==
+            kflow_checkpoint_actions_hash(nla_data(actions), nla_len(actions)) &&
+        kflow_mask_covers(&record->mask, mask);
+}
+
+/*
+ * Write the recently used kflows to the checkpoint file, if configured
+ *
+ * Called on shutdown. See the description of warm start at the top of this
+ * file.
+ */
+void
+ind_ovs_kflow_checkpoint(void)
+{
+    if (kflow_checkpoint_path == NULL) {
+        return;
+    }
+
+    uint64_t now = monotonic_us()/1000;
+    struct kflow_checkpoint_header header = {
+        .magic = KFLOW_CHECKPOINT_MAGIC,
+        .version = KFLOW_CHECKPOINT_VERSION,
+        .fingerprint = kflow_checkpoint_fingerprint(),
+        .count = 0,
+    };
+
+    struct xbuf buf;
+    xbuf_init(&buf);
+    xbuf_append(&buf, &header, sizeof(header));
+
+    struct list_links *cur;
+    LIST_FOREACH(&ind_ovs_kflows, cur) {
+        struct ind_ovs_kflow *kflow = container_of(cur, global_links, struct ind_ovs_kflow);
+        struct ind_ovs_port *port = ind_ovs_ports[kflow->in_port];
+        if (port == NULL || kflow->hard_timeout || kflow->install_pending ||
+                kflow->last_used + IND_OVS_KFLOW_EXPIRATION_MS < now) {
+            continue;
+        }
+
+        uint32_t len = sizeof(struct kflow_checkpoint_record) + kflow->key->nla_len;
+        uint32_t padded_len = (len + 7) & ~7;
+
+        struct kflow_checkpoint_record record;
+        memset(&record, 0, sizeof(record));
+        record.len = padded_len;
+        record.actions_hash = kflow_checkpoint_actions_hash(kflow->actions, kflow->actions_len);
+        memcpy(record.ifname, port->ifname, sizeof(record.ifname));
+        record.mask = kflow->mask;
+
+        xbuf_append(&buf, &record, sizeof(record));
+        xbuf_append(&buf, kflow->key, kflow->key->nla_len);
+        xbuf_append_zeroes(&buf, padded_len - len);
+        header.count++;
+    }
+
+    memcpy(xbuf_data(&buf), &header, sizeof(header));
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", kflow_checkpoint_path);
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open kflow checkpoint %s: %s", tmp_path, strerror(errno));
+        xbuf_cleanup(&buf);
+        return;
+    }
+
+    const char *data = xbuf_data(&buf);
+    uint32_t remaining = xbuf_length(&buf);
+    while (remaining > 0) {
+        ssize_t n = write(fd, data, remaining);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        remaining -= n;
+    }
+
+    if (remaining > 0 || close(fd) < 0) {
+        LOG_ERROR("Failed to write kflow checkpoint %s: %s", tmp_path, strerror(errno));
+        if (remaining > 0) {
+            close(fd);
+        }
+        unlink(tmp_path);
+    } else if (rename(tmp_path, kflow_checkpoint_path) < 0) {
+        LOG_ERROR("Failed to rename kflow checkpoint to %s: %s",
+                  kflow_checkpoint_path, strerror(errno));
+        unlink(tmp_path);
+    } else {
+        LOG_INFO("Wrote %u kernel flows to checkpoint %s",
+                 header.count, kflow_checkpoint_path);
+    }
+
+    xbuf_cleanup(&buf);
+}
+
+static void
+kflow_checkpoint_release(void)
+{
+    xbuf_cleanup(&kflow_checkpoint_buf);
+    kflow_checkpoint_count = 0;
+    kflow_checkpoint_remaining = 0;
+}
+
+/*
+ * Read the checkpoint written by the previous instance
+ */
+static void
+kflow_checkpoint_load(void)
+{
+    int fd = open(kflow_checkpoint_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            LOG_WARN("Failed to open kflow checkpoint %s: %s",
+                     kflow_checkpoint_path, strerror(errno));
+        }
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct kflow_checkpoint_header)) {
+        LOG_WARN("Ignoring invalid kflow checkpoint %s", kflow_checkpoint_path);
+        close(fd);
+        return;
+    }
+
+    xbuf_init(&kflow_checkpoint_buf);
+    char *data = xbuf_reserve(&kflow_checkpoint_buf, st.st_size);
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        ssize_t n = read(fd, data + offset, st.st_size - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+    close(fd);
+
+    struct kflow_checkpoint_header *header = (void *)data;
+    bool valid = offset == st.st_size &&
+        header->magic == KFLOW_CHECKPOINT_MAGIC &&
+        header->version == KFLOW_CHECKPOINT_VERSION;
+
+    uint32_t count = 0;
+    offset = sizeof(*header);
+    while (valid && offset < st.st_size) {
+        struct kflow_checkpoint_record *record = (void *)(data + offset);
+        struct nlattr *key = (struct nlattr *)(record + 1);
+        if (st.st_size - offset < sizeof(*record) + NLA_HDRLEN ||
+                record->len < sizeof(*record) + NLA_HDRLEN ||
+                record->len > st.st_size - offset ||
+                key->nla_len < NLA_HDRLEN ||
+                key->nla_len > record->len - sizeof(*record)) {
+            valid = false;
+            break;
+        }
+        record->done = false;
+        offset += record->len;
+        count++;
+    }
+
+    if (!valid || count != header->count) {
+        LOG_WARN("Ignoring invalid kflow checkpoint %s", kflow_checkpoint_path);
+        kflow_checkpoint_release();
+        return;
+    }
+
+    LOG_INFO("Loaded %u kernel flows from checkpoint %s", count, kflow_checkpoint_path);
+
+    kflow_checkpoint_file_fingerprint = header->fingerprint;
+    kflow_checkpoint_count = count;
+    kflow_checkpoint_remaining = count;
+}
+
+/*
+ * Try to install a checkpointed kflow
+ *
+ * The record is left for a later attempt if its port doesn't exist yet or
+ * the pipeline output differs.
+ */
+static void
+kflow_checkpoint_install(struct kflow_checkpoint_record *record)
+{
+    struct nlattr *key = (struct nlattr *)(record + 1);
+    struct nlattr *in_port_attr = nla_find(nla_data(key), nla_len(key), OVS_KEY_ATTR_IN_PORT);
+    uint32_t in_port = in_port_attr ? nla_get_u32(in_port_attr) : IND_OVS_MAX_PORTS;
+    struct ind_ovs_port *port = in_port < IND_OVS_MAX_PORTS ? ind_ovs_ports[in_port] : NULL;
+    if (port == NULL || strncmp(port->ifname, record->ifname, sizeof(record->ifname))) {
+        return;
+    }
+
+    indigo_error_t err = kflow_add(key, record);
+    if (err == INDIGO_ERROR_COMPAT) {
+        return;
+    } else if (err == INDIGO_ERROR_NONE) {
+        debug_counter_inc(&warm_start);
+    }
+
+    record->done = true;
+    kflow_checkpoint_remaining--;
+}
+
+static ind_soc_task_status_t
+kflow_checkpoint_task(void *cookie)
+{
+    while (kflow_checkpoint_offset < xbuf_length(&kflow_checkpoint_buf)) {
+        struct kflow_checkpoint_record *record = (void *)
+            ((char *)xbuf_data(&kflow_checkpoint_buf) + kflow_checkpoint_offset);
+        kflow_checkpoint_offset += record->len;
+
+        if (!record->done) {
+            kflow_checkpoint_install(record);
+        }
+
+        if (ind_soc_should_yield()) {
+            return IND_SOC_TASK_CONTINUE;
+        }
+    }
+
+    kflow_checkpoint_task_registered = false;
+
+    LOG_INFO("Warm start: %u of %u checkpointed kernel flows done %"PRIu64" ms after startup",
+             kflow_checkpoint_count - kflow_checkpoint_remaining, kflow_checkpoint_count,
+             monotonic_us()/1000 - kflow_checkpoint_start_time);
+
+    if (kflow_checkpoint_remaining == 0) {
+        kflow_checkpoint_release();
+    }
+
+    return IND_SOC_TASK_FINISHED;
+}
+
+/*
+ * Called after each revalidation pass to retry the checkpointed kflows
+ */
+static void
+kflow_checkpoint_kick(void)
+{
+    if (kflow_checkpoint_remaining == 0 || kflow_checkpoint_task_registered) {
+        return;
+    }
+
+    if (monotonic_us()/1000 - kflow_checkpoint_start_time > KFLOW_CHECKPOINT_TIMEOUT_MS) {
+        LOG_INFO("Warm start: giving up on %u of %u checkpointed kernel flows",
+                 kflow_checkpoint_remaining, kflow_checkpoint_count);
+        kflow_checkpoint_release();
+        return;
+    }
+
+    /* The pipeline may not have been chosen yet */
+    if (kflow_checkpoint_file_fingerprint != kflow_checkpoint_fingerprint()) {
+        return;
+    }
+
+    kflow_checkpoint_offset = sizeof(struct kflow_checkpoint_header);
+
+    if (ind_soc_task_register(kflow_checkpoint_task, NULL, IND_SOC_NORMAL_PRIORITY) < 0) {
+        AIM_DIE("Failed to create long running task for kflow warm start");
+    }
+
+    kflow_checkpoint_task_registered = true;
+}
+
 void
 ind_ovs_kflow_module_init(void)
 {
     list_init(&ind_ovs_kflows);
+    list_init(&kflow_masks);
+
+    taghash_init(&kflow_table, KFLOW_TABLE_MIN_SLOTS);
+    taghash_init(&kflow_mask_table, KFLOW_MASK_TABLE_MIN_SLOTS);
 
     int i;
-    for (i = 0; i < NUM_KFLOW_BUCKETS; i++) {
-        list_init(&ind_ovs_kflow_buckets[i]);
+    for (i = 0; i < NUM_KFLOW_SLABS; i++) {
+        kflow_slabs[i] = slab_create(sizeof(struct ind_ovs_kflow) +
+                                     (i + 1) * KFLOW_SLAB_GRANULARITY);
     }
 
     xbuf_init(&ind_ovs_kflow_stats_xbuf);
+    xbuf_init(&kflow_deps_xbuf);
+
+    for (i = 0; i < KFLOW_REVALIDATE_MAX_WORKERS; i++) {
+        kflow_revalidate_workers[i].fd = -1;
+        xbuf_init(&kflow_revalidate_workers[i].buf);
+    }
+
+    char *s = getenv("IVS_REVALIDATE_WORKERS");
+    if (s != NULL) {
+        ind_ovs_kflow_revalidate_workers = atoi(s);
+    }
+
+    s = getenv("IVS_KFLOW_MASK_BUDGET");
+    if (s != NULL) {
+        ind_ovs_kflow_mask_budget = atoi(s);
+    }
+
+    kflow_checkpoint_path = getenv("IVS_KFLOW_CHECKPOINT");
+    kflow_checkpoint_start_time = monotonic_us()/1000;
+    if (kflow_checkpoint_path != NULL && !ind_ovs_hitless && !ind_ovs_disable_kflows) {
+        kflow_checkpoint_load();
+    }
+
+    s = getenv("IVS_KFLOW_LIMIT");
+    if (s != NULL) {
+        ind_ovs_kflow_limit = atoi(s);
+        if (ind_ovs_kflow_limit == 0) {
+            AIM_DIE("Invalid kflow limit");
+        }
+    }
 
     ind_ovs_kflow_stats_writer = stats_writer_create();
+    kflow_stats_snapshot = stats_snapshot_create();
 
     kflow_expire_socket = ind_ovs_create_nlsock();
     AIM_ASSERT(kflow_expire_socket != NULL);
 
+    xbuf_init(&kflow_expire_buf);
+
+    kflow_stats_socket = ind_ovs_create_nlsock();
+    AIM_ASSERT(kflow_stats_socket != NULL);
+
+    xbuf_init(&kflow_stats_expire_keys);
+
+    xbuf_init(&kflow_install_buf);
+
+    kflow_install_socket = ind_ovs_create_nlsock();
+    AIM_ASSERT(kflow_install_socket != NULL);
+
+    if (ind_soc_socket_register(nl_socket_get_fd(kflow_install_socket),
+                                kflow_install_sock_ready, NULL) < 0) {
+        AIM_DIE("Failed to register kflow install socket with SocketManager");
+    }
+
     megaflow_tcam = tcam_create(sizeof(struct ind_ovs_parsed_key), ind_ovs_salt);
 }
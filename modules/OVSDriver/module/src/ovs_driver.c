@@ -215,6 +215,17 @@ ind_ovs_init(const char *datapath_name, bool hitless)
         ind_ovs_disable_megaflows = true;
     }
 
+    env_str = getenv("IVS_STATS_HUGEPAGES");
+    if (env_str != NULL) {
+        if (!strcmp(env_str, "explicit")) {
+            stats_hugepages_set(STATS_HUGEPAGES_EXPLICIT);
+        } else if (!strcmp(env_str, "transparent")) {
+            stats_hugepages_set(STATS_HUGEPAGES_TRANSPARENT);
+        } else if (strcmp(env_str, "none")) {
+            AIM_DIE("Invalid IVS_STATS_HUGEPAGES (expected explicit, transparent or none)");
+        }
+    }
+
     ind_ovs_salt = get_entropy();
 
     ind_ovs_kflow_module_init();
@@ -256,7 +267,8 @@ ind_ovs_init(const char *datapath_name, bool hitless)
     }
 
     if ((ret = ind_soc_timer_event_register(
-        (ind_soc_timer_callback_f)ind_ovs_kflow_expire, NULL, 2345)) != 0) {
+        (ind_soc_timer_callback_f)ind_ovs_kflow_expire, NULL,
+        IND_OVS_KFLOW_EXPIRE_INTERVAL_MS)) != 0) {
         LOG_ERROR("failed to create timer");
         return ret;
     }
@@ -269,6 +281,7 @@ ind_ovs_init(const char *datapath_name, bool hitless)
 void
 ind_ovs_finish(void)
 {
+    ind_ovs_kflow_checkpoint();
     ind_ovs_port_finish();
     ind_ovs_upcall_finish();
     ind_ovs_pktin_socket_unregister(&ind_ovs_pktout_soc);
@@ -40,6 +40,8 @@
 #include <stats/stats.h>
 #include <debug_counter/debug_counter.h>
 #include <shared_debug_counter/shared_debug_counter.h>
+#include <log_histogram/log_histogram.h>
+#include <telemetry/telemetry.h>
 
 #define IND_OVS_MAX_PORTS 1024
 
@@ -61,13 +63,14 @@
 #define IND_OVS_DEFAULT_MSG_SIZE 32768
 
 /*
- * Limit the number of kernel flows for a given input port to prevent
- * a malicious guest from creating too many.
- * TODO should be configurable.
- * TODO increase or unlimit this for uplink ports?
+ * Default limit on the number of kernel flows for a given input port, to
+ * prevent a malicious guest from creating too many. See ind_ovs_kflow_limit.
  */
 #define IND_OVS_MAX_KFLOWS_PER_PORT 16384
 
+/* Interval between slices of the incremental kflow expiration scan (in ms) */
+#define IND_OVS_KFLOW_EXPIRE_INTERVAL_MS 250
+
 /* Per-port minimum average interval between packet-ins (in us) */
 #define PORT_PKTIN_INTERVAL 5000
 
@@ -119,10 +122,119 @@ struct ind_ovs_port {
     aim_ratelimiter_t pktin_limiter;
     struct ind_ovs_upcall_thread *upcall_thread;
     struct ind_ovs_port_counters pcounters;
+    /* Indexed by enum telemetry_port_counter */
+    struct telemetry_object pcounters_telemetry[TELEMETRY_PORT_RX_BAD_VLAN+1];
     uint64_t link_up_count;
     uint64_t link_down_count;
+    /* Per-port kflow install policy, zero to use the global default */
+    uint32_t kflow_install_packets;
+    uint32_t kflow_install_window_ms;
+    uint32_t kflow_limit; /* zero to use ind_ovs_kflow_limit */
+    /* Upcall scheduling, only used by the owning upcall process */
+    struct list_links upcall_links; /* ind_ovs_upcall_thread.active_ports */
+    int upcall_deficit;
+    unsigned upcall_active : 1;
+    uint16_t upcall_weight; /* multiplier for the DRR quantum, zero means 1 */
+    aim_ratelimiter_t upcall_admission_limiter; /* used in overload mode */
+    aim_ratelimiter_t drop_kflow_limiter; /* used in overload mode */
+};
+
+/*
+ * Per-port upcall scheduling counters, see ind_ovs_upcall_port_stats_get.
+ */
+struct ind_ovs_upcall_port_stats {
+    uint64_t upcalls; /* upcalls handled */
+    uint64_t service_time; /* microseconds spent handling upcalls */
+    uint64_t visits; /* DRR rounds in which the port was serviced */
+    uint64_t quantum_exhausted; /* visits that ended with upcalls still queued */
+    /* most upcalls handled in a single visit, at most the quantum times
+     * the weight. Netlink sockets don't report their queue length. */
+    uint64_t max_visit_upcalls;
+    uint64_t shed; /* upcalls dropped by admission control */
+    uint64_t drop_kflows; /* drop kflows requested */
+};
+
+/*
+ * Upcall latency and batching histograms, one set per upcall process.
+ * Latencies are in nanoseconds.
+ */
+struct ind_ovs_upcall_histograms {
+    struct log_histogram recv_to_pipeline; /* recvmmsg return to pipeline start */
+    struct log_histogram pipeline; /* pipeline_process duration */
+    struct log_histogram pipeline_to_execute; /* pipeline end to execute sent */
+    struct log_histogram recv_batch; /* messages returned by recvmmsg */
+    struct log_histogram tx_batch; /* execute messages per sendmsg */
+    struct log_histogram startup; /* fork to entering the upcall loop */
+};
+
+/*
+ * Progress of the current or last kflow revalidation pass
+ *
+ * Generations count changes to the pipeline. A pass revalidates the kflows
+ * affected by changes up to pass_generation.
+ */
+struct ind_ovs_kflow_revalidate_status {
+    bool running;
+    uint64_t generation; /* latest change */
+    uint64_t pass_generation; /* changes covered by the current or last pass */
+    uint64_t completed_generation; /* changes covered by the last completed pass */
+    uint64_t passes; /* completed passes */
+    uint64_t start_time; /* monotonic time in us */
+    uint64_t end_time; /* monotonic time in us, zero while running */
+    uint64_t busy_time; /* us spent revalidating */
+    uint32_t slices; /* task invocations */
+    uint32_t queued; /* kflows queued at the start of the pass */
+    uint32_t remaining; /* kflows not yet visited */
+    uint32_t revalidated;
+    uint32_t skipped; /* kflows whose dependencies didn't change */
+    uint32_t workers; /* worker processes used by the pass */
+    uint32_t workers_active; /* worker processes still running */
+};
+
+/* Cost and coverage of one cycle of the kflow expiration scan */
+struct ind_ovs_kflow_expire_cycle {
+    uint64_t start_time; /* monotonic time in us */
+    uint64_t end_time; /* monotonic time in us, zero while running */
+    uint64_t busy_time; /* us spent scanning */
+    uint32_t ticks; /* timer ticks that contributed a slice */
+    uint32_t kflows; /* kflows in the table at the start of the cycle */
+    uint32_t visited; /* kflows checked against their idle timeout */
+    uint32_t fetched; /* stale candidates fetched from the kernel */
+    uint32_t expired; /* kflows deleted */
+    uint32_t batches; /* batches of GET requests sent */
+};
+
+/*
+ * State of the incremental kflow expiration scan
+ *
+ * A cycle visits every kflow once. 'current' is the cycle in progress and
+ * 'last' the previous completed one.
+ */
+struct ind_ovs_kflow_expire_status {
+    uint64_t cycles; /* completed cycles */
+    uint32_t cycle_ms; /* target duration of the current cycle */
+    uint32_t slice; /* kflows to visit per tick */
+    uint32_t budget; /* kflows left to visit in this tick's slice */
+    struct ind_ovs_kflow_expire_cycle current;
+    struct ind_ovs_kflow_expire_cycle last;
+};
+
+#define IND_OVS_KFLOW_MASK_HISTOGRAM_BUCKETS 16
+
+/*
+ * Usage of kflow masks, see the mask budget in kflow.c
+ */
+struct ind_ovs_kflow_mask_status {
+    uint32_t masks; /* distinct masks in use */
+    uint32_t budget;
+    uint64_t widened; /* kflows given a more specific mask to stay in budget */
+    uint64_t over_budget; /* kflows that added a mask past the budget */
+    /* Masks used by 2^i to 2^(i+1)-1 kflows, the last bucket is unbounded */
+    uint32_t histogram[IND_OVS_KFLOW_MASK_HISTOGRAM_BUCKETS];
 };
 
+struct ind_ovs_kflow_mask;
+
 /*
  * A cached kernel flow.
  *
@@ -131,16 +243,26 @@ struct ind_ovs_port {
  */
 struct ind_ovs_kflow {
     struct list_links global_links; /* (global) kflows */
-    struct list_links bucket_links; /* (global) kflow_buckets[] */
+    uint32_t hash; /* of the key, see kflow_table */
     struct tcam_entry tcam_entry; /* (global) megaflow_tcam */
     struct stats stats; /* periodically synchronized with the kernel */
     uint16_t in_port;
     uint16_t num_stats_handles; /* size of stats_handles array */
     uint16_t actions_len; /* length of actions blob */
     uint64_t last_used; /* monotonic time in ms */
+    uint64_t hard_timeout; /* monotonic time in ms to delete the kflow, or zero */
+    bool install_pending; /* OVS_FLOW_CMD_NEW not yet acknowledged */
+    bool adopted; /* left by a previous instance, mask read from the kernel */
+    uint8_t idle_shift; /* idle timeout doubled this many times, see kflow.c */
+    bool referenced; /* packets seen since the eviction clock last passed */
+    bool mask_widened; /* mask is more specific than the pipeline requires */
     struct ind_ovs_parsed_key mask;
+    struct ind_ovs_kflow_mask *mask_entry; /* refcounted entry for 'mask' */
     void *actions; /* payload of actions nlattr */
     struct stats_handle *stats_handles;
+    uint32_t revalidate_index; /* slot in the revalidation pass, or UINT32_MAX */
+    const void **deps; /* pipeline objects consulted, see pipeline_add_dependency */
+    uint32_t num_deps; /* size of deps array */
     struct nlattr key[0];
 };
 
@@ -172,11 +294,22 @@ void ind_ovs_key_to_match(const struct ind_ovs_parsed_key *pkey, of_version_t ve
 
 /* Management of the kernel flow table */
 indigo_error_t ind_ovs_kflow_add(const struct nlattr *key);
+indigo_error_t ind_ovs_kflow_add_drop(const struct nlattr *key);
 void ind_ovs_kflow_sync_stats(struct ind_ovs_kflow *kflow);
 void ind_ovs_kflow_invalidate(struct ind_ovs_kflow *kflow);
 void ind_ovs_kflow_invalidate_all(void);
+void ind_ovs_kflow_mark_dirty(const void *object);
+void ind_ovs_kflow_mark_all_dirty(void);
+uint64_t ind_ovs_kflow_generation(void);
+void ind_ovs_kflow_revalidate(void);
+void ind_ovs_kflow_revalidate_status_get(struct ind_ovs_kflow_revalidate_status *status);
 void ind_ovs_kflow_expire(void);
+void ind_ovs_kflow_expire_status_get(struct ind_ovs_kflow_expire_status *status);
+void ind_ovs_kflow_mask_status_get(struct ind_ovs_kflow_mask_status *status);
 void ind_ovs_kflow_flush(void);
+void ind_ovs_kflow_adopt(void);
+void ind_ovs_kflow_checkpoint(void);
+uint32_t ind_ovs_port_kflow_limit(const struct ind_ovs_port *port);
 void ind_ovs_kflow_module_init(void);
 
 /* Management of the port set */
@@ -200,6 +333,10 @@ void ind_ovs_upcall_finish(void);
 void ind_ovs_upcall_register(struct ind_ovs_port *port);
 void ind_ovs_upcall_unregister(struct ind_ovs_port *port);
 void ind_ovs_upcall_respawn(void);
+const struct ind_ovs_upcall_port_stats *ind_ovs_upcall_port_stats_get(struct ind_ovs_port *port);
+int ind_ovs_upcall_num_threads(void);
+void ind_ovs_upcall_histograms_get(int thread_index, struct ind_ovs_upcall_histograms *result);
+void ind_ovs_upcall_histograms_clear(void);
 
 /* Interface of the multicast submodule */
 void ind_ovs_multicast_init(void);
@@ -220,6 +357,7 @@ void ind_ovs_vlan_stats_init(void);
 /* Interface of the barrier submodule */
 void ind_ovs_barrier_init(void);
 void ind_ovs_barrier_defer_revalidation_internal(void);
+void ind_ovs_barrier_revalidation_complete(uint64_t generation);
 
 /* Interface of the hitless submodule */
 void ind_ovs_hitless_init(void);
@@ -245,6 +383,7 @@ void ind_ovs_dump_msg(const struct nlmsghdr *nlh);
 /* Utility functions */
 uint32_t get_entropy(void);
 uint64_t monotonic_us(void);
+uint64_t monotonic_ns(void);
 struct nl_sock *ind_ovs_create_nlsock(void);
 struct nl_msg* ind_ovs_create_nlmsg(int family, int cmd);
 struct nl_msg *ind_ovs_recv_nlmsg(struct nl_sock *sk);
@@ -308,6 +447,70 @@ extern bool ind_ovs_disable_megaflows;
  */
 extern uint32_t ind_ovs_salt;
 
+/*
+ * Number of upcalls each port may have handled per deficit round robin round,
+ * before multiplying by the port's weight.
+ * Set with the environment variable IVS_UPCALL_QUANTUM.
+ */
+extern uint32_t ind_ovs_upcall_quantum;
+
+/*
+ * Maximum time in microseconds an upcall process spins polling its ports
+ * before sleeping in epoll_wait. Zero (the default) disables busy polling.
+ * Set with the environment variable IVS_UPCALL_BUSY_POLL_US.
+ */
+extern uint32_t ind_ovs_upcall_busy_poll_us;
+
+/*
+ * Upcall overload protection. See ind_ovs_upcall_check_overload.
+ *
+ * ind_ovs_upcall_overload_budget_us is the longest a round of upcall handling
+ * may take before the upcall process enters overload mode, zero disables
+ * overload mode. ind_ovs_upcall_port_rate and ind_ovs_upcall_port_burst
+ * configure the per-port token buckets used in overload mode. If
+ * ind_ovs_upcall_overload_drop_kflows is set, shed upcalls may also install
+ * short-lived kflows dropping matching packets in the kernel.
+ *
+ * Set with the environment variables IVS_UPCALL_OVERLOAD_BUDGET_US,
+ * IVS_UPCALL_PORT_RATE, IVS_UPCALL_PORT_BURST and
+ * IVS_UPCALL_OVERLOAD_DROP_KFLOWS=1.
+ */
+extern uint32_t ind_ovs_upcall_overload_budget_us;
+extern uint32_t ind_ovs_upcall_port_rate;
+extern uint32_t ind_ovs_upcall_port_burst;
+extern bool ind_ovs_upcall_overload_drop_kflows;
+
+/*
+ * Default kflow install policy: request a kflow once a key has been seen in
+ * this many upcalls within roughly this many milliseconds.
+ * Set with the environment variables IVS_KFLOW_INSTALL_PACKETS and
+ * IVS_KFLOW_INSTALL_WINDOW_MS.
+ */
+extern uint32_t ind_ovs_kflow_install_packets;
+extern uint32_t ind_ovs_kflow_install_window_ms;
+
+/*
+ * Number of processes to fork for large kflow revalidation passes. Zero
+ * uses one per upcall thread, one disables parallel revalidation.
+ * Set with the environment variable IVS_REVALIDATE_WORKERS.
+ */
+extern uint32_t ind_ovs_kflow_revalidate_workers;
+
+/*
+ * Default maximum number of kflows per input port. Once a port reaches its
+ * limit each new kflow evicts a cold one. Set with the environment variable
+ * IVS_KFLOW_LIMIT or the "kflow-limit" CLI command.
+ */
+extern uint32_t ind_ovs_kflow_limit;
+
+/*
+ * Number of distinct kflow masks past which new kflows are given an existing,
+ * more specific mask where one exists. Zero disables the budget.
+ * Set with the environment variable IVS_KFLOW_MASK_BUDGET or the
+ * "kflow-masks" CLI command.
+ */
+extern uint32_t ind_ovs_kflow_mask_budget;
+
 /*
  * Netlink socket to be used for sending pktin's to the controller from
  * pktout path.
@@ -0,0 +1,428 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <OVSDriver/ovsdriver_config.h>
+
+#if OVSDRIVER_CONFIG_INCLUDE_UCLI == 1
+
+#include "ovs_driver_int.h"
+#include <OVSDriver/ovsdriver.h>
+#include <uCli/ucli.h>
+#include <uCli/ucli_argparse.h>
+#include <uCli/ucli_handler_macros.h>
+
+static ucli_status_t
+ovsdriver_ucli_ucli__kflow_install_policy__(ucli_context_t* uc)
+{
+    UCLI_COMMAND_INFO(uc,
+                      "kflow-install-policy", -1,
+                      "$summary#Show or set the kflow install policy."
+                      "$args#[<port> <packets> <window_ms>]");
+
+    if (uc->pargs->count == 3) {
+        char *port_name;
+        int packets, window_ms;
+        UCLI_ARGPARSE_OR_RETURN(uc, "sii", &port_name, &packets, &window_ms);
+        if (packets < 0 || window_ms < 0) {
+            return ucli_error(uc, "invalid policy");
+        }
+        indigo_error_t rv = ind_ovs_port_kflow_install_policy_set(
+            port_name, packets, window_ms);
+        if (rv < 0) {
+            return ucli_error(uc, "failed to set policy on %s: %s",
+                              port_name, indigo_strerror(rv));
+        }
+        return UCLI_STATUS_OK;
+    } else if (uc->pargs->count != 0) {
+        return ucli_error(uc, "expected 0 or 3 arguments");
+    }
+
+    ucli_printf(uc, "default: %u packets within %u ms\n",
+                ind_ovs_kflow_install_packets, ind_ovs_kflow_install_window_ms);
+
+    int i;
+    for (i = 0; i < IND_OVS_MAX_PORTS; i++) {
+        struct ind_ovs_port *port = ind_ovs_ports[i];
+        if (port == NULL) {
+            continue;
+        }
+        if (port->kflow_install_packets || port->kflow_install_window_ms) {
+            ucli_printf(uc, "%s: %u packets within %u ms\n", port->ifname,
+                        port->kflow_install_packets ?
+                            port->kflow_install_packets : ind_ovs_kflow_install_packets,
+                        port->kflow_install_window_ms ?
+                            port->kflow_install_window_ms : ind_ovs_kflow_install_window_ms);
+        }
+    }
+
+    return UCLI_STATUS_OK;
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__upcall_weight__(ucli_context_t* uc)
+{
+    char *port_name;
+    int weight;
+
+    UCLI_COMMAND_INFO(uc,
+                      "upcall-weight", 2,
+                      "$summary#Set the upcall scheduling weight of a port."
+                      "$args#<port> <weight>");
+
+    UCLI_ARGPARSE_OR_RETURN(uc, "si", &port_name, &weight);
+
+    if (weight < 0) {
+        return ucli_error(uc, "invalid weight");
+    }
+
+    indigo_error_t rv = ind_ovs_port_upcall_weight_set(port_name, weight);
+    if (rv < 0) {
+        return ucli_error(uc, "failed to set weight on %s: %s",
+                          port_name, indigo_strerror(rv));
+    }
+
+    return UCLI_STATUS_OK;
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__upcall_ports__(ucli_context_t* uc)
+{
+    UCLI_COMMAND_INFO(uc,
+                      "upcall-ports", 0,
+                      "$summary#Show per-port upcall scheduling counters.");
+
+    ucli_printf(uc, "quantum: %u\n", ind_ovs_upcall_quantum);
+    ucli_printf(uc, "%-16s %6s %12s %14s %10s %10s %9s %10s %10s\n",
+                "port", "weight", "upcalls", "service_us",
+                "visits", "exhausted", "max_visit", "shed", "drop_kflow");
+
+    int i;
+    for (i = 0; i < IND_OVS_MAX_PORTS; i++) {
+        struct ind_ovs_port *port = ind_ovs_ports[i];
+        if (port == NULL) {
+            continue;
+        }
+        const struct ind_ovs_upcall_port_stats *stats =
+            ind_ovs_upcall_port_stats_get(port);
+        ucli_printf(uc, "%-16s %6u %12"PRIu64" %14"PRIu64" %10"PRIu64" %10"PRIu64" %9"PRIu64" %10"PRIu64" %10"PRIu64"\n",
+                    port->ifname, port->upcall_weight ? port->upcall_weight : 1,
+                    stats->upcalls, stats->service_time, stats->visits,
+                    stats->quantum_exhausted, stats->max_visit_upcalls,
+                    stats->shed, stats->drop_kflows);
+    }
+
+    return UCLI_STATUS_OK;
+}
+
+static void
+show_histogram(ucli_context_t* uc, const char *name,
+               const struct log_histogram *hist, uint64_t divisor)
+{
+    ucli_printf(uc, "%-20s %10"PRIu64" %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                name, hist->count,
+                hist->count ? (double)hist->sum / hist->count / divisor : 0.0,
+                (double)log_histogram_percentile(hist, 50) / divisor,
+                (double)log_histogram_percentile(hist, 90) / divisor,
+                (double)log_histogram_percentile(hist, 99) / divisor,
+                (double)log_histogram_percentile(hist, 99.9) / divisor,
+                (double)hist->max / divisor);
+}
+
+static void
+show_upcall_histograms(ucli_context_t* uc,
+                       const struct ind_ovs_upcall_histograms *histograms)
+{
+    ucli_printf(uc, "%-20s %10s %10s %10s %10s %10s %10s %10s\n",
+                "latency (us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    show_histogram(uc, "recv-to-pipeline", &histograms->recv_to_pipeline, 1000);
+    show_histogram(uc, "pipeline", &histograms->pipeline, 1000);
+    show_histogram(uc, "pipeline-to-execute", &histograms->pipeline_to_execute, 1000);
+    show_histogram(uc, "process-startup", &histograms->startup, 1000);
+    ucli_printf(uc, "%-20s %10s %10s %10s %10s %10s %10s %10s\n",
+                "batch size", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    show_histogram(uc, "recvmmsg", &histograms->recv_batch, 1);
+    show_histogram(uc, "tx-flush", &histograms->tx_batch, 1);
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__upcall_latency__(ucli_context_t* uc)
+{
+    struct ind_ovs_upcall_histograms histograms;
+
+    UCLI_COMMAND_INFO(uc,
+                      "upcall-latency", -1,
+                      "$summary#Show upcall latency and batch size histograms."
+                      "$args#[per-thread|clear]");
+
+    if (uc->pargs->count == 0) {
+        ind_ovs_upcall_histograms_get(-1, &histograms);
+        show_upcall_histograms(uc, &histograms);
+    } else if (uc->pargs->count == 1 && !strcmp(uc->pargs->args[0], "per-thread")) {
+        int i;
+        for (i = 0; i < ind_ovs_upcall_num_threads(); i++) {
+            ind_ovs_upcall_histograms_get(i, &histograms);
+            ucli_printf(uc, "upcall thread %d:\n", i);
+            show_upcall_histograms(uc, &histograms);
+        }
+    } else if (uc->pargs->count == 1 && !strcmp(uc->pargs->args[0], "clear")) {
+        ind_ovs_upcall_histograms_clear();
+    } else {
+        return ucli_error(uc, "usage: upcall-latency [per-thread|clear]");
+    }
+
+    return UCLI_STATUS_OK;
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__kflow_revalidation__(ucli_context_t* uc)
+{
+    struct ind_ovs_kflow_revalidate_status status;
+
+    UCLI_COMMAND_INFO(uc,
+                      "kflow-revalidation", 0,
+                      "$summary#Show kflow revalidation progress.");
+
+    ind_ovs_kflow_revalidate_status_get(&status);
+
+    uint64_t elapsed = 0;
+    if (status.running) {
+        elapsed = monotonic_us() - status.start_time;
+    } else if (status.passes) {
+        elapsed = status.end_time - status.start_time;
+    }
+
+    ucli_printf(uc, "state: %s\n", status.running ? "running" : "idle");
+    ucli_printf(uc, "generation: %"PRIu64" (pass %"PRIu64", completed %"PRIu64")\n",
+                status.generation, status.pass_generation,
+                status.completed_generation);
+    ucli_printf(uc, "passes: %"PRIu64"\n", status.passes);
+    ucli_printf(uc, "%s pass: %u/%u kflows visited, %u revalidated, %u skipped\n",
+                status.running ? "current" : "last",
+                status.queued - status.remaining, status.queued,
+                status.revalidated, status.skipped);
+    ucli_printf(uc, "%s pass time: %"PRIu64" us, %"PRIu64" us busy in %u slices\n",
+                status.running ? "current" : "last",
+                elapsed, status.busy_time, status.slices);
+    ucli_printf(uc, "%s pass workers: %u (%u running)\n",
+                status.running ? "current" : "last",
+                status.workers, status.workers_active);
+
+    return UCLI_STATUS_OK;
+}
+
+static void
+show_expire_cycle(ucli_context_t* uc, const char *name,
+                  const struct ind_ovs_kflow_expire_cycle *cycle)
+{
+    uint64_t elapsed = (cycle->end_time ? cycle->end_time : monotonic_us()) -
+        cycle->start_time;
+
+    ucli_printf(uc, "%s cycle: %u/%u kflows visited (%.1f%%), %u fetched in %u batches, %u expired\n",
+                name, cycle->visited, cycle->kflows,
+                cycle->kflows ? 100.0 * cycle->visited / cycle->kflows : 100.0,
+                cycle->fetched, cycle->batches, cycle->expired);
+    ucli_printf(uc, "%s cycle time: %"PRIu64" us, %"PRIu64" us busy in %u ticks\n",
+                name, elapsed, cycle->busy_time, cycle->ticks);
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__kflow_expiration__(ucli_context_t* uc)
+{
+    struct ind_ovs_kflow_expire_status status;
+
+    UCLI_COMMAND_INFO(uc,
+                      "kflow-expiration", 0,
+                      "$summary#Show kflow expiration scan cost and coverage.");
+
+    ind_ovs_kflow_expire_status_get(&status);
+
+    ucli_printf(uc, "cycles: %"PRIu64"\n", status.cycles);
+    ucli_printf(uc, "target cycle time: %u ms, %u kflows per %u ms tick\n",
+                status.cycle_ms, status.slice, IND_OVS_KFLOW_EXPIRE_INTERVAL_MS);
+    if (status.current.start_time && !status.current.end_time) {
+        show_expire_cycle(uc, "current", &status.current);
+    }
+    if (status.cycles) {
+        show_expire_cycle(uc, "last", &status.last);
+    }
+
+    return UCLI_STATUS_OK;
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__kflow_limit__(ucli_context_t* uc)
+{
+    UCLI_COMMAND_INFO(uc,
+                      "kflow-limit", -1,
+                      "$summary#Show or set the per-port kflow limits."
+                      "$args#[[<port>] <limit>]");
+
+    if (uc->pargs->count == 2) {
+        char *port_name;
+        int limit;
+        UCLI_ARGPARSE_OR_RETURN(uc, "si", &port_name, &limit);
+        if (limit < 0) {
+            return ucli_error(uc, "invalid limit");
+        }
+        indigo_error_t rv = ind_ovs_port_kflow_limit_set(port_name, limit);
+        if (rv < 0) {
+            return ucli_error(uc, "failed to set limit on %s: %s",
+                              port_name, indigo_strerror(rv));
+        }
+        return UCLI_STATUS_OK;
+    } else if (uc->pargs->count == 1) {
+        int limit;
+        UCLI_ARGPARSE_OR_RETURN(uc, "i", &limit);
+        if (limit <= 0) {
+            return ucli_error(uc, "invalid limit");
+        }
+        ind_ovs_kflow_limit = limit;
+        return UCLI_STATUS_OK;
+    } else if (uc->pargs->count != 0) {
+        return ucli_error(uc, "expected 0, 1 or 2 arguments");
+    }
+
+    ucli_printf(uc, "default: %u kflows\n", ind_ovs_kflow_limit);
+
+    int i;
+    for (i = 0; i < IND_OVS_MAX_PORTS; i++) {
+        struct ind_ovs_port *port = ind_ovs_ports[i];
+        if (port == NULL) {
+            continue;
+        }
+        ucli_printf(uc, "%s: %u/%u kflows%s\n", port->ifname, port->num_kflows,
+                    ind_ovs_port_kflow_limit(port),
+                    port->kflow_limit ? "" : " (default)");
+    }
+
+    return UCLI_STATUS_OK;
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__kflow_masks__(ucli_context_t* uc)
+{
+    struct ind_ovs_kflow_mask_status status;
+
+    UCLI_COMMAND_INFO(uc,
+                      "kflow-masks", -1,
+                      "$summary#Show kflow mask usage or set the mask budget."
+                      "$args#[<budget>]");
+
+    if (uc->pargs->count == 1) {
+        int budget;
+        UCLI_ARGPARSE_OR_RETURN(uc, "i", &budget);
+        if (budget < 0) {
+            return ucli_error(uc, "invalid budget");
+        }
+        ind_ovs_kflow_mask_budget = budget;
+        return UCLI_STATUS_OK;
+    } else if (uc->pargs->count != 0) {
+        return ucli_error(uc, "expected 0 or 1 arguments");
+    }
+
+    ind_ovs_kflow_mask_status_get(&status);
+
+    ucli_printf(uc, "masks: %u (budget %u)\n", status.masks, status.budget);
+    ucli_printf(uc, "widened: %"PRIu64", over budget: %"PRIu64"\n",
+                status.widened, status.over_budget);
+    ucli_printf(uc, "%-16s %8s\n", "kflows per mask", "masks");
+
+    int i;
+    for (i = 0; i < IND_OVS_KFLOW_MASK_HISTOGRAM_BUCKETS; i++) {
+        if (status.histogram[i] == 0) {
+            continue;
+        }
+        char range[32];
+        if (i == 0) {
+            snprintf(range, sizeof(range), "1");
+        } else if (i == IND_OVS_KFLOW_MASK_HISTOGRAM_BUCKETS - 1) {
+            snprintf(range, sizeof(range), "%u+", 1u << i);
+        } else {
+            snprintf(range, sizeof(range), "%u-%u", 1u << i, (2u << i) - 1);
+        }
+        ucli_printf(uc, "%-16s %8u\n", range, status.histogram[i]);
+    }
+
+    return UCLI_STATUS_OK;
+}
+
+static ucli_status_t
+ovsdriver_ucli_ucli__stats_arena__(ucli_context_t* uc)
+{
+    struct stats_usage usage;
+
+    UCLI_COMMAND_INFO(uc,
+                      "stats-arena", 0,
+                      "$summary#Show memory used by stats slots.");
+
+    stats_usage_get(&usage);
+
+    ucli_printf(uc, "slots: %u allocated, %u backed by %u segments\n",
+                usage.allocated, usage.slots, usage.segments);
+    ucli_printf(uc, "writers: %u\n", usage.writers);
+    ucli_printf(uc, "mapped: %"PRIu64" KB (%"PRIu64" KB hugepages, %"PRIu64" KB advised for THP)\n",
+                usage.mapped_bytes / 1024, usage.hugetlb_bytes / 1024,
+                usage.thp_bytes / 1024);
+    ucli_printf(uc, "free stack: %"PRIu64" KB\n", usage.free_stack_bytes / 1024);
+
+    return UCLI_STATUS_OK;
+}
+
+/* <auto.ucli.handlers.start> */
+static ucli_command_handler_f ovsdriver_ucli_ucli_handlers__[] =
+{
+    ovsdriver_ucli_ucli__kflow_install_policy__,
+    ovsdriver_ucli_ucli__upcall_weight__,
+    ovsdriver_ucli_ucli__upcall_ports__,
+    ovsdriver_ucli_ucli__upcall_latency__,
+    ovsdriver_ucli_ucli__kflow_revalidation__,
+    ovsdriver_ucli_ucli__kflow_expiration__,
+    ovsdriver_ucli_ucli__kflow_limit__,
+    ovsdriver_ucli_ucli__kflow_masks__,
+    ovsdriver_ucli_ucli__stats_arena__,
+    NULL
+};
+/* <auto.ucli.handlers.end> */
+
+static ucli_module_t
+ovsdriver_ucli_module__ =
+    {
+        "ovsdriver_ucli",
+        NULL,
+        ovsdriver_ucli_ucli_handlers__,
+        NULL,
+        NULL,
+    };
+
+ucli_node_t*
+ovsdriver_ucli_node_create(void)
+{
+    ucli_node_t* n;
+    ucli_module_init(&ovsdriver_ucli_module__);
+    n = ucli_node_create("ovsdriver", NULL, &ovsdriver_ucli_module__);
+    return n;
+}
+
+#else
+void*
+ovsdriver_ucli_node_create(void)
+{
+    return NULL;
+}
+#endif
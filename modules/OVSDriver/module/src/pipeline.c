@@ -31,7 +31,12 @@ indigo_fwd_pipeline_get(of_desc_str_t pipeline)
 indigo_error_t
 indigo_fwd_pipeline_set(of_desc_str_t pipeline)
 {
-    return pipeline_set(pipeline);
+    indigo_error_t rv = pipeline_set(pipeline);
+    if (rv == INDIGO_ERROR_NONE) {
+        /* Dependencies recorded by the old pipeline are meaningless now */
+        ind_ovs_barrier_defer_revalidation_internal();
+    }
+    return rv;
 }
 
 void
@@ -41,19 +41,137 @@
 #include <pwd.h>
 #include <sys/capability.h>
 #include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <dirent.h>
 
 #define DEFAULT_NUM_UPCALL_THREADS 4
 #define MAX_UPCALL_THREADS 16
-#define NUM_UPCALL_BUFFERS 64
 #define MAX_KEY_SIZE 4096
 
-#define BLOOM_BUCKETS 65536
-#define BLOOM_CAPACITY 4096
+/*
+ * Bounds for the adaptive recvmmsg batch size. See ind_ovs_upcall_pool_adapt.
+ *
+ * A queued execute message takes up to 3 iovecs, and sendmsg accepts at most
+ * UIO_MAXIOV (1024).
+ */
+#define MIN_UPCALL_BATCH 16
+#define MAX_UPCALL_BATCH 256
+
+/*
+ * Each receive slot is a small buffer that fits the common case plus a spill
+ * buffer for the rest of a large message. The spill buffers are reserved
+ * address space and only cost memory once a large message is received.
+ */
+#define UPCALL_SMALL_BUFFER_SIZE 2048
+#define UPCALL_SPILL_BUFFER_SIZE (IND_OVS_DEFAULT_MSG_SIZE - UPCALL_SMALL_BUFFER_SIZE)
+
+/*
+ * The batch size is limited so that a full batch of average sized messages
+ * fits in this many bytes.
+ */
+#define UPCALL_POOL_TARGET_BYTES (1024*1024)
+
+/*
+ * Receive buffers beyond the minimum batch are returned to the kernel after
+ * an upcall process has been idle this long.
+ */
+#define UPCALL_POOL_IDLE_MS 1000
+
+/*
+ * Execute actions for a whole batch are built in one message. It is flushed
+ * early if less than UPCALL_ACTIONS_HEADROOM bytes are left.
+ */
+#define UPCALL_ACTIONS_MSG_SIZE (IND_OVS_DEFAULT_MSG_SIZE*2)
+#define UPCALL_ACTIONS_HEADROOM (IND_OVS_DEFAULT_MSG_SIZE/2)
+
+/*
+ * Stats handles an upcall can collect before the list moves to the heap.
+ * A packet typically hits a table, a flow and maybe a group bucket in each
+ * of a few tables.
+ */
+#define UPCALL_STATS_STUB_HANDLES 32
+
+/*
+ * Default number of upcalls a port may have handled in each round of the
+ * deficit round robin scheduler. Multiplied by the port's weight.
+ */
+#define DEFAULT_UPCALL_QUANTUM 64
+
+/*
+ * Lower bound for the adaptive busy poll budget, in microseconds.
+ * See ind_ovs_upcall_busy_poll.
+ */
+#define MIN_BUSY_POLL_US 8
+
+/*
+ * Overload detection. An upcall process enters overload mode when a DRR round
+ * takes longer than ind_ovs_upcall_overload_budget_us or ports still have
+ * upcalls queued after OVERLOAD_BACKLOG_ROUNDS consecutive rounds. It leaves
+ * overload mode OVERLOAD_HOLD_US after the last time either happened.
+ */
+#define DEFAULT_OVERLOAD_BUDGET_US 10000
+#define OVERLOAD_BACKLOG_ROUNDS 8
+#define OVERLOAD_HOLD_US (1000*1000)
+
+/* Per-port admission control defaults for overload mode */
+#define DEFAULT_UPCALL_PORT_RATE 5000 /* upcalls per second */
+#define DEFAULT_UPCALL_PORT_BURST 500
+
+/* The token bucket refills at a whole number of microseconds per upcall */
+#define MAX_UPCALL_PORT_RATE (1000*1000)
+#define MAX_UPCALL_PORT_BURST (1000*1000)
+
+/* Per-port limit on drop kflow requests in overload mode, per second */
+#define DROP_KFLOW_RATE 100
+#define DROP_KFLOW_BURST 10
+
+/*
+ * Header of a message on the kflow socket. Followed by the flow key.
+ */
+struct ind_ovs_kflow_request {
+    uint32_t flags;
+};
+
+/* Install a short-lived kflow that drops matching packets */
+#define KFLOW_REQUEST_F_DROP 1
+
+/*
+ * Dimensions of the count-min sketch used by ind_ovs_upcall_seen_key.
+ * SKETCH_COLUMNS must be a power of 2.
+ */
+#define SKETCH_ROWS 4
+#define SKETCH_COLUMNS 2048
+
+/* Defaults for the kflow install policy. See ind_ovs_upcall_seen_key. */
+#define DEFAULT_KFLOW_INSTALL_PACKETS 2
+#define DEFAULT_KFLOW_INSTALL_WINDOW_MS 1000
+
+/*
+ * A received upcall
+ *
+ * 'nlh' is contiguous and used for parsing. If the message spilled out of
+ * its small buffer it points to a copy, otherwise it is the same as
+ * iov[0].iov_base. The execute message is sent from 'iov' so the packet isn't
+ * copied again.
+ */
+struct ind_ovs_upcall_msg {
+    struct nlmsghdr *nlh;
+    struct iovec iov[2];
+};
+
+/* A single counter in the count-min sketch */
+struct ind_ovs_upcall_sketch_cell {
+    uint32_t last_ms; /* time of the last increment, truncated monotonic ms */
+    uint32_t count;
+};
 
 struct ind_ovs_upcall_thread {
     int pid;
     int index;
 
+    /* Time the upcall process was forked, in ns */
+    uint64_t spawn_time;
+
     /* Epoll set containing all upcall netlink sockets assigned to this thread */
     int epfd;
 
@@ -68,23 +186,64 @@ struct ind_ovs_upcall_thread {
 
     /* Cached here so we don't need to reallocate it every time */
     struct xbuf stats;
+    struct stats_handle stats_stub[UPCALL_STATS_STUB_HANDLES];
 
-    /* Preallocated messages used by the upcall thread for send and recv. */
-    struct nl_msg *msgs[NUM_UPCALL_BUFFERS];
+    /*
+     * Receive buffers, allocated by the upcall process. Slot i is the small
+     * buffer at recv_small + i * UPCALL_SMALL_BUFFER_SIZE followed by the
+     * spill buffer at recv_spill + i * UPCALL_SPILL_BUFFER_SIZE.
+     * See ind_ovs_upcall_pool_init.
+     */
+    char *recv_small;
+    char *recv_spill;
+
+    /* Contiguous copy of a message that used its spill buffer */
+    char *spill_copy;
+
+    /* Current recvmmsg batch size. See ind_ovs_upcall_pool_adapt. */
+    int recv_batch;
+
+    /* Moving average of the received message size */
+    uint32_t avg_msg_size;
+
+    /* Slots touched since the pool was last released */
+    int recv_high_water;
+    bool recv_spilled;
 
     /*
      * Structures used by recvmmsg to receive multiple netlink messages at
-     * once. These point into the preallocated messages above.
+     * once. These point into the receive buffers above.
      */
-    struct iovec iovecs[NUM_UPCALL_BUFFERS];
-    struct mmsghdr msgvec[NUM_UPCALL_BUFFERS];
+    struct iovec iovecs[MAX_UPCALL_BATCH][2];
+    struct mmsghdr msgvec[MAX_UPCALL_BATCH];
 
     /*
      * To reduce the number of user/kernel transitions we queue up
      * OVS_PACKET_CMD_EXECUTE msgs to send in one call to sendmsg.
+     *
+     * Each execute is the received message followed by its actions, which
+     * are built in actions_msg.
      */
-    struct iovec tx_queue[NUM_UPCALL_BUFFERS];
+    struct iovec tx_queue[MAX_UPCALL_BATCH*3];
     int tx_queue_len;
+    int tx_queue_msgs;
+    struct nl_msg *actions_msg;
+
+    /* Time each queued execute message left the pipeline, for histograms */
+    uint64_t tx_queue_times[MAX_UPCALL_BATCH];
+
+    /* Time the current batch was returned by recvmmsg, in ns */
+    uint64_t recv_time;
+
+    /* Points into ind_ovs_upcall_histograms, which is shared memory */
+    struct ind_ovs_upcall_histograms *histograms;
+
+    /*
+     * Overload mode. See ind_ovs_upcall_check_overload.
+     */
+    bool overloaded;
+    uint64_t overload_until; /* monotonic us */
+    int backlog_rounds;
 
     /*
      * Whether the VERBOSE log flags is set. Cached here so we only have to
@@ -92,21 +251,48 @@ struct ind_ovs_upcall_thread {
      */
     bool log_upcalls;
 
+    /*
+     * Monotonic time in ms, sampled once per recvmmsg batch.
+     */
+    uint32_t now_ms;
+
     /*
      * See ind_ovs_upcall_seen_key.
      */
-    uint8_t bloom_filter[BLOOM_BUCKETS/8];
-    uint16_t bloom_filter_count;
+    struct ind_ovs_upcall_sketch_cell sketch[SKETCH_ROWS][SKETCH_COLUMNS];
 
     /* Used to increment stats */
     struct stats_writer *stats_writer;
+
+    /*
+     * Ports with queued upcalls, in deficit round robin order.
+     * See ind_ovs_upcall_drr_round.
+     */
+    struct list_head active_ports;
+
+    /* Ports assigned to this thread, only valid in the upcall process */
+    struct ind_ovs_port **ports;
+    int num_ports;
+
+    /*
+     * Current busy poll budget in microseconds, between MIN_BUSY_POLL_US and
+     * ind_ovs_upcall_busy_poll_us. See ind_ovs_upcall_busy_poll.
+     */
+    uint32_t busy_poll_budget;
 };
 
-static void ind_ovs_handle_port_upcalls(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port);
-static void ind_ovs_handle_one_upcall(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port, struct nl_msg *msg);
-static void ind_ovs_handle_packet_miss(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port, struct nl_msg *msg, struct nlattr **attrs);
-static bool ind_ovs_upcall_seen_key(struct ind_ovs_upcall_thread *thread, struct nlattr *key);
-static void ind_ovs_upcall_request_kflow(struct ind_ovs_upcall_thread *thread, struct nlattr *key);
+static int ind_ovs_upcall_drr_round(struct ind_ovs_upcall_thread *thread);
+static void ind_ovs_upcall_busy_poll(struct ind_ovs_upcall_thread *thread);
+static int ind_ovs_handle_port_upcalls(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port, int budget, bool *drained);
+static void ind_ovs_handle_one_upcall(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port, struct ind_ovs_upcall_msg *msg);
+static void ind_ovs_handle_packet_miss(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port, struct ind_ovs_upcall_msg *msg, struct nlattr **attrs);
+static void ind_ovs_upcall_flush_tx(struct ind_ovs_upcall_thread *thread, int fd);
+static void ind_ovs_upcall_pool_adapt(struct ind_ovs_upcall_thread *thread, int vlen, int n, uint32_t bytes);
+static void ind_ovs_upcall_pool_release(struct ind_ovs_upcall_thread *thread);
+static bool ind_ovs_upcall_seen_key(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port, struct nlattr *key);
+static void ind_ovs_upcall_request_kflow(struct ind_ovs_upcall_thread *thread, struct nlattr *key, uint32_t flags);
+static bool ind_ovs_upcall_admit(struct ind_ovs_upcall_thread *thread, struct ind_ovs_port *port, struct nlmsghdr *nlh);
+static void ind_ovs_upcall_check_overload(struct ind_ovs_upcall_thread *thread, uint64_t start_time, uint64_t end_time);
 static void ind_ovs_upcall_thread_init(struct ind_ovs_upcall_thread *thread, int parent_pid);
 static void ind_ovs_upcall_respawn_child(struct ind_ovs_upcall_thread *thread);
 
@@ -116,6 +302,24 @@ static int nobody_uid;
 static int sigfd;
 static int shutdown_pipe[2];
 
+/*
+ * Written by the upcall process that owns the port, so the array lives in
+ * shared memory. Indexed by datapath port number.
+ */
+static struct ind_ovs_upcall_port_stats *ind_ovs_upcall_port_stats;
+
+/* Indexed by upcall thread, shared memory */
+static struct ind_ovs_upcall_histograms *ind_ovs_upcall_histograms;
+
+uint32_t ind_ovs_upcall_quantum = DEFAULT_UPCALL_QUANTUM;
+uint32_t ind_ovs_upcall_busy_poll_us;
+uint32_t ind_ovs_upcall_overload_budget_us = DEFAULT_OVERLOAD_BUDGET_US;
+uint32_t ind_ovs_upcall_port_rate = DEFAULT_UPCALL_PORT_RATE;
+uint32_t ind_ovs_upcall_port_burst = DEFAULT_UPCALL_PORT_BURST;
+bool ind_ovs_upcall_overload_drop_kflows;
+uint32_t ind_ovs_kflow_install_packets = DEFAULT_KFLOW_INSTALL_PACKETS;
+uint32_t ind_ovs_kflow_install_window_ms = DEFAULT_KFLOW_INSTALL_WINDOW_MS;
+
 DEBUG_COUNTER(kflow_request, "ovsdriver.upcall.kflow_request", "Kernel flow requested by upcall process");
 DEBUG_COUNTER(kflow_request_error, "ovsdriver.upcall.kflow_request_error", "Error on kernel flow request socket");
 DEBUG_COUNTER(respawn, "ovsdriver.upcall.respawn", "Respawned upcall processes");
@@ -125,6 +329,15 @@ SHARED_DEBUG_COUNTER(upcall, "ovsdriver.upcall", "Upcall from the kernel");
 SHARED_DEBUG_COUNTER(wakeup, "ovsdriver.upcall.wakeup", "Upcall process woken up");
 SHARED_DEBUG_COUNTER(upcall_time, "ovsdriver.upcall.time", "Total time in microseconds spent handling upcalls");
 SHARED_DEBUG_COUNTER(kflow_socket_full, "ovsdriver.upcall.kflow_socket_full", "Kernel flow socket full");
+SHARED_DEBUG_COUNTER(busy_poll_useful, "ovsdriver.upcall.busy_poll_useful", "Busy poll pass that found upcalls");
+SHARED_DEBUG_COUNTER(busy_poll_empty, "ovsdriver.upcall.busy_poll_empty", "Busy poll pass that found no upcalls");
+SHARED_DEBUG_COUNTER(overload, "ovsdriver.upcall.overload", "Upcall process entered overload mode");
+SHARED_DEBUG_COUNTER(shed, "ovsdriver.upcall.shed", "Upcall dropped by admission control in overload mode");
+SHARED_DEBUG_COUNTER(drop_kflow_request, "ovsdriver.upcall.drop_kflow_request", "Drop kflow requested in overload mode");
+SHARED_DEBUG_COUNTER(spill, "ovsdriver.upcall.spill", "Upcall too large for a small receive buffer");
+SHARED_DEBUG_COUNTER(truncated, "ovsdriver.upcall.truncated", "Upcall dropped because it did not fit in a receive slot");
+SHARED_DEBUG_COUNTER(pool_release, "ovsdriver.upcall.pool_release", "Idle upcall process returned receive buffers to the kernel");
+SHARED_DEBUG_COUNTER(kflow_install_suppressed, "ovsdriver.upcall.kflow_install_suppressed", "Kernel flow not requested because the key has not met the install policy");
 
 #if defined(__GNUC__) && !defined(__clang__)
 #pragma GCC optimize (4)
@@ -136,51 +349,291 @@ ind_ovs_upcall_thread_main(struct ind_ovs_upcall_thread *thread)
     while (1) {
         struct epoll_event events[128];
         thread->log_upcalls = aim_log_enabled(AIM_LOG_STRUCT_POINTER, AIM_LOG_FLAG_VERBOSE);
-        int n = epoll_wait(thread->epfd, events, AIM_ARRAYSIZE(events), -1);
+
+        if (ind_ovs_upcall_busy_poll_us > 0 && list_empty(&thread->active_ports)) {
+            ind_ovs_upcall_busy_poll(thread);
+        }
+
+        /*
+         * Don't sleep while ports still have upcalls queued. Otherwise wake
+         * up to release the receive buffers if we stay idle.
+         */
+        int timeout;
+        if (!list_empty(&thread->active_ports)) {
+            timeout = 0;
+        } else if (thread->recv_high_water > MIN_UPCALL_BATCH || thread->recv_spilled) {
+            timeout = UPCALL_POOL_IDLE_MS;
+        } else {
+            timeout = -1;
+        }
+
+        int n = epoll_wait(thread->epfd, events, AIM_ARRAYSIZE(events), timeout);
         if (n < 0 && errno != EINTR) {
             LOG_ERROR("epoll_wait failed: %s", strerror(errno));
             abort();
+        } else if (n == 0 && timeout > 0) {
+            ind_ovs_upcall_pool_release(thread);
         } else if (n > 0) {
             debug_counter_inc(&wakeup);
-            uint64_t start_time = monotonic_us();
             int j;
             for (j = 0; j < n; j++) {
                 if (events[j].data.ptr == shutdown_pipe) {
                     raise(SIGKILL);
                 } else {
-                    ind_ovs_handle_port_upcalls(thread, events[j].data.ptr);
+                    struct ind_ovs_port *port = events[j].data.ptr;
+                    if (!port->upcall_active) {
+                        port->upcall_active = 1;
+                        port->upcall_deficit = 0;
+                        list_push(&thread->active_ports, &port->upcall_links);
+                    }
                 }
             }
+        }
+
+        if (!list_empty(&thread->active_ports)) {
+            uint64_t start_time = monotonic_us();
+            ind_ovs_upcall_drr_round(thread);
             uint64_t elapsed = monotonic_us() - start_time;
             debug_counter_add(&upcall_time, elapsed);
         }
     }
 }
 
+/*
+ * Give each port with queued upcalls one turn, in deficit round robin order.
+ *
+ * A port's deficit grows by the quantum times its weight each round and
+ * shrinks by the number of upcalls handled. Once a port's socket is drained
+ * it leaves the active list and is readded when epoll next reports it
+ * readable. This bounds how long one busy port can delay the other ports on
+ * the same upcall process.
+ */
+static int
+ind_ovs_upcall_drr_round(struct ind_ovs_upcall_thread *thread)
+{
+    int total = 0;
+    uint64_t round_start_time = monotonic_us();
+    thread->overloaded = round_start_time < thread->overload_until;
+
+    list_links_t *cur, *next;
+    LIST_FOREACH_SAFE(&thread->active_ports, cur, next) {
+        struct ind_ovs_port *port = container_of(cur, upcall_links, struct ind_ovs_port);
+        struct ind_ovs_upcall_port_stats *port_stats =
+            &ind_ovs_upcall_port_stats[port->dp_port_no];
+
+        port->upcall_deficit += ind_ovs_upcall_quantum *
+            (port->upcall_weight ? port->upcall_weight : 1);
+
+        uint64_t start_time = monotonic_us();
+        bool drained;
+        int count = ind_ovs_handle_port_upcalls(thread, port,
+                                                port->upcall_deficit, &drained);
+        uint64_t elapsed = monotonic_us() - start_time;
+
+        if (count > 0) {
+            port_stats->upcalls += count;
+            port_stats->service_time += elapsed;
+            port_stats->visits++;
+            if (count > port_stats->max_visit_upcalls) {
+                port_stats->max_visit_upcalls = count;
+            }
+            total += count;
+        }
+
+        if (drained) {
+            list_remove(cur);
+            port->upcall_active = 0;
+            port->upcall_deficit = 0;
+        } else {
+            port_stats->quantum_exhausted++;
+            port->upcall_deficit -= count;
+        }
+    }
+
+    if (total > 0) {
+        ind_ovs_upcall_check_overload(thread, round_start_time, monotonic_us());
+    }
+
+    return total;
+}
+
+/*
+ * Enter overload mode if the last DRR round ran over its time budget or
+ * ports have had upcalls queued for several rounds in a row.
+ *
+ * In overload mode each port's upcalls must pass a token bucket before
+ * running through the pipeline (see ind_ovs_upcall_admit), so that a port
+ * storming upcalls can't monopolize the upcall process.
+ */
 static void
+ind_ovs_upcall_check_overload(struct ind_ovs_upcall_thread *thread,
+                              uint64_t start_time, uint64_t end_time)
+{
+    if (ind_ovs_upcall_overload_budget_us == 0 || ind_ovs_benchmark_mode) {
+        return;
+    }
+
+    if (list_empty(&thread->active_ports)) {
+        thread->backlog_rounds = 0;
+    } else {
+        thread->backlog_rounds++;
+    }
+
+    if (end_time - start_time > ind_ovs_upcall_overload_budget_us ||
+            thread->backlog_rounds >= OVERLOAD_BACKLOG_ROUNDS) {
+        if (end_time >= thread->overload_until) {
+            debug_counter_inc(&overload);
+            if (thread->log_upcalls) {
+                LOG_VERBOSE("Upcall process %d entering overload mode", thread->index);
+            }
+        }
+        thread->overload_until = end_time + OVERLOAD_HOLD_US;
+    }
+}
+
+/*
+ * Admission control for upcalls in overload mode
+ *
+ * Returns false if the upcall should be dropped without running the
+ * pipeline. Optionally requests a short-lived drop kflow for the shed packet's
+ * key. The drop kflow requests are rate limited per port, so they're most
+ * likely to hit the keys responsible for the most upcalls.
+ */
+static bool
+ind_ovs_upcall_admit(struct ind_ovs_upcall_thread *thread,
+                     struct ind_ovs_port *port,
+                     struct nlmsghdr *nlh)
+{
+    uint64_t now = thread->recv_time / 1000;
+
+    if (nlh->nlmsg_type != ovs_packet_family) {
+        return true;
+    }
+
+    if (aim_ratelimiter_limit(&port->upcall_admission_limiter, now) == 0) {
+        return true;
+    }
+
+    struct ind_ovs_upcall_port_stats *port_stats =
+        &ind_ovs_upcall_port_stats[port->dp_port_no];
+    port_stats->shed++;
+    debug_counter_inc(&shed);
+
+    if (ind_ovs_upcall_overload_drop_kflows && !ind_ovs_disable_kflows &&
+            aim_ratelimiter_limit(&port->drop_kflow_limiter, now) == 0) {
+        struct nlattr *key = nlmsg_find_attr(nlh, GENL_HDRLEN + sizeof(struct ovs_header),
+                                             OVS_PACKET_ATTR_KEY);
+        if (key) {
+            port_stats->drop_kflows++;
+            debug_counter_inc(&drop_kflow_request);
+            ind_ovs_upcall_request_kflow(thread, key, KFLOW_REQUEST_F_DROP);
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Poll all of this thread's ports without blocking until we find upcalls or
+ * the busy poll budget runs out.
+ *
+ * This trades a CPU for the epoll wakeup latency. The budget adapts to the
+ * load: it doubles (up to ind_ovs_upcall_busy_poll_us) each time polling
+ * finds work and halves (down to MIN_BUSY_POLL_US) each time it expires, so
+ * an idle upcall process quickly goes back to sleeping in epoll_wait.
+ */
+static void
+ind_ovs_upcall_busy_poll(struct ind_ovs_upcall_thread *thread)
+{
+    uint64_t start_time = monotonic_us();
+    uint64_t deadline = start_time + thread->busy_poll_budget;
+    uint64_t now;
+
+    do {
+        int i;
+        for (i = 0; i < thread->num_ports; i++) {
+            struct ind_ovs_port *port = thread->ports[i];
+            if (!port->upcall_active) {
+                port->upcall_active = 1;
+                port->upcall_deficit = 0;
+                list_push(&thread->active_ports, &port->upcall_links);
+            }
+        }
+
+        uint64_t poll_start_time = monotonic_us();
+        int count = ind_ovs_upcall_drr_round(thread);
+        now = monotonic_us();
+
+        if (count > 0) {
+            debug_counter_inc(&busy_poll_useful);
+            debug_counter_add(&upcall_time, now - poll_start_time);
+            thread->busy_poll_budget *= 2;
+            if (thread->busy_poll_budget > ind_ovs_upcall_busy_poll_us) {
+                thread->busy_poll_budget = ind_ovs_upcall_busy_poll_us;
+            }
+            return;
+        }
+
+        debug_counter_inc(&busy_poll_empty);
+    } while (now < deadline);
+
+    thread->busy_poll_budget /= 2;
+    if (thread->busy_poll_budget < MIN_BUSY_POLL_US) {
+        thread->busy_poll_budget = MIN_BUSY_POLL_US;
+    }
+}
+
+/*
+ * Handle up to 'budget' upcalls queued on the port's netlink socket.
+ *
+ * Returns the number of upcalls handled and sets 'drained' if the socket
+ * ran out of messages before the budget did.
+ */
+static int
 ind_ovs_handle_port_upcalls(struct ind_ovs_upcall_thread *thread,
-                            struct ind_ovs_port *port)
+                            struct ind_ovs_port *port,
+                            int budget, bool *drained)
 {
     int fd = nl_socket_get_fd(port->notify_socket);
     int count = 0; /* total messages processed */
 
-    while (count < 128) {
-        /* Fast recv into our preallocated messages */
-        int n = recvmmsg(fd, thread->msgvec, NUM_UPCALL_BUFFERS, 0, NULL);
+    *drained = false;
+
+    while (count < budget) {
+        int vlen = budget - count;
+        if (vlen > thread->recv_batch) {
+            vlen = thread->recv_batch;
+        }
+
+        /* Fast recv into our preallocated buffers */
+        int n = recvmmsg(fd, thread->msgvec, vlen, 0, NULL);
         if (n < 0) {
             if (errno == EAGAIN) {
+                *drained = true;
                 break;
             } else {
                 continue;
             }
         }
 
-        thread->tx_queue_len = 0;
+        thread->recv_time = monotonic_ns();
+        thread->now_ms = thread->recv_time / (1000*1000);
+
+        log_histogram_add(&thread->histograms->recv_batch, n);
 
+        uint32_t bytes = 0;
         int i;
         for (i = 0; i < n; i++) {
-            struct nl_msg *msg = thread->msgs[i];
-            struct nlmsghdr *nlh = nlmsg_hdr(msg);
+            struct mmsghdr *mmsg = &thread->msgvec[i];
+            struct nlmsghdr *nlh = thread->iovecs[i][0].iov_base;
+            int len = mmsg->msg_len;
+
+            bytes += len;
+
+            if ((mmsg->msg_hdr.msg_flags & MSG_TRUNC) || len < NLMSG_HDRLEN) {
+                debug_counter_inc(&truncated);
+                continue;
+            }
 
             /*
             * HACK to workaround OVS not using nlmsg_end().
@@ -193,36 +646,86 @@ ind_ovs_handle_port_upcalls(struct ind_ovs_upcall_thread *thread,
             * which doesn't use any multipart messages.
             */
             /* Don't mess with messages that aren't broken. */
-            int len = thread->msgvec[i].msg_len;
             if (nlh->nlmsg_len + nlmsg_padlen(nlh->nlmsg_len) != len) {
                 //LOG_TRACE("fixup size: nlh->nlmsg_len=%d pad=%d len=%d", nlh->nlmsg_len, nlmsg_padlen(nlh->nlmsg_len), len);
                 nlh->nlmsg_len = len;
             }
 
-            ind_ovs_handle_one_upcall(thread, port, msg);
+            struct ind_ovs_upcall_msg msg;
+            msg.iov[0].iov_base = nlh;
+            msg.iov[1].iov_base = thread->iovecs[i][1].iov_base;
+
+            if (len <= UPCALL_SMALL_BUFFER_SIZE) {
+                msg.nlh = nlh;
+                msg.iov[0].iov_len = len;
+                msg.iov[1].iov_len = 0;
+            } else {
+                /* Reassemble the message so it can be parsed */
+                debug_counter_inc(&spill);
+                thread->recv_spilled = true;
+                msg.nlh = (void *)thread->spill_copy;
+                msg.iov[0].iov_len = UPCALL_SMALL_BUFFER_SIZE;
+                msg.iov[1].iov_len = len - UPCALL_SMALL_BUFFER_SIZE;
+                memcpy(thread->spill_copy, msg.iov[0].iov_base, msg.iov[0].iov_len);
+                memcpy(thread->spill_copy + msg.iov[0].iov_len,
+                       msg.iov[1].iov_base, msg.iov[1].iov_len);
+            }
+
+            if (thread->overloaded && !ind_ovs_upcall_admit(thread, port, msg.nlh)) {
+                continue;
+            }
+
+            ind_ovs_handle_one_upcall(thread, port, &msg);
         }
 
-        struct msghdr msghdr = { 0 };
-        msghdr.msg_iov = thread->tx_queue;
-        msghdr.msg_iovlen = thread->tx_queue_len;
-        (void) sendmsg(fd, &msghdr, 0);
+        ind_ovs_upcall_flush_tx(thread, fd);
+        ind_ovs_upcall_pool_adapt(thread, vlen, n, bytes);
 
         count += n;
 
-        if (n != NUM_UPCALL_BUFFERS) {
+        if (n != vlen) {
+            *drained = true;
             break;
         }
     }
 
     debug_counter_add(&upcall, count);
+
+    return count;
+}
+
+/*
+ * Send the queued execute messages and reset the actions message
+ */
+static void
+ind_ovs_upcall_flush_tx(struct ind_ovs_upcall_thread *thread, int fd)
+{
+    if (thread->tx_queue_msgs > 0) {
+        struct msghdr msghdr = { 0 };
+        msghdr.msg_iov = thread->tx_queue;
+        msghdr.msg_iovlen = thread->tx_queue_len;
+        (void) sendmsg(fd, &msghdr, 0);
+
+        uint64_t sent_time = monotonic_ns();
+        int i;
+        for (i = 0; i < thread->tx_queue_msgs; i++) {
+            log_histogram_add(&thread->histograms->pipeline_to_execute,
+                              sent_time - thread->tx_queue_times[i]);
+        }
+        log_histogram_add(&thread->histograms->tx_batch, thread->tx_queue_msgs);
+    }
+
+    thread->tx_queue_len = 0;
+    thread->tx_queue_msgs = 0;
+    nlmsg_hdr(thread->actions_msg)->nlmsg_len = NLMSG_HDRLEN;
 }
 
 static void
 ind_ovs_handle_one_upcall(struct ind_ovs_upcall_thread *thread,
                           struct ind_ovs_port *port,
-                          struct nl_msg *msg)
+                          struct ind_ovs_upcall_msg *msg)
 {
-    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    struct nlmsghdr *nlh = msg->nlh;
 
     if (nlh->nlmsg_type == NLMSG_ERROR) {
         struct nlmsgerr *err = NLMSG_DATA(nlh);
@@ -257,11 +760,8 @@ ind_ovs_handle_one_upcall(struct ind_ovs_upcall_thread *thread,
 static void
 ind_ovs_handle_packet_miss(struct ind_ovs_upcall_thread *thread,
                            struct ind_ovs_port *port,
-                           struct nl_msg *msg, struct nlattr **attrs)
+                           struct ind_ovs_upcall_msg *msg, struct nlattr **attrs)
 {
-    struct nlmsghdr *nlh = nlmsg_hdr(msg);
-    struct genlmsghdr *gnlh = (void *)(nlh + 1);
-
     struct nlattr *key = attrs[OVS_PACKET_ATTR_KEY];
     struct nlattr *packet = attrs[OVS_PACKET_ATTR_PACKET];
     assert(key && packet);
@@ -273,17 +773,31 @@ ind_ovs_handle_packet_miss(struct ind_ovs_upcall_thread *thread,
 
     xbuf_reset(&thread->stats);
 
-    struct nlattr *actions = nla_nest_start(msg, OVS_PACKET_ATTR_ACTIONS);
+    struct nl_msg *actions_msg = thread->actions_msg;
+    if (nlmsg_get_max_size(actions_msg) - nlmsg_hdr(actions_msg)->nlmsg_len < UPCALL_ACTIONS_HEADROOM) {
+        ind_ovs_upcall_flush_tx(thread, nl_socket_get_fd(port->notify_socket));
+    }
+
+    struct nlattr *actions = nla_nest_start(actions_msg, OVS_PACKET_ATTR_ACTIONS);
 
     struct action_context actx;
-    action_context_init(&actx, &pkey, NULL, msg);
+    action_context_init(&actx, &pkey, NULL, actions_msg);
 
+    uint64_t pipeline_start_time = monotonic_ns();
     indigo_error_t err = pipeline_process(&pkey, &mask, &thread->stats, &actx);
+    uint64_t pipeline_end_time = monotonic_ns();
+
+    log_histogram_add(&thread->histograms->recv_to_pipeline,
+                      pipeline_start_time - thread->recv_time);
+    log_histogram_add(&thread->histograms->pipeline,
+                      pipeline_end_time - pipeline_start_time);
+
     if (err < 0) {
+        nlmsg_hdr(actions_msg)->nlmsg_len = (char *)actions - (char *)nlmsg_hdr(actions_msg);
         return;
     }
 
-    ind_ovs_nla_nest_end(msg, actions);
+    ind_ovs_nla_nest_end(actions_msg, actions);
 
     struct stats_handle *stats_handles = xbuf_data(&thread->stats);
     int num_stats_handles = xbuf_length(&thread->stats) / sizeof(struct stats_handle);
@@ -293,30 +807,125 @@ ind_ovs_handle_packet_miss(struct ind_ovs_upcall_thread *thread,
                   1, nla_len(packet));
     }
 
-    /* Reuse the incoming message for the packet execute */
-    gnlh->cmd = OVS_PACKET_CMD_EXECUTE;
-
     /* Don't send the packet back out if it would be dropped. */
     if (nla_len(actions) > 0) {
+        /*
+         * Reuse the incoming message for the packet execute. The header is
+         * always in the small buffer, so edit it there rather than in the
+         * parsing copy.
+         */
+        struct nlmsghdr *nlh = msg->iov[0].iov_base;
+        struct genlmsghdr *gnlh = (void *)(nlh + 1);
+        int rx_len = NLMSG_ALIGN(nlh->nlmsg_len);
+        int actions_len = (char *)nlmsg_tail(nlmsg_hdr(actions_msg)) - (char *)actions;
+
+        gnlh->cmd = OVS_PACKET_CMD_EXECUTE;
+        nlh->nlmsg_len = rx_len + actions_len;
         nlh->nlmsg_pid = 0;
         nlh->nlmsg_seq = 0;
         nlh->nlmsg_flags = NLM_F_REQUEST;
+
+        thread->tx_queue_times[thread->tx_queue_msgs++] = pipeline_end_time;
+
         struct iovec *iovec = &thread->tx_queue[thread->tx_queue_len++];
         iovec->iov_base = nlh;
-        iovec->iov_len = nlh->nlmsg_len;
+        if (rx_len <= UPCALL_SMALL_BUFFER_SIZE) {
+            iovec->iov_len = rx_len;
+        } else {
+            iovec->iov_len = UPCALL_SMALL_BUFFER_SIZE;
+            iovec = &thread->tx_queue[thread->tx_queue_len++];
+            iovec->iov_base = msg->iov[1].iov_base;
+            iovec->iov_len = rx_len - UPCALL_SMALL_BUFFER_SIZE;
+        }
+
+        iovec = &thread->tx_queue[thread->tx_queue_len++];
+        iovec->iov_base = actions;
+        iovec->iov_len = actions_len;
+
         if (thread->log_upcalls) {
-            LOG_VERBOSE("Sending upcall reply:");
-            ind_ovs_dump_msg(nlh);
+            /* The reply isn't contiguous, so only the actions are dumped */
+            LOG_VERBOSE("Sending upcall reply with actions:");
+            ind_ovs_dump_nested(actions, ind_ovs_dump_action_attr);
         }
+    } else {
+        nlmsg_hdr(actions_msg)->nlmsg_len = (char *)actions - (char *)nlmsg_hdr(actions_msg);
     }
 
     /* See the comment for ind_ovs_upcall_seen_key. */
-    if (!ind_ovs_disable_kflows && ind_ovs_upcall_seen_key(thread, key)) {
+    if (!ind_ovs_disable_kflows && ind_ovs_upcall_seen_key(thread, port, key)) {
         /* Create a kflow with the given key and actions. */
-        ind_ovs_upcall_request_kflow(thread, key);
+        ind_ovs_upcall_request_kflow(thread, key, 0);
     }
 }
 
+/*
+ * Choose the next recvmmsg batch size.
+ *
+ * The batch doubles while recvmmsg keeps filling it and halves when it comes
+ * back mostly empty, so it follows the arrival rate. It is capped so that a
+ * full batch of messages of the average size fits in UPCALL_POOL_TARGET_BYTES,
+ * which keeps a burst of large packets from touching every spill buffer.
+ */
+static void
+ind_ovs_upcall_pool_adapt(struct ind_ovs_upcall_thread *thread,
+                          int vlen, int n, uint32_t bytes)
+{
+    if (n > thread->recv_high_water) {
+        thread->recv_high_water = n;
+    }
+
+    if (n > 0) {
+        thread->avg_msg_size = (thread->avg_msg_size * 7 + bytes / n) / 8;
+    }
+
+    int limit = MAX_UPCALL_BATCH;
+    if (thread->avg_msg_size > UPCALL_SMALL_BUFFER_SIZE) {
+        limit = UPCALL_POOL_TARGET_BYTES / thread->avg_msg_size;
+    }
+    if (limit > MAX_UPCALL_BATCH) {
+        limit = MAX_UPCALL_BATCH;
+    }
+
+    if (n == vlen && vlen == thread->recv_batch) {
+        thread->recv_batch *= 2;
+    } else if (n < thread->recv_batch / 4) {
+        thread->recv_batch /= 2;
+    }
+
+    if (thread->recv_batch > limit) {
+        thread->recv_batch = limit;
+    }
+    if (thread->recv_batch < MIN_UPCALL_BATCH) {
+        thread->recv_batch = MIN_UPCALL_BATCH;
+    }
+}
+
+/*
+ * Give back the memory behind the receive buffers touched since the last
+ * release, except those for a minimum size batch, which stay locked.
+ */
+static void
+ind_ovs_upcall_pool_release(struct ind_ovs_upcall_thread *thread)
+{
+    debug_counter_inc(&pool_release);
+
+    if (thread->recv_high_water > MIN_UPCALL_BATCH) {
+        (void) madvise(thread->recv_small + MIN_UPCALL_BATCH * UPCALL_SMALL_BUFFER_SIZE,
+                       (thread->recv_high_water - MIN_UPCALL_BATCH) * UPCALL_SMALL_BUFFER_SIZE,
+                       MADV_DONTNEED);
+    }
+
+    if (thread->recv_spilled) {
+        (void) madvise(thread->recv_spill,
+                       MAX_UPCALL_BATCH * UPCALL_SPILL_BUFFER_SIZE,
+                       MADV_DONTNEED);
+    }
+
+    thread->recv_high_water = 0;
+    thread->recv_spilled = false;
+    thread->recv_batch = MIN_UPCALL_BATCH;
+}
+
 static void
 ind_ovs_upcall_assign_thread(struct ind_ovs_port *port)
 {
@@ -329,6 +938,8 @@ ind_ovs_upcall_assign_thread(struct ind_ovs_port *port)
 void
 ind_ovs_upcall_register(struct ind_ovs_port *port)
 {
+    memset(&ind_ovs_upcall_port_stats[port->dp_port_no], 0,
+           sizeof(ind_ovs_upcall_port_stats[port->dp_port_no]));
     ind_ovs_upcall_assign_thread(port);
 }
 
@@ -340,45 +951,83 @@ ind_ovs_upcall_unregister(struct ind_ovs_port *port)
 
 /*
  * For single packet flows the cost of installing and expiring a kernel flow
- * is significant. This function uses a bloom filter to probabilistically check
- * if we've seen this flow before. To prevent the bloom filter from filling up
- * we reset it after a certain number of insertions, calculated to keep the
- * probability of a false positive around 1%.
+ * is significant. This function estimates how many packets with this key
+ * we've seen recently and only returns true once the key has met the install
+ * policy: 'packets' upcalls within roughly 'window_ms' milliseconds. The
+ * policy defaults to ind_ovs_kflow_install_packets and
+ * ind_ovs_kflow_install_window_ms and can be overridden per input port.
+ *
+ * The estimate comes from a count-min sketch. Each key increments one counter
+ * in each row and the estimate is the minimum of those counters, so hash
+ * collisions can only cause a key to be installed early. Only the counters
+ * equal to the current minimum are incremented ("conservative update"), which
+ * keeps heavy keys from inflating the counters they share with light ones.
+ *
+ * Instead of resetting the whole table periodically, each counter is halved
+ * for every window that has elapsed since it was last incremented. This keeps
+ * the sketch from filling up with stale keys without a burst of false
+ * negatives right after a reset.
  *
  * This is similar in function to the OVS governor though it uses a different
  * datastructure and runs all the time.
  */
 static bool
 ind_ovs_upcall_seen_key(struct ind_ovs_upcall_thread *thread,
+                        struct ind_ovs_port *port,
                         struct nlattr *key)
 {
-#define BLOOM_TEST(idx) thread->bloom_filter[(idx)/8] &  (1 << ((idx) % 8))
-#define BLOOM_SET(idx)  thread->bloom_filter[(idx)/8] |= (1 << ((idx) % 8))
+    uint32_t packets = port->kflow_install_packets ?
+        port->kflow_install_packets : ind_ovs_kflow_install_packets;
+    uint32_t window_ms = port->kflow_install_window_ms ?
+        port->kflow_install_window_ms : ind_ovs_kflow_install_window_ms;
+
+    if (packets <= 1) {
+        return true;
+    }
+
+    uint32_t hash1 = murmur_hash(nla_data(key), nla_len(key), ind_ovs_salt);
+    uint32_t hash2 = murmur_hash(nla_data(key), nla_len(key), ~ind_ovs_salt) | 1;
+
+    struct ind_ovs_upcall_sketch_cell *cells[SKETCH_ROWS];
+    uint32_t min_count = UINT32_MAX;
+    int i;
+
+    for (i = 0; i < SKETCH_ROWS; i++) {
+        uint32_t idx = (hash1 + i * hash2) & (SKETCH_COLUMNS - 1);
+        struct ind_ovs_upcall_sketch_cell *cell = &thread->sketch[i][idx];
+
+        uint32_t windows = (thread->now_ms - cell->last_ms) / window_ms;
+        if (windows >= 32) {
+            cell->count = 0;
+        } else {
+            cell->count >>= windows;
+        }
+
+        if (cell->count < min_count) {
+            min_count = cell->count;
+        }
 
-    uint32_t key_hash = murmur_hash(nla_data(key), nla_len(key), ind_ovs_salt);
-    uint16_t idx1 = key_hash & 0xFFFF;
-    uint16_t idx2 = key_hash >> 16;
+        cells[i] = cell;
+    }
+
+    for (i = 0; i < SKETCH_ROWS; i++) {
+        if (cells[i]->count == min_count) {
+            cells[i]->count++;
+            cells[i]->last_ms = thread->now_ms;
+        }
+    }
 
-    if (BLOOM_TEST(idx1) && BLOOM_TEST(idx2)) {
+    if (min_count + 1 >= packets) {
         return true;
     } else {
-        if (thread->bloom_filter_count >= BLOOM_CAPACITY) {
-            memset(thread->bloom_filter, 0, sizeof(thread->bloom_filter));
-            thread->bloom_filter_count = 0;
-        }
-        BLOOM_SET(idx1);
-        BLOOM_SET(idx2);
-        thread->bloom_filter_count++;
+        debug_counter_inc(&kflow_install_suppressed);
         return false;
     }
-
-#undef BLOOM_TEST
-#undef BLOOM_SET
 }
 
 static void
 ind_ovs_upcall_request_kflow(struct ind_ovs_upcall_thread *thread,
-                             struct nlattr *key)
+                             struct nlattr *key, uint32_t flags)
 {
     if (key->nla_len > MAX_KEY_SIZE) {
         AIM_LOG_WARN("Maximum kflow key size exceeded (is %u)", key->nla_len);
@@ -387,7 +1036,13 @@ ind_ovs_upcall_request_kflow(struct ind_ovs_upcall_thread *thread,
 
     AIM_LOG_VERBOSE("Requesting kflow");
 
-    int written = write(thread->kflow_sock_wr, key, key->nla_len);
+    struct ind_ovs_kflow_request req = { .flags = flags };
+    struct iovec iov[2] = {
+        { .iov_base = &req, .iov_len = sizeof(req) },
+        { .iov_base = key, .iov_len = key->nla_len },
+    };
+
+    int written = writev(thread->kflow_sock_wr, iov, AIM_ARRAYSIZE(iov));
     if (written < 0) {
         if (errno == EAGAIN) {
             AIM_LOG_VERBOSE("kflow socket buffer full");
@@ -395,7 +1050,7 @@ ind_ovs_upcall_request_kflow(struct ind_ovs_upcall_thread *thread,
         } else {
             AIM_LOG_ERROR("Failed to write to kflow socket: %s", strerror(errno));
         }
-    } else if (written != key->nla_len) {
+    } else if (written != sizeof(req) + key->nla_len) {
         AIM_LOG_ERROR("Short write to kflow socket");
     }
 }
@@ -405,7 +1060,7 @@ static void
 kflow_sock_ready(int fd, void *cookie,
                  int ready_ready, int write_ready, int error_seen)
 {
-    static char buf[MAX_KEY_SIZE];
+    static char buf[sizeof(struct ind_ovs_kflow_request) + MAX_KEY_SIZE];
 
     debug_counter_inc(&kflow_request);
 
@@ -416,9 +1071,11 @@ kflow_sock_ready(int fd, void *cookie,
         return;
     }
 
-    AIM_ASSERT(n >= NLA_HDRLEN);
+    AIM_ASSERT(n >= sizeof(struct ind_ovs_kflow_request) + NLA_HDRLEN);
 
-    struct nlattr *key = (void *)buf;
+    struct ind_ovs_kflow_request *req = (void *)buf;
+    struct nlattr *key = (void *)(req + 1);
+    n -= sizeof(*req);
     if (key->nla_len != n) {
         AIM_LOG_ERROR("kflow socket length mismatch: read %u, attr len %u", n, key->nla_len);
         debug_counter_inc(&kflow_request_error);
@@ -426,7 +1083,11 @@ kflow_sock_ready(int fd, void *cookie,
     }
 
     AIM_LOG_VERBOSE("Received kflow request");
-    ind_ovs_kflow_add(key);
+    if (req->flags & KFLOW_REQUEST_F_DROP) {
+        ind_ovs_kflow_add_drop(key);
+    } else {
+        ind_ovs_kflow_add(key);
+    }
 }
 
 static void
@@ -452,23 +1113,16 @@ signalfd_sock_ready(int fd, void *cookie,
      * Multiple children terminating before we read a SIGCHLD with signalfd()
      * will be compressed into a single SIGCHLD.
      * So we need to check which upcall children have been terminated.
+     * Other children, such as kflow revalidation workers, are reaped by
+     * the module that forked them.
      */
-    while (1) {
+    int i;
+    for (i = 0; i < ind_ovs_num_upcall_threads; i++) {
+        struct ind_ovs_upcall_thread *thread = ind_ovs_upcall_threads[i];
         int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG);
-        if (pid <= 0) {
-            break;
-        }
-
-        /* Respawn upcall thread with child 'pid' */
-        int i;
-        for (i = 0; i < ind_ovs_num_upcall_threads; i++) {
-            struct ind_ovs_upcall_thread *thread = ind_ovs_upcall_threads[i];
-            if (thread->pid == pid) {
-                AIM_LOG_VERBOSE("Upcall process %d terminated, Respawning", i);
-                ind_ovs_upcall_respawn_child(thread);
-                break;
-            }
+        if (thread->pid > 0 && waitpid(thread->pid, &status, WNOHANG) == thread->pid) {
+            AIM_LOG_VERBOSE("Upcall process %d terminated, Respawning", i);
+            ind_ovs_upcall_respawn_child(thread);
         }
     }
 }
@@ -489,7 +1143,89 @@ ind_ovs_upcall_init(void)
 
     LOG_INFO("using %d upcall threads", ind_ovs_num_upcall_threads);
 
-    int i, j;
+    s = getenv("IVS_KFLOW_INSTALL_PACKETS");
+    if (s != NULL) {
+        ind_ovs_kflow_install_packets = atoi(s);
+    }
+
+    s = getenv("IVS_KFLOW_INSTALL_WINDOW_MS");
+    if (s != NULL) {
+        ind_ovs_kflow_install_window_ms = atoi(s);
+        if (ind_ovs_kflow_install_window_ms == 0) {
+            LOG_ERROR("invalid kflow install window");
+            abort();
+        }
+    }
+
+    s = getenv("IVS_UPCALL_BUSY_POLL_US");
+    if (s != NULL) {
+        ind_ovs_upcall_busy_poll_us = atoi(s);
+        if (ind_ovs_upcall_busy_poll_us > 0) {
+            if (ind_ovs_upcall_busy_poll_us < MIN_BUSY_POLL_US) {
+                ind_ovs_upcall_busy_poll_us = MIN_BUSY_POLL_US;
+            }
+            LOG_INFO("busy polling upcall sockets for up to %u us",
+                     ind_ovs_upcall_busy_poll_us);
+        }
+    }
+
+    s = getenv("IVS_UPCALL_OVERLOAD_BUDGET_US");
+    if (s != NULL) {
+        ind_ovs_upcall_overload_budget_us = atoi(s);
+    }
+
+    s = getenv("IVS_UPCALL_PORT_RATE");
+    if (s != NULL) {
+        int rate = atoi(s);
+        if (rate <= 0 || rate > MAX_UPCALL_PORT_RATE) {
+            LOG_ERROR("invalid upcall port rate, must be between 1 and %u",
+                      MAX_UPCALL_PORT_RATE);
+            abort();
+        }
+        ind_ovs_upcall_port_rate = rate;
+    }
+
+    s = getenv("IVS_UPCALL_PORT_BURST");
+    if (s != NULL) {
+        int burst = atoi(s);
+        if (burst <= 0 || burst > MAX_UPCALL_PORT_BURST) {
+            LOG_ERROR("invalid upcall port burst, must be between 1 and %u",
+                      MAX_UPCALL_PORT_BURST);
+            abort();
+        }
+        ind_ovs_upcall_port_burst = burst;
+    }
+
+    s = getenv("IVS_UPCALL_OVERLOAD_DROP_KFLOWS");
+    if (s != NULL && atoi(s) == 1) {
+        ind_ovs_upcall_overload_drop_kflows = true;
+    }
+
+    s = getenv("IVS_UPCALL_QUANTUM");
+    if (s != NULL) {
+        ind_ovs_upcall_quantum = atoi(s);
+        if (ind_ovs_upcall_quantum == 0) {
+            LOG_ERROR("invalid upcall quantum");
+            abort();
+        }
+    }
+
+    ind_ovs_upcall_port_stats = mmap(NULL, sizeof(*ind_ovs_upcall_port_stats) * IND_OVS_MAX_PORTS,
+                                     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (ind_ovs_upcall_port_stats == MAP_FAILED) {
+        AIM_DIE("Failed to allocate upcall port stats: %s", strerror(errno));
+    }
+
+    ind_ovs_upcall_histograms = mmap(NULL, sizeof(*ind_ovs_upcall_histograms) * ind_ovs_num_upcall_threads,
+                                     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (ind_ovs_upcall_histograms == MAP_FAILED) {
+        AIM_DIE("Failed to allocate upcall histograms: %s", strerror(errno));
+    }
+
+    LOG_INFO("installing kflows after %u packets within %u ms",
+             ind_ovs_kflow_install_packets, ind_ovs_kflow_install_window_ms);
+
+    int i;
     for (i = 0; i < ind_ovs_num_upcall_threads; i++) {
         struct ind_ovs_upcall_thread *thread = aim_zmalloc(sizeof(*thread));
         thread->index = i;
@@ -505,21 +1241,11 @@ ind_ovs_upcall_init(void)
             AIM_DIE("Failed to register kflow socket with SocketManager");
         }
 
-        xbuf_init(&thread->stats);
-
-        for (j = 0; j < NUM_UPCALL_BUFFERS; j++) {
-            thread->msgs[j] = nlmsg_alloc();
-            if (thread->msgs[j] == NULL) {
-                LOG_ERROR("Failed to allocate upcall message buffers");
-                abort();
-            }
-            thread->iovecs[j].iov_base = nlmsg_hdr(thread->msgs[j]);
-            thread->iovecs[j].iov_len = IND_OVS_DEFAULT_MSG_SIZE;
-            thread->msgvec[j].msg_hdr.msg_iov = &thread->iovecs[j];
-            thread->msgvec[j].msg_hdr.msg_iovlen = 1;
-        }
+        xbuf_init_stub(&thread->stats, thread->stats_stub,
+                       sizeof(thread->stats_stub));
 
         thread->stats_writer = stats_writer_create();
+        thread->histograms = &ind_ovs_upcall_histograms[i];
 
         ind_ovs_upcall_threads[i] = thread;
     }
@@ -576,7 +1302,7 @@ ind_ovs_upcall_finish(void)
     close(shutdown_pipe[0]);
     close(shutdown_pipe[1]);
 
-    int i, j;
+    int i;
     for (i = 0; i < ind_ovs_num_upcall_threads; i++) {
         struct ind_ovs_upcall_thread *thread = ind_ovs_upcall_threads[i];
         close(thread->epfd);
@@ -585,19 +1311,23 @@ ind_ovs_upcall_finish(void)
         kill(thread->pid, SIGKILL);
         waitpid(thread->pid, NULL, 0);
         xbuf_cleanup(&thread->stats);
-        for (j = 0; j < NUM_UPCALL_BUFFERS; j++) {
-            nlmsg_free(thread->msgs[j]);
-        }
         stats_writer_destroy(thread->stats_writer);
         aim_free(thread);
         ind_ovs_upcall_threads[i] = NULL;
     }
+
+    munmap(ind_ovs_upcall_port_stats, sizeof(*ind_ovs_upcall_port_stats) * IND_OVS_MAX_PORTS);
+    ind_ovs_upcall_port_stats = NULL;
+
+    munmap(ind_ovs_upcall_histograms, sizeof(*ind_ovs_upcall_histograms) * ind_ovs_num_upcall_threads);
+    ind_ovs_upcall_histograms = NULL;
 }
 
 static void
 ind_ovs_upcall_respawn_child(struct ind_ovs_upcall_thread *thread)
 {
     int parent_pid = getpid();
+    thread->spawn_time = monotonic_ns();
     int child_pid = fork();
     if (child_pid < 0) {
         AIM_DIE("Failed to spawn upcall process: %s", strerror(errno));
@@ -638,6 +1368,99 @@ ind_ovs_upcall_respawn(void)
     debug_counter_add(&respawn_time, elapsed);
 }
 
+indigo_error_t
+ind_ovs_port_kflow_install_policy_set(const char *port_name,
+                                      uint32_t packets, uint32_t window_ms)
+{
+    struct ind_ovs_port *port = ind_ovs_port_lookup_by_name(port_name);
+    if (port == NULL) {
+        return INDIGO_ERROR_NOT_FOUND;
+    }
+
+    AIM_LOG_VERBOSE("Setting kflow install policy on port %s to %u packets within %u ms",
+                    port->ifname, packets, window_ms);
+
+    port->kflow_install_packets = packets;
+    port->kflow_install_window_ms = window_ms;
+
+    /* The upcall processes have their own copy of the port */
+    ind_ovs_barrier_defer_revalidation_internal();
+
+    return INDIGO_ERROR_NONE;
+}
+
+indigo_error_t
+ind_ovs_port_upcall_weight_set(const char *port_name, uint32_t weight)
+{
+    struct ind_ovs_port *port = ind_ovs_port_lookup_by_name(port_name);
+    if (port == NULL) {
+        return INDIGO_ERROR_NOT_FOUND;
+    }
+
+    if (weight > UINT16_MAX) {
+        return INDIGO_ERROR_PARAM;
+    }
+
+    AIM_LOG_VERBOSE("Setting upcall weight on port %s to %u", port->ifname, weight);
+
+    port->upcall_weight = weight;
+
+    /* The upcall processes have their own copy of the port */
+    ind_ovs_barrier_defer_revalidation_internal();
+
+    return INDIGO_ERROR_NONE;
+}
+
+const struct ind_ovs_upcall_port_stats *
+ind_ovs_upcall_port_stats_get(struct ind_ovs_port *port)
+{
+    return &ind_ovs_upcall_port_stats[port->dp_port_no];
+}
+
+int
+ind_ovs_upcall_num_threads(void)
+{
+    return ind_ovs_num_upcall_threads;
+}
+
+/*
+ * Copy the histograms of the given upcall thread into 'result', or the sum
+ * over all upcall threads if 'thread_index' is -1.
+ */
+void
+ind_ovs_upcall_histograms_get(int thread_index,
+                              struct ind_ovs_upcall_histograms *result)
+{
+    if (thread_index >= 0) {
+        AIM_ASSERT(thread_index < ind_ovs_num_upcall_threads);
+        *result = ind_ovs_upcall_histograms[thread_index];
+        return;
+    }
+
+    memset(result, 0, sizeof(*result));
+
+    int i;
+    for (i = 0; i < ind_ovs_num_upcall_threads; i++) {
+        struct ind_ovs_upcall_histograms *h = &ind_ovs_upcall_histograms[i];
+        log_histogram_merge(&result->recv_to_pipeline, &h->recv_to_pipeline);
+        log_histogram_merge(&result->pipeline, &h->pipeline);
+        log_histogram_merge(&result->pipeline_to_execute, &h->pipeline_to_execute);
+        log_histogram_merge(&result->recv_batch, &h->recv_batch);
+        log_histogram_merge(&result->tx_batch, &h->tx_batch);
+        log_histogram_merge(&result->startup, &h->startup);
+    }
+}
+
+/*
+ * Racy with the upcall processes, a few samples may survive the clear.
+ */
+void
+ind_ovs_upcall_histograms_clear(void)
+{
+    memset(ind_ovs_upcall_histograms, 0,
+           sizeof(*ind_ovs_upcall_histograms) * ind_ovs_num_upcall_threads);
+}
+
 static void
 drop_privileges(void)
 {
@@ -667,6 +1490,150 @@ drop_privileges(void)
     cap_free(caps);
 }
 
+/*
+ * Allocate the receive buffers
+ *
+ * Called in the upcall process after lock_memory, so only the buffers for a
+ * minimum size batch are locked and faulted in up front. The rest are
+ * faulted in as the batch size grows or large messages arrive, and returned
+ * by ind_ovs_upcall_pool_release.
+ */
+static void
+ind_ovs_upcall_pool_init(struct ind_ovs_upcall_thread *thread)
+{
+    thread->recv_small = mmap(NULL, MAX_UPCALL_BATCH * UPCALL_SMALL_BUFFER_SIZE,
+                              PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (thread->recv_small == MAP_FAILED) {
+        AIM_DIE("Failed to allocate upcall receive buffers: %s", strerror(errno));
+    }
+
+    thread->recv_spill = mmap(NULL, MAX_UPCALL_BATCH * UPCALL_SPILL_BUFFER_SIZE,
+                              PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (thread->recv_spill == MAP_FAILED) {
+        AIM_DIE("Failed to allocate upcall spill buffers: %s", strerror(errno));
+    }
+
+    if (mlock(thread->recv_small, MIN_UPCALL_BATCH * UPCALL_SMALL_BUFFER_SIZE) < 0) {
+        AIM_LOG_WARN("mlock failed: %s", strerror(errno));
+    }
+
+    int i;
+    for (i = 0; i < MAX_UPCALL_BATCH; i++) {
+        thread->iovecs[i][0].iov_base = thread->recv_small + i * UPCALL_SMALL_BUFFER_SIZE;
+        thread->iovecs[i][0].iov_len = UPCALL_SMALL_BUFFER_SIZE;
+        thread->iovecs[i][1].iov_base = thread->recv_spill + i * UPCALL_SPILL_BUFFER_SIZE;
+        thread->iovecs[i][1].iov_len = UPCALL_SPILL_BUFFER_SIZE;
+        thread->msgvec[i].msg_hdr.msg_iov = thread->iovecs[i];
+        thread->msgvec[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    thread->recv_batch = MIN_UPCALL_BATCH;
+    thread->recv_high_water = 0;
+    thread->recv_spilled = false;
+    thread->avg_msg_size = 0;
+}
+
+/*
+ * Return one more than the highest open file descriptor
+ *
+ * Used to size the bitmap of file descriptors to keep, since every kept
+ * descriptor is open. Falls back to the file descriptor limit if
+ * /proc/self/fd can't be read.
+ */
+static int
+open_fds_limit(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return sysconf(_SC_OPEN_MAX);
+    }
+
+    long highest = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long fd = strtol(entry->d_name, &end, 10);
+        if (end == entry->d_name || *end != '\0') {
+            continue; /* "." and ".." */
+        }
+
+        if (fd != dirfd(dir) && fd > highest) {
+            highest = fd;
+        }
+    }
+
+    closedir(dir);
+    return highest + 1;
+}
+
+/*
+ * Close every file descriptor not set in 'keep'
+ *
+ * Walks /proc/self/fd so the cost is proportional to the number of open file
+ * descriptors rather than the file descriptor limit.
+ */
+static void
+close_other_fds(aim_bitmap_t *keep, int max_fds)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        AIM_LOG_WARN("Failed to open /proc/self/fd: %s", strerror(errno));
+        int i;
+        for (i = 0; i < max_fds; i++) {
+            if (!AIM_BITMAP_GET(keep, i)) {
+                close(i);
+            }
+        }
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long fd = strtol(entry->d_name, &end, 10);
+        if (end == entry->d_name || *end != '\0') {
+            continue; /* "." and ".." */
+        }
+
+        if (fd == dirfd(dir) || (fd < max_fds && AIM_BITMAP_GET(keep, fd))) {
+            continue;
+        }
+
+        close(fd);
+    }
+
+    closedir(dir);
+}
+
+/*
+ * Lock the upcall process in memory
+ *
+ * The address space inherited from the main process is locked as it is
+ * touched rather than faulted in all at once, which would copy every
+ * private writable page. Memory used on every upcall is faulted in now.
+ */
+static void
+lock_memory(struct ind_ovs_upcall_thread *thread)
+{
+#ifdef MCL_ONFAULT
+    if (mlockall(MCL_CURRENT|MCL_ONFAULT) == 0) {
+        if (mlock(thread, sizeof(*thread)) < 0 ||
+                mlock(nlmsg_hdr(thread->actions_msg), UPCALL_ACTIONS_MSG_SIZE) < 0) {
+            AIM_LOG_WARN("mlock failed: %s", strerror(errno));
+        }
+        return;
+    } else if (errno != EINVAL) {
+        AIM_LOG_WARN("mlockall failed: %s", strerror(errno));
+        return;
+    }
+    /* Kernel doesn't support MCL_ONFAULT */
+#endif
+
+    if (mlockall(MCL_CURRENT) < 0) {
+        AIM_LOG_WARN("mlockall failed: %s", strerror(errno));
+    }
+}
+
 static void
 ind_ovs_upcall_thread_init(struct ind_ovs_upcall_thread *thread, int parent_pid)
 {
@@ -679,13 +1646,26 @@ ind_ovs_upcall_thread_init(struct ind_ovs_upcall_thread *thread, int parent_pid)
         AIM_DIE("prctl(PR_SET_PDEATHSIG) failed: %s", strerror(errno));
     }
 
+    list_init(&thread->active_ports);
+    thread->ports = aim_zmalloc(sizeof(*thread->ports) * IND_OVS_MAX_PORTS);
+    thread->num_ports = 0;
+    thread->busy_poll_budget = ind_ovs_upcall_busy_poll_us;
+
+    thread->spill_copy = aim_malloc(IND_OVS_DEFAULT_MSG_SIZE);
+    thread->actions_msg = nlmsg_alloc_size(UPCALL_ACTIONS_MSG_SIZE);
+    if (thread->actions_msg == NULL) {
+        AIM_DIE("Failed to allocate upcall actions message");
+    }
+    thread->tx_queue_len = 0;
+    thread->tx_queue_msgs = 0;
+
     thread->epfd = epoll_create(1);
     if (thread->epfd < 0) {
         AIM_DIE("failed to create epoll set: %s", strerror(errno));
     }
 
     /* Create a bitmap of file descriptors we want to keep */
-    int max_fds = sysconf(_SC_OPEN_MAX);
+    int max_fds = open_fds_limit();
     aim_bitmap_t *fds = aim_bitmap_alloc(NULL, max_fds);
     AIM_BITMAP_SET(fds, STDIN_FILENO);
     AIM_BITMAP_SET(fds, STDOUT_FILENO);
@@ -710,17 +1690,19 @@ ind_ovs_upcall_thread_init(struct ind_ovs_upcall_thread *thread, int parent_pid)
                 AIM_DIE("failed to add to epoll set: %s", strerror(errno));
             }
             AIM_BITMAP_SET(fds, nl_socket_get_fd(port->notify_socket));
+            thread->ports[thread->num_ports++] = port;
+            aim_ratelimiter_init(&port->upcall_admission_limiter,
+                                 1000*1000 / ind_ovs_upcall_port_rate,
+                                 ind_ovs_upcall_port_burst, NULL);
+            aim_ratelimiter_init(&port->drop_kflow_limiter,
+                                 1000*1000 / DROP_KFLOW_RATE,
+                                 DROP_KFLOW_BURST, NULL);
         }
     }
 
     packet_trace_set_fd_bitmap(fds);
 
-    /* Close all other file descriptors */
-    for (i = 0; i < max_fds; i++) {
-        if (!AIM_BITMAP_GET(fds, i)) {
-            close(i);
-        }
-    }
+    close_other_fds(fds, max_fds);
 
     aim_bitmap_free(fds);
 
@@ -733,9 +1715,12 @@ ind_ovs_upcall_thread_init(struct ind_ovs_upcall_thread *thread, int parent_pid)
         AIM_LOG_WARN("nice(-20) failed: %s", strerror(errno));
     }
 
-    if (mlockall(MCL_CURRENT) < 0) {
-        AIM_LOG_WARN("mlockall failed: %s", strerror(errno));
-    }
+    lock_memory(thread);
+
+    ind_ovs_upcall_pool_init(thread);
 
     drop_privileges();
+
+    log_histogram_add(&thread->histograms->startup,
+                      monotonic_ns() - thread->spawn_time);
 }
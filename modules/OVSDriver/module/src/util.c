@@ -79,6 +79,14 @@ monotonic_us(void)
     return ((uint64_t)tp.tv_sec * 1000*1000) + (tp.tv_nsec / 1000);
 }
 
+uint64_t
+monotonic_ns(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ((uint64_t)tp.tv_sec * 1000*1000*1000) + tp.tv_nsec;
+}
+
 /* Send a netlink message and wait for an ack or error reply. */
 int
 ind_ovs_transact(struct nl_msg *msg)
@@ -19,10 +19,13 @@
 
 #include <ivs/ivs.h>
 #include <indigo/forwarding.h>
+#include <telemetry/telemetry.h>
 
 struct vlan_counters {
     struct stats_handle rx_stats_handle;
     struct stats_handle tx_stats_handle;
+    struct telemetry_object rx_telemetry;
+    struct telemetry_object tx_telemetry;
 };
 
 static struct vlan_counters vcounters[4096];
@@ -34,6 +37,14 @@ ind_ovs_vlan_stats_init(void)
     for (i = 0; i < 4096; i++) {
         stats_alloc(&vcounters[i].rx_stats_handle);
         stats_alloc(&vcounters[i].tx_stats_handle);
+        if (i > 0) {
+            telemetry_register(&vcounters[i].rx_telemetry,
+                               &vcounters[i].rx_stats_handle,
+                               TELEMETRY_TYPE_VLAN, TELEMETRY_VLAN_RX, i, 0);
+            telemetry_register(&vcounters[i].tx_telemetry,
+                               &vcounters[i].tx_stats_handle,
+                               TELEMETRY_TYPE_VLAN, TELEMETRY_VLAN_TX, i, 0);
+        }
     }
 }
 
@@ -44,14 +55,17 @@ indigo_fwd_vlan_stats_get(uint16_t vlan_vid, indigo_fi_vlan_stats_t *vlan_stats)
 
     AIM_ASSERT(vlan_stats != NULL);
 
-    struct stats rx_stats, tx_stats;
-    stats_get(&vcounters[vlan_vid].rx_stats_handle, &rx_stats);
-    stats_get(&vcounters[vlan_vid].tx_stats_handle, &tx_stats);
+    const struct stats_handle *handles[] = {
+        &vcounters[vlan_vid].rx_stats_handle,
+        &vcounters[vlan_vid].tx_stats_handle,
+    };
+    struct stats stats[2];
+    ind_ovs_stats_get_batch(handles, stats, 2);
 
-    vlan_stats->rx_bytes = rx_stats.bytes;
-    vlan_stats->rx_packets = rx_stats.packets;
-    vlan_stats->tx_bytes = tx_stats.bytes;
-    vlan_stats->tx_packets = tx_stats.packets;
+    vlan_stats->rx_bytes = stats[0].bytes;
+    vlan_stats->rx_packets = stats[0].packets;
+    vlan_stats->tx_bytes = stats[1].bytes;
+    vlan_stats->tx_packets = stats[1].packets;
 }
 
 struct stats_handle *
@@ -44,9 +44,8 @@ static struct nl_cache *link_stats_cache;
 
 static indigo_error_t port_status_notify(uint32_t port_no, unsigned reason);
 static void port_desc_set(of_port_desc_t *of_port_desc, of_port_no_t of_port_num);
-static void alloc_port_counters(struct ind_ovs_port_counters *pcounters);
-static void free_port_counters(struct ind_ovs_port_counters *pcounters);
-static uint64_t get_packet_stats(struct stats_handle *handle);
+static void alloc_port_counters(struct ind_ovs_port *port);
+static void free_port_counters(struct ind_ovs_port *port);
 
 aim_ratelimiter_t nl_cache_refill_limiter;
 
@@ -318,7 +317,7 @@ ind_ovs_port_added(uint32_t port_no, const char *ifname,
     port->mac_addr = mac_addr;
     aim_ratelimiter_init(&port->upcall_log_limiter, 1000*1000, 5, NULL);
     aim_ratelimiter_init(&port->pktin_limiter, PORT_PKTIN_INTERVAL, PORT_PKTIN_BURST_SIZE, NULL);
-    alloc_port_counters(&port->pcounters);
+    alloc_port_counters(port);
 
     port->notify_socket = ind_ovs_create_nlsock();
     if (port->notify_socket == NULL) {
@@ -382,7 +381,7 @@ cleanup_port:
     if (port->notify_socket) {
         nl_socket_free(port->notify_socket);
     }
-    free_port_counters(&port->pcounters);
+    free_port_counters(port);
     aim_free(port);
 }
 
@@ -430,7 +429,7 @@ ind_ovs_port_deleted(uint32_t port_no)
     LOG_INFO("Deleted %s %s", port->is_uplink ? "uplink" : "port", port->ifname);
 
     nl_socket_free(port->notify_socket);
-    free_port_counters(&port->pcounters);
+    free_port_counters(port);
     aim_free(port);
     ind_ovs_ports[port_no] = NULL;
 
@@ -626,12 +625,23 @@ indigo_port_extended_stats_get(
 
         rtnl_link_put(link);
 
-        port_stats->rx_packets_unicast = get_packet_stats(&port->pcounters.rx_unicast_stats_handle);
-        port_stats->rx_packets_broadcast = get_packet_stats(&port->pcounters.rx_broadcast_stats_handle);
-        port_stats->rx_packets_multicast = get_packet_stats(&port->pcounters.rx_multicast_stats_handle);
-        port_stats->tx_packets_unicast = get_packet_stats(&port->pcounters.tx_unicast_stats_handle);
-        port_stats->tx_packets_broadcast = get_packet_stats(&port->pcounters.tx_broadcast_stats_handle);
-        port_stats->tx_packets_multicast = get_packet_stats(&port->pcounters.tx_multicast_stats_handle);
+        const struct stats_handle *handles[] = {
+            &port->pcounters.rx_unicast_stats_handle,
+            &port->pcounters.rx_broadcast_stats_handle,
+            &port->pcounters.rx_multicast_stats_handle,
+            &port->pcounters.tx_unicast_stats_handle,
+            &port->pcounters.tx_broadcast_stats_handle,
+            &port->pcounters.tx_multicast_stats_handle,
+        };
+        struct stats stats[6];
+        ind_ovs_stats_get_batch(handles, stats, 6);
+
+        port_stats->rx_packets_unicast = stats[0].packets;
+        port_stats->rx_packets_broadcast = stats[1].packets;
+        port_stats->rx_packets_multicast = stats[2].packets;
+        port_stats->tx_packets_unicast = stats[3].packets;
+        port_stats->tx_packets_broadcast = stats[4].packets;
+        port_stats->tx_packets_multicast = stats[5].packets;
 
         port_stats->link_up_count = port->link_up_count;
         port_stats->link_down_count = port->link_down_count;
@@ -1141,8 +1151,10 @@ ind_ovs_port_stats_select(of_port_no_t port_no)
 }
 
 static void
-alloc_port_counters(struct ind_ovs_port_counters *pcounters)
+alloc_port_counters(struct ind_ovs_port *port)
 {
+    struct ind_ovs_port_counters *pcounters = &port->pcounters;
+
     stats_alloc(&pcounters->rx_unicast_stats_handle);
     stats_alloc(&pcounters->tx_unicast_stats_handle);
     stats_alloc(&pcounters->rx_broadcast_stats_handle);
@@ -1150,11 +1162,36 @@ alloc_port_counters(struct ind_ovs_port_counters *pcounters)
     stats_alloc(&pcounters->rx_multicast_stats_handle);
     stats_alloc(&pcounters->tx_multicast_stats_handle);
     stats_alloc(&pcounters->rx_bad_vlan_stats_handle);
+
+    /* Same order as enum telemetry_port_counter */
+    const struct stats_handle *handles[] = {
+        &pcounters->rx_unicast_stats_handle,
+        &pcounters->tx_unicast_stats_handle,
+        &pcounters->rx_broadcast_stats_handle,
+        &pcounters->tx_broadcast_stats_handle,
+        &pcounters->rx_multicast_stats_handle,
+        &pcounters->tx_multicast_stats_handle,
+        &pcounters->rx_bad_vlan_stats_handle,
+    };
+    AIM_ASSERT(AIM_ARRAYSIZE(handles) == AIM_ARRAYSIZE(port->pcounters_telemetry));
+
+    int i;
+    for (i = 0; i < AIM_ARRAYSIZE(handles); i++) {
+        telemetry_register(&port->pcounters_telemetry[i], handles[i],
+                           TELEMETRY_TYPE_PORT, i, port->dp_port_no, 0);
+    }
 }
 
 static void
-free_port_counters(struct ind_ovs_port_counters *pcounters)
+free_port_counters(struct ind_ovs_port *port)
 {
+    struct ind_ovs_port_counters *pcounters = &port->pcounters;
+
+    int i;
+    for (i = 0; i < AIM_ARRAYSIZE(port->pcounters_telemetry); i++) {
+        telemetry_unregister(&port->pcounters_telemetry[i]);
+    }
+
     stats_free(&pcounters->rx_unicast_stats_handle);
     stats_free(&pcounters->tx_unicast_stats_handle);
     stats_free(&pcounters->rx_broadcast_stats_handle);
@@ -1164,14 +1201,6 @@ free_port_counters(struct ind_ovs_port_counters *pcounters)
     stats_free(&pcounters->rx_bad_vlan_stats_handle);
 }
 
-static uint64_t
-get_packet_stats(struct stats_handle *handle)
-{
-    struct stats stats;
-    stats_get(handle, &stats);
-    return stats.packets;
-}
-
 bool
 ind_ovs_port_running(of_port_no_t port_no)
 {
@@ -152,6 +152,17 @@ struct stats_handle *ind_ovs_rx_vlan_stats_select(uint16_t vlan_vid);
 struct stats_handle *ind_ovs_tx_vlan_stats_select(uint16_t vlan_vid);
 struct ind_ovs_port_counters *ind_ovs_port_stats_select(of_port_no_t port_no);
 void ind_ovs_barrier_defer_revalidation(indigo_cxn_id_t cxn_id);
+void ind_ovs_barrier_defer_revalidation_object(indigo_cxn_id_t cxn_id, const void *object);
+
+/*
+ * Read OpenFlow stats. The kernel flow counts included are from the last
+ * periodic dump of the kernel flow table, about a second old. A flow-mod makes
+ * the next reads include every packet counted so far.
+ */
+void ind_ovs_stats_get(const struct stats_handle *handle, struct stats *result);
+void ind_ovs_stats_get_batch(const struct stats_handle *const handles[],
+                             struct stats results[], uint32_t count);
+
 bool ind_ovs_uplink_check(of_port_no_t port_no);
 of_port_no_t ind_ovs_uplink_select(void);
 extern uint16_t ind_ovs_inband_vlan;
@@ -0,0 +1,103 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * log_histogram - Fixed size histogram with logarithmic buckets
+ *
+ * Each power of 2 is split into LOG_HISTOGRAM_SUB_BUCKETS linear buckets, so
+ * a percentile read from the histogram is within 25% of the true value. The
+ * struct contains no pointers and needs no initialization beyond zeroing,
+ * so it can be placed in memory shared between processes. A histogram must
+ * only be written by a single thread, but may be read concurrently.
+ */
+
+#ifndef LOG_HISTOGRAM_H
+#define LOG_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define LOG_HISTOGRAM_SUB_BUCKET_BITS 2
+#define LOG_HISTOGRAM_SUB_BUCKETS (1 << LOG_HISTOGRAM_SUB_BUCKET_BITS)
+#define LOG_HISTOGRAM_BUCKETS ((64 - LOG_HISTOGRAM_SUB_BUCKET_BITS + 1) * LOG_HISTOGRAM_SUB_BUCKETS)
+
+struct log_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LOG_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Return the index of the bucket containing 'value'
+ */
+static inline uint32_t
+log_histogram_bucket(uint64_t value)
+{
+    if (value < LOG_HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    uint32_t msb = 63 - __builtin_clzll(value);
+    uint32_t shift = msb - LOG_HISTOGRAM_SUB_BUCKET_BITS;
+    uint32_t sub_bucket = (value >> shift) & (LOG_HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * LOG_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/*
+ * Record a value
+ */
+static inline void
+log_histogram_add(struct log_histogram *hist, uint64_t value)
+{
+    hist->buckets[log_histogram_bucket(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/*
+ * Return the smallest value that falls in the given bucket
+ */
+uint64_t log_histogram_bucket_min(uint32_t bucket);
+
+/*
+ * Return the largest value that falls in the given bucket
+ */
+uint64_t log_histogram_bucket_max(uint32_t bucket);
+
+/*
+ * Add the contents of 'src' to 'dst'
+ */
+void log_histogram_merge(struct log_histogram *dst, const struct log_histogram *src);
+
+/*
+ * Return an upper bound on the given percentile (0-100)
+ *
+ * Returns 0 if the histogram is empty.
+ */
+uint64_t log_histogram_percentile(const struct log_histogram *hist, double percentile);
+
+/*
+ * Reset the histogram to empty
+ */
+void log_histogram_clear(struct log_histogram *hist);
+
+#endif
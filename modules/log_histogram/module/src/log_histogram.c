@@ -0,0 +1,91 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <log_histogram/log_histogram.h>
+#include <string.h>
+
+uint64_t
+log_histogram_bucket_min(uint32_t bucket)
+{
+    if (bucket < LOG_HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    uint32_t shift = bucket / LOG_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = bucket % LOG_HISTOGRAM_SUB_BUCKETS;
+    return (LOG_HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+}
+
+uint64_t
+log_histogram_bucket_max(uint32_t bucket)
+{
+    if (bucket == LOG_HISTOGRAM_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+
+    return log_histogram_bucket_min(bucket + 1) - 1;
+}
+
+void
+log_histogram_merge(struct log_histogram *dst, const struct log_histogram *src)
+{
+    int i;
+    for (i = 0; i < LOG_HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t
+log_histogram_percentile(const struct log_histogram *hist, double percentile)
+{
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    /* Number of values at or below the percentile, rounded up */
+    uint64_t rank = hist->count * percentile / 100;
+    if (rank < hist->count * percentile / 100 || rank == 0) {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < LOG_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = log_histogram_bucket_max(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    /* Concurrently updated and the count got ahead of the buckets */
+    return hist->max;
+}
+
+void
+log_histogram_clear(struct log_histogram *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
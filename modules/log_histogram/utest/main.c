@@ -0,0 +1,140 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <AIM/aim.h>
+#include <log_histogram/log_histogram.h>
+#include <assert.h>
+
+static void
+test_buckets(void)
+{
+    /* Small values get their own bucket */
+    assert(log_histogram_bucket(0) == 0);
+    assert(log_histogram_bucket(1) == 1);
+    assert(log_histogram_bucket(3) == 3);
+
+    /* Each power of 2 is split into 4 buckets */
+    assert(log_histogram_bucket(4) == 4);
+    assert(log_histogram_bucket(7) == 7);
+    assert(log_histogram_bucket(8) == 8);
+    assert(log_histogram_bucket(9) == 8);
+    assert(log_histogram_bucket(10) == 9);
+    assert(log_histogram_bucket(15) == 11);
+    assert(log_histogram_bucket(16) == 12);
+    assert(log_histogram_bucket(UINT64_MAX) == LOG_HISTOGRAM_BUCKETS - 1);
+
+    /* Bucket bounds should be contiguous and contain their values */
+    uint32_t i;
+    for (i = 0; i < LOG_HISTOGRAM_BUCKETS; i++) {
+        uint64_t min = log_histogram_bucket_min(i);
+        uint64_t max = log_histogram_bucket_max(i);
+        assert(min <= max);
+        assert(log_histogram_bucket(min) == i);
+        assert(log_histogram_bucket(max) == i);
+        if (i > 0) {
+            assert(log_histogram_bucket_max(i - 1) + 1 == min);
+        }
+    }
+}
+
+static void
+test_percentile(void)
+{
+    struct log_histogram hist;
+    log_histogram_clear(&hist);
+
+    /* Empty histogram */
+    assert(log_histogram_percentile(&hist, 50) == 0);
+    assert(log_histogram_percentile(&hist, 99) == 0);
+
+    /* Single value */
+    log_histogram_add(&hist, 3);
+    assert(hist.count == 1);
+    assert(hist.sum == 3);
+    assert(hist.max == 3);
+    assert(log_histogram_percentile(&hist, 0) == 3);
+    assert(log_histogram_percentile(&hist, 100) == 3);
+
+    /* 1..1000 */
+    log_histogram_clear(&hist);
+    uint64_t i;
+    for (i = 1; i <= 1000; i++) {
+        log_histogram_add(&hist, i);
+    }
+    assert(hist.count == 1000);
+    assert(hist.sum == 500500);
+    assert(hist.max == 1000);
+
+    /* Upper bound within 25% of the true value */
+    uint64_t p50 = log_histogram_percentile(&hist, 50);
+    assert(p50 >= 500 && p50 <= 625);
+    uint64_t p99 = log_histogram_percentile(&hist, 99);
+    assert(p99 >= 990 && p99 <= 1000);
+    assert(log_histogram_percentile(&hist, 100) == 1000);
+
+    /* A single outlier shows up in the tail but not the median */
+    log_histogram_clear(&hist);
+    for (i = 0; i < 999; i++) {
+        log_histogram_add(&hist, 10);
+    }
+    log_histogram_add(&hist, 1000000);
+    assert(log_histogram_percentile(&hist, 50) == 11);
+    assert(log_histogram_percentile(&hist, 99.9) == 11);
+    assert(log_histogram_percentile(&hist, 100) == 1000000);
+}
+
+static void
+test_merge(void)
+{
+    struct log_histogram a, b;
+    log_histogram_clear(&a);
+    log_histogram_clear(&b);
+
+    log_histogram_add(&a, 1);
+    log_histogram_add(&a, 100);
+    log_histogram_add(&b, 5);
+    log_histogram_add(&b, 200);
+
+    log_histogram_merge(&a, &b);
+    assert(a.count == 4);
+    assert(a.sum == 306);
+    assert(a.max == 200);
+    assert(a.buckets[log_histogram_bucket(1)] == 1);
+    assert(a.buckets[log_histogram_bucket(5)] == 1);
+    assert(a.buckets[log_histogram_bucket(100)] == 1);
+    assert(a.buckets[log_histogram_bucket(200)] == 1);
+
+    /* Source is unchanged */
+    assert(b.count == 2);
+}
+
+int aim_main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_buckets();
+    test_percentile();
+    test_merge();
+
+    return 0;
+}
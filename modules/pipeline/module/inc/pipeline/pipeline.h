@@ -108,6 +108,38 @@ pipeline_add_stats(struct xbuf *stats, struct stats_handle *stats_handle)
     xbuf_append(stats, stats_handle, sizeof(*stats_handle));
 }
 
+/*
+ * Dependency tracking
+ *
+ * While a dependency xbuf is set, pipeline implementations record a pointer
+ * to each table and table entry they consult in pipeline_process. The kflow
+ * subsystem stores these with each kflow. When a pipeline changes an object
+ * it calls ind_ovs_barrier_defer_revalidation_object, and only the kflows
+ * that recorded that object are revalidated.
+ *
+ * A flow add can change the result for any packet that looked up the table,
+ * so pipelines should record the table as well as the entry that matched.
+ */
+extern struct xbuf *pipeline_dependencies;
+
+/*
+ * Collect dependencies from subsequent pipeline_process calls into 'deps'
+ *
+ * Pass NULL to stop collecting.
+ */
+void pipeline_dependencies_set(struct xbuf *deps);
+
+/*
+ * Record that the current pipeline_process call consulted 'object'
+ */
+static inline void
+pipeline_add_dependency(const void *object)
+{
+    if (pipeline_dependencies != NULL) {
+        xbuf_append_ptr(pipeline_dependencies, (void *)object);
+    }
+}
+
 /*
  * Set the queue priority for inband control packets.
  */
@@ -43,6 +43,8 @@ static struct pipeline *current_pipeline;
 
 static int queue_priority_inband = -1;
 
+struct xbuf *pipeline_dependencies;
+
 void
 pipeline_register(const char *name, const struct pipeline_ops *ops)
 {
@@ -169,6 +171,12 @@ pipeline_process(struct ind_ovs_parsed_key *key,
     return rv;
 }
 
+void
+pipeline_dependencies_set(struct xbuf *deps)
+{
+    pipeline_dependencies = deps;
+}
+
 void
 pipeline_inband_queue_priority_set(int priority)
 {
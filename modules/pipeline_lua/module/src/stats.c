@@ -101,7 +101,7 @@ void
 pipeline_lua_stats_get(uint32_t slot, struct stats *result)
 {
     if (slot < NUM_STATS) {
-        stats_get(&stats[slot], result);
+        ind_ovs_stats_get(&stats[slot], result);
     } else {
         memset(result, 0xff, sizeof(*result));
     }
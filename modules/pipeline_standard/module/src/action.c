@@ -200,6 +200,8 @@ process_group(
 {
     packet_trace("group %u type %u", group->id, group->type);
 
+    pipeline_add_dependency(group);
+
     if (group->value.num_buckets == 0) {
         packet_trace("empty group");
         return;
@@ -78,4 +78,12 @@ void pipeline_standard_translate_actions(
 /* Netlink socket to be used for receiving pktin's */
 extern struct ind_ovs_pktin_socket pktin_soc;
 
+/*
+ * Scratch memory for translating the actions of a flow or group
+ *
+ * The translated actions are compacted onto the heap and the arena is reset
+ * before returning to indigo core.
+ */
+extern struct xbuf_arena pipeline_standard_arena;
+
 #endif
@@ -0,0 +1,383 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include "action_cache.h"
+#include "action.h"
+#include <ivs/ivs.h>
+#include <AIM/aim.h>
+#include <OVSDriver/ovsdriver.h>
+#include <murmur/murmur.h>
+#include <netlink/genl/genl.h>
+#include <packet_trace/packet_trace.h>
+#include <shared_debug_counter/shared_debug_counter.h>
+
+/* Number of cached translations. Must be a power of 2. */
+#define ACTION_CACHE_SIZE 1024
+
+/* Translations producing more OVS actions than this aren't cached */
+#define ACTION_CACHE_MAX_LEN 256
+
+#ifndef NDEBUG
+#define ACTION_CACHE_TEST_HITS true
+#else
+#define ACTION_CACHE_TEST_HITS false
+#endif
+
+struct action_cache_entry {
+    const struct xbuf *actions; /* NULL if unused */
+    uint64_t generation;
+    uint32_t hash;
+    uint16_t len;
+    bool has_mask;
+    uint64_t attrs; /* bitmap of OVS_KEY_ATTR_* the translation depends on */
+    uint64_t in_modified_attrs;
+    uint64_t out_modified_attrs;
+    struct ind_ovs_parsed_key in_key;
+    struct ind_ovs_parsed_key out_key;
+    struct ind_ovs_parsed_key mask;
+    uint8_t data[ACTION_CACHE_MAX_LEN];
+};
+
+/*
+ * Allocated on first use. Upcall processes inherit the entries of the main
+ * process and then fill in their own copy.
+ */
+static struct action_cache_entry *action_cache;
+
+/* Incremented to invalidate every entry */
+static uint64_t action_cache_generation = 1;
+
+SHARED_DEBUG_COUNTER(hit, "pipeline_standard.action_cache.hit",
+                     "Action translation replayed from the cache");
+SHARED_DEBUG_COUNTER(miss, "pipeline_standard.action_cache.miss",
+                     "Action translation added to the cache");
+SHARED_DEBUG_COUNTER(bypass, "pipeline_standard.action_cache.bypass",
+                     "Action translation that could not be cached");
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize (4)
+#endif
+
+/*
+ * Find the key attributes that translating 'actions' reads or writes
+ *
+ * Returns false if the translation depends on anything else.
+ */
+static bool
+action_cache_key_attrs(struct xbuf *actions, uint64_t *attrs)
+{
+    uint64_t bitmap = 0;
+    struct nlattr *attr;
+    XBUF_FOREACH2(actions, attr) {
+        switch (attr->nla_type) {
+        case IND_OVS_ACTION_OUTPUT:
+        case IND_OVS_ACTION_LOCAL:
+        case IND_OVS_ACTION_CONTROLLER:
+            break;
+        case IND_OVS_ACTION_IN_PORT:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_IN_PORT);
+            break;
+        case IND_OVS_ACTION_SET_ETH_DST:
+        case IND_OVS_ACTION_SET_ETH_SRC:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_ETHERNET);
+            break;
+        case IND_OVS_ACTION_SET_VLAN_VID:
+        case IND_OVS_ACTION_SET_VLAN_PCP:
+        case IND_OVS_ACTION_POP_VLAN:
+        case IND_OVS_ACTION_PUSH_VLAN:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_VLAN);
+            break;
+        case IND_OVS_ACTION_SET_IPV4_DST:
+        case IND_OVS_ACTION_SET_IPV4_SRC:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_IPV4);
+            break;
+        case IND_OVS_ACTION_SET_IPV6_DST:
+        case IND_OVS_ACTION_SET_IPV6_SRC:
+        case IND_OVS_ACTION_SET_IPV6_FLABEL:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_IPV6);
+            break;
+        case IND_OVS_ACTION_SET_IP_DSCP:
+        case IND_OVS_ACTION_SET_IP_ECN:
+        case IND_OVS_ACTION_DEC_NW_TTL:
+        case IND_OVS_ACTION_SET_NW_TTL:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_IPV4);
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_IPV6);
+            break;
+        case IND_OVS_ACTION_SET_TCP_DST:
+        case IND_OVS_ACTION_SET_TCP_SRC:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_TCP);
+            break;
+        case IND_OVS_ACTION_SET_UDP_DST:
+        case IND_OVS_ACTION_SET_UDP_SRC:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_UDP);
+            break;
+        case IND_OVS_ACTION_SET_TP_DST:
+        case IND_OVS_ACTION_SET_TP_SRC:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_TCP);
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_UDP);
+            break;
+        case IND_OVS_ACTION_SET_PRIORITY:
+            ATTR_BITMAP_SET(bitmap, OVS_KEY_ATTR_PRIORITY);
+            break;
+        default:
+            /* Groups, or an action this function doesn't know about */
+            return false;
+        }
+    }
+
+    *attrs = bitmap;
+    return true;
+}
+
+static uint32_t
+action_cache_hash(const struct action_context *ctx, const struct xbuf *actions,
+                  uint64_t attrs)
+{
+    struct {
+        const struct xbuf *actions;
+        uint64_t populated;
+        uint64_t modified_attrs;
+    } header = {
+        .actions = actions,
+        .populated = ctx->current_key.populated,
+        .modified_attrs = ctx->modified_attrs,
+    };
+
+    uint32_t hash = murmur_hash(&header, sizeof(header), ind_ovs_salt);
+
+#define field(attr, name, type) \
+    if (ATTR_BITMAP_TEST(attrs, (attr))) { \
+        hash = murmur_hash(&ctx->current_key.name, sizeof(type), hash); \
+    }
+OVS_KEY_FIELDS
+#undef field
+
+    return hash;
+}
+
+static bool
+action_cache_match(const struct action_cache_entry *entry,
+                   const struct action_context *ctx,
+                   const struct xbuf *actions, uint64_t attrs, uint32_t hash)
+{
+    if (entry->actions != actions ||
+            entry->generation != action_cache_generation ||
+            entry->hash != hash ||
+            entry->attrs != attrs ||
+            entry->in_modified_attrs != ctx->modified_attrs ||
+            entry->in_key.populated != ctx->current_key.populated) {
+        return false;
+    }
+
+#define field(attr, name, type) \
+    if (ATTR_BITMAP_TEST(attrs, (attr)) && \
+            memcmp(&entry->in_key.name, &ctx->current_key.name, sizeof(type))) { \
+        return false; \
+    }
+OVS_KEY_FIELDS
+#undef field
+
+    return true;
+}
+
+static void
+mask_or(struct ind_ovs_parsed_key *dst, const struct ind_ovs_parsed_key *src)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    unsigned i;
+    for (i = 0; i < sizeof(*dst); i++) {
+        d[i] |= s[i];
+    }
+}
+
+static void
+action_cache_replay(const struct action_cache_entry *entry,
+                    struct action_context *ctx)
+{
+    if (entry->len > 0) {
+        /* Room was checked by the caller */
+        void *dst = nlmsg_reserve(ctx->msg, entry->len, NLA_ALIGNTO);
+        assert(dst);
+        memcpy(dst, entry->data, entry->len);
+    }
+
+    ctx->current_key.populated = entry->out_key.populated;
+
+#define field(attr, name, type) \
+    if (ATTR_BITMAP_TEST(entry->attrs, (attr))) { \
+        memcpy(&ctx->current_key.name, &entry->out_key.name, sizeof(type)); \
+    }
+OVS_KEY_FIELDS
+#undef field
+
+    ctx->modified_attrs = entry->out_modified_attrs;
+
+    if (entry->has_mask && ctx->mask) {
+        mask_or(ctx->mask, &entry->mask);
+    }
+}
+
+/*
+ * Self test for the action cache
+ *
+ * In debug builds, this function is run after every cache hit. It translates
+ * the actions again starting from 'orig_ctx', the context before the replay,
+ * and checks that the replay produced the same OVS actions, current key,
+ * modified attributes and mask bits. A difference means the cache key is
+ * missing something the translation depends on. 'start' is the length of the
+ * message before the replay.
+ */
+static void
+test_action_cache_hit(const struct action_cache_entry *entry,
+                      const struct action_context *orig_ctx, uint32_t start,
+                      const struct action_context *ctx,
+                      struct xbuf *actions, uint32_t hash, struct xbuf *stats)
+{
+    struct ind_ovs_parsed_key mask;
+    memset(&mask, 0, sizeof(mask));
+
+    struct action_context fresh = *orig_ctx;
+    fresh.mask = &mask;
+    fresh.msg = nlmsg_alloc();
+    AIM_TRUE_OR_DIE(fresh.msg != NULL, "failed to allocate netlink message");
+
+    pipeline_standard_translate_actions(&fresh, actions, hash, stats);
+
+    struct nlmsghdr *nlh = nlmsg_hdr(fresh.msg);
+    uint32_t len = nlmsg_hdr(ctx->msg)->nlmsg_len - start;
+
+    if ((uint32_t)nlmsg_datalen(nlh) != len ||
+            memcmp(nlmsg_data(nlh), (char *)nlmsg_hdr(ctx->msg) + start, len) ||
+            memcmp(&fresh.current_key, &ctx->current_key, sizeof(fresh.current_key)) ||
+            fresh.modified_attrs != ctx->modified_attrs ||
+            memcmp(&mask, &entry->mask, sizeof(mask))) {
+        AIM_DIE("Cached action translation differs from a fresh one");
+    }
+
+    nlmsg_free(fresh.msg);
+}
+
+/*
+ * Translate the actions and record the result in 'entry'
+ *
+ * The translation writes its mask bits to a separate mask so that only the
+ * bits it used are recorded.
+ */
+static void
+action_cache_compile(struct action_cache_entry *entry,
+                     struct action_context *ctx, struct xbuf *actions,
+                     uint64_t attrs, uint32_t key_hash,
+                     uint32_t hash, struct xbuf *stats)
+{
+    static const struct ind_ovs_parsed_key zero_mask;
+    struct ind_ovs_parsed_key *mask = ctx->mask;
+    uint32_t start = nlmsg_hdr(ctx->msg)->nlmsg_len;
+
+    entry->actions = NULL;
+    entry->in_key = ctx->current_key;
+    entry->in_modified_attrs = ctx->modified_attrs;
+    memset(&entry->mask, 0, sizeof(entry->mask));
+
+    ctx->mask = &entry->mask;
+    pipeline_standard_translate_actions(ctx, actions, hash, stats);
+    ctx->mask = mask;
+
+    if (mask) {
+        mask_or(mask, &entry->mask);
+    }
+
+    uint32_t len = nlmsg_hdr(ctx->msg)->nlmsg_len - start;
+    if (len > ACTION_CACHE_MAX_LEN) {
+        return;
+    }
+
+    memcpy(entry->data, (char *)nlmsg_hdr(ctx->msg) + start, len);
+    entry->len = len;
+    entry->has_mask = memcmp(&entry->mask, &zero_mask, sizeof(zero_mask)) != 0;
+    entry->out_key = ctx->current_key;
+    entry->out_modified_attrs = ctx->modified_attrs;
+    entry->attrs = attrs;
+    entry->hash = key_hash;
+    entry->generation = action_cache_generation;
+    entry->actions = actions;
+}
+
+void
+pipeline_standard_translate_actions_cached(
+    struct action_context *ctx, struct xbuf *actions,
+    uint32_t hash, struct xbuf *stats)
+{
+    uint64_t attrs;
+
+    /*
+     * Bypass the cache if the actions might not fit, since a translation
+     * truncated by a full message must not be recorded. Packet traces need
+     * the action functions to run.
+     */
+    if (packet_trace_enabled ||
+            nlmsg_get_max_size(ctx->msg) - nlmsg_hdr(ctx->msg)->nlmsg_len < ACTION_CACHE_MAX_LEN ||
+            !action_cache_key_attrs(actions, &attrs)) {
+        debug_counter_inc(&bypass);
+        pipeline_standard_translate_actions(ctx, actions, hash, stats);
+        return;
+    }
+
+    /* Pending set-field actions are written out by the first output */
+    attrs |= ctx->modified_attrs;
+
+    if (action_cache == NULL) {
+        action_cache = aim_zmalloc(sizeof(*action_cache) * ACTION_CACHE_SIZE);
+    }
+
+    uint32_t key_hash = action_cache_hash(ctx, actions, attrs);
+    struct action_cache_entry *entry = &action_cache[key_hash & (ACTION_CACHE_SIZE - 1)];
+
+    if (action_cache_match(entry, ctx, actions, attrs, key_hash)) {
+        struct action_context orig_ctx;
+        uint32_t start = 0;
+        if (ACTION_CACHE_TEST_HITS) {
+            orig_ctx = *ctx;
+            start = nlmsg_hdr(ctx->msg)->nlmsg_len;
+        }
+        action_cache_replay(entry, ctx);
+        if (ACTION_CACHE_TEST_HITS) {
+            test_action_cache_hit(entry, &orig_ctx, start, ctx, actions, hash, stats);
+        }
+        debug_counter_inc(&hit);
+        return;
+    }
+
+    debug_counter_inc(&miss);
+    action_cache_compile(entry, ctx, actions, attrs, key_hash, hash, stats);
+}
+
+void
+pipeline_standard_action_cache_invalidate(void)
+{
+    action_cache_generation++;
+}
+
+void
+pipeline_standard_action_cache_cleanup(void)
+{
+    aim_free(action_cache);
+    action_cache = NULL;
+    action_cache_generation++;
+}
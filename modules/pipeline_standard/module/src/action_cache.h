@@ -0,0 +1,50 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#ifndef PIPELINE_STANDARD_ACTION_CACHE_H
+#define PIPELINE_STANDARD_ACTION_CACHE_H
+
+#include <xbuf/xbuf.h>
+#include <action/action.h>
+
+/*
+ * Cache of translated OVS actions
+ *
+ * Translating a flow's actions depends only on the action list and the
+ * fields of the current key that the actions read or write, plus any
+ * set-field actions still pending from earlier tables. The cache maps those
+ * inputs to the resulting OVS action attributes, the changes to the action
+ * context and the mask bits used, so a repeat translation is a memcpy.
+ *
+ * Action lists containing groups aren't cached because they also depend on
+ * the packet hash and add stats handles and dependencies.
+ */
+
+/* Same as pipeline_standard_translate_actions, using the cache if possible */
+void pipeline_standard_translate_actions_cached(
+    struct action_context *ctx, struct xbuf *actions,
+    uint32_t hash, struct xbuf *stats);
+
+/* Forget every cached translation, after an action list changed or was freed */
+void pipeline_standard_action_cache_invalidate(void);
+
+/* Free the cache */
+void pipeline_standard_action_cache_cleanup(void);
+
+#endif
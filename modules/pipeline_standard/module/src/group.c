@@ -52,14 +52,14 @@ parse_group_value(int group_type, of_list_bucket_t *of_buckets, struct group_val
     uint16_t num_buckets = 0;
 
     struct xbuf buckets_xbuf;
-    xbuf_init(&buckets_xbuf);
+    xbuf_init_arena(&buckets_xbuf, &pipeline_standard_arena);
 
     of_bucket_t of_bucket;
     int rv;
     OF_LIST_BUCKET_ITER(of_buckets, &of_bucket, rv) {
         struct group_bucket *bucket =
             xbuf_reserve(&buckets_xbuf, sizeof(*bucket));
-        xbuf_init(&bucket->actions);
+        xbuf_init_arena(&bucket->actions, &pipeline_standard_arena);
         stats_alloc(&bucket->stats_handle);
         num_buckets++;
 
@@ -94,16 +94,16 @@ parse_group_value(int group_type, of_list_bucket_t *of_buckets, struct group_val
         xbuf_compact(&bucket->actions);
     }
 
-    xbuf_compact(&buckets_xbuf);
-
     value->buckets = xbuf_steal(&buckets_xbuf);
     value->num_buckets = num_buckets;
+    xbuf_arena_reset(&pipeline_standard_arena);
     return INDIGO_ERROR_NONE;
 
 error:
     value->buckets = xbuf_steal(&buckets_xbuf);
     value->num_buckets = num_buckets;
     cleanup_group_value(value);
+    xbuf_arena_reset(&pipeline_standard_arena);
     return err;
 }
 
@@ -158,7 +158,7 @@ group_modify(
     cleanup_group_value(&group->value);
     group->value = value;
 
-    ind_ovs_barrier_defer_revalidation(cxn_id);
+    ind_ovs_barrier_defer_revalidation_object(cxn_id, group);
     return INDIGO_ERROR_NONE;
 }
 
@@ -183,22 +183,38 @@ group_stats_get(
     of_list_bucket_counter_t bucket_counters;
     of_group_stats_entry_bucket_stats_bind(stats, &bucket_counters);
 
+    uint16_t num_buckets = group->value.num_buckets;
+    if (num_buckets == 0) {
+        of_group_stats_entry_packet_count_set(stats, 0);
+        of_group_stats_entry_byte_count_set(stats, 0);
+        return INDIGO_ERROR_NONE;
+    }
+
+    const struct stats_handle **handles = aim_malloc(num_buckets * sizeof(*handles));
+    struct stats *bucket_stats = aim_malloc(num_buckets * sizeof(*bucket_stats));
+
     int i;
-    for (i = 0; i < group->value.num_buckets; i++) {
+    for (i = 0; i < num_buckets; i++) {
+        handles[i] = &group->value.buckets[i].stats_handle;
+    }
+
+    ind_ovs_stats_get_batch(handles, bucket_stats, num_buckets);
+
+    for (i = 0; i < num_buckets; i++) {
         of_bucket_counter_t bucket_counter;
         of_bucket_counter_init(&bucket_counter, stats->version, -1, 1);
         (void) of_list_bucket_counter_append_bind(&bucket_counters, &bucket_counter);
 
-        struct stats stats;
-        stats_get(&group->value.buckets[i].stats_handle, &stats);
+        of_bucket_counter_packet_count_set(&bucket_counter, bucket_stats[i].packets);
+        of_bucket_counter_byte_count_set(&bucket_counter, bucket_stats[i].bytes);
 
-        of_bucket_counter_packet_count_set(&bucket_counter, stats.packets);
-        of_bucket_counter_byte_count_set(&bucket_counter, stats.bytes);
-
-        total_packets += stats.packets;
-        total_bytes += stats.bytes;
+        total_packets += bucket_stats[i].packets;
+        total_bytes += bucket_stats[i].bytes;
     }
 
+    aim_free(handles);
+    aim_free(bucket_stats);
+
     of_group_stats_entry_packet_count_set(stats, total_packets);
     of_group_stats_entry_byte_count_set(stats, total_bytes);
     return INDIGO_ERROR_NONE;
@@ -29,8 +29,10 @@
 #include <indigo/of_state_manager.h>
 #include <murmur/murmur.h>
 #include <packet_trace/packet_trace.h>
+#include <telemetry/telemetry.h>
 #include "cfr.h"
 #include "action.h"
+#include "action_cache.h"
 #include "group.h"
 
 #define AIM_LOG_MODULE_NAME pipeline_standard
@@ -46,6 +48,9 @@ AIM_LOG_STRUCT_DEFINE(AIM_LOG_OPTIONS_DEFAULT, AIM_LOG_BITS_DEFAULT, NULL, 0);
 /* Overall packet-in burstiness tolerance. */
 #define PKTIN_BURST_SIZE 32
 
+/* Holds the actions of any ordinary flow or group while they're translated */
+#define ARENA_CHUNK_SIZE 4096
+
 struct flowtable {
     struct tcam *tcam;
     struct stats_handle matched_stats_handle;
@@ -68,6 +73,7 @@ struct flowtable_entry {
     struct flowtable_value value;
 
     struct stats_handle stats_handle;
+    struct telemetry_object telemetry;
 
     /* Packet stats from the last hit bit check */
     /* See indigo_fwd_table_stats_get */
@@ -86,6 +92,7 @@ static struct flowtable *flowtables[NUM_TABLES];
 static const indigo_core_table_ops_t table_ops;
 
 struct ind_ovs_pktin_socket pktin_soc;
+struct xbuf_arena pipeline_standard_arena;
 
 static void
 pipeline_standard_init(const char *name)
@@ -98,6 +105,8 @@ pipeline_standard_init(const char *name)
         AIM_DIE("unexpected pipeline name '%s'", name);
     }
 
+    xbuf_arena_init(&pipeline_standard_arena, ARENA_CHUNK_SIZE);
+
     int i;
     for (i = 0; i < NUM_TABLES; i++) {
         struct flowtable *flowtable = aim_zmalloc(sizeof(*flowtable));
@@ -136,6 +145,9 @@ pipeline_standard_finish(void)
     }
 
     ind_ovs_pktin_socket_unregister(&pktin_soc);
+
+    xbuf_arena_cleanup(&pipeline_standard_arena);
+    pipeline_standard_action_cache_cleanup();
 }
 
 indigo_error_t
@@ -167,6 +179,8 @@ pipeline_standard_process(struct ind_ovs_parsed_key *key,
         struct flowtable *flowtable = flowtables[table_id];
         AIM_ASSERT(flowtable != NULL);
 
+        pipeline_add_dependency(flowtable);
+
         struct tcam_entry *tcam_entry = tcam_match_and_mask(flowtable->tcam, &cfr, &cfr_mask);
         if (tcam_entry == NULL) {
             if (openflow_version < OF_VERSION_1_3) {
@@ -183,6 +197,8 @@ pipeline_standard_process(struct ind_ovs_parsed_key *key,
 
         struct flowtable_entry *entry = container_of(tcam_entry, tcam_entry, struct flowtable_entry);
 
+        pipeline_add_dependency(entry);
+
         if (packet_trace_enabled) {
             packet_trace("hit flowtable entry");
             packet_trace("fields:");
@@ -199,8 +215,8 @@ pipeline_standard_process(struct ind_ovs_parsed_key *key,
 
         pipeline_add_stats(stats, &entry->stats_handle);
 
-        pipeline_standard_translate_actions(actx, &entry->value.apply_actions,
-                                            hash, stats);
+        pipeline_standard_translate_actions_cached(
+            actx, &entry->value.apply_actions, hash, stats);
 
         table_id = entry->value.next_table_id;
 
@@ -369,8 +385,8 @@ parse_value(of_flow_add_t *flow_mod, struct flowtable_value *value,
     of_list_action_t openflow_actions;
     indigo_error_t err;
 
-    xbuf_init(&value->apply_actions);
-    xbuf_init(&value->write_actions);
+    xbuf_init_arena(&value->apply_actions, &pipeline_standard_arena);
+    xbuf_init_arena(&value->write_actions, &pipeline_standard_arena);
 
     value->clear_actions = 0;
     value->meter_id = -1;
@@ -431,14 +447,17 @@ parse_value(of_flow_add_t *flow_mod, struct flowtable_value *value,
         }
     }
 
+    /* Moves the actions to the heap, or frees nothing if they're empty */
     xbuf_compact(&value->apply_actions);
     xbuf_compact(&value->write_actions);
+    xbuf_arena_reset(&pipeline_standard_arena);
 
     return INDIGO_ERROR_NONE;
 
 error:
     pipeline_standard_cleanup_actions(&value->apply_actions);
     pipeline_standard_cleanup_actions(&value->write_actions);
+    xbuf_arena_reset(&pipeline_standard_arena);
     return err;
 }
 
@@ -463,6 +482,7 @@ flowtable_entry_create(
     struct pipeline_standard_cfr key;
     struct pipeline_standard_cfr mask;
     uint16_t priority;
+    uint64_t cookie;
 
     if (of_flow_add_match_get(obj, &match) < 0) {
         aim_free(entry);
@@ -470,6 +490,7 @@ flowtable_entry_create(
     }
 
     of_flow_add_priority_get(obj, &priority);
+    of_flow_add_cookie_get(obj, &cookie);
 
     pipeline_standard_match_to_cfr(&match, &key, &mask);
 
@@ -490,9 +511,11 @@ flowtable_entry_create(
     tcam_insert(flowtable->tcam, &entry->tcam_entry, &key, &mask, priority);
 
     stats_alloc(&entry->stats_handle);
+    telemetry_register(&entry->telemetry, &entry->stats_handle,
+                       TELEMETRY_TYPE_FLOW, flowtable->table_id, flow_id, cookie);
 
     *entry_priv = entry;
-    ind_ovs_barrier_defer_revalidation(cxn_id);
+    ind_ovs_barrier_defer_revalidation_object(cxn_id, flowtable);
     return INDIGO_ERROR_NONE;
 }
 
@@ -514,8 +537,9 @@ flowtable_entry_modify(
     pipeline_standard_cleanup_actions(&entry->value.apply_actions);
     pipeline_standard_cleanup_actions(&entry->value.write_actions);
     entry->value = value;
+    pipeline_standard_action_cache_invalidate();
 
-    ind_ovs_barrier_defer_revalidation(cxn_id);
+    ind_ovs_barrier_defer_revalidation_object(cxn_id, entry);
     return INDIGO_ERROR_NONE;
 }
 
@@ -529,7 +553,7 @@ flowtable_entry_delete(
 
     tcam_remove(flowtable->tcam, &entry->tcam_entry);
 
-    ind_ovs_barrier_defer_revalidation(cxn_id);
+    ind_ovs_barrier_defer_revalidation_object(cxn_id, entry);
 
     struct stats stats;
     stats_get(&entry->stats_handle, &stats);
@@ -538,6 +562,8 @@ flowtable_entry_delete(
 
     pipeline_standard_cleanup_actions(&entry->value.apply_actions);
     pipeline_standard_cleanup_actions(&entry->value.write_actions);
+    pipeline_standard_action_cache_invalidate();
+    telemetry_unregister(&entry->telemetry);
     stats_free(&entry->stats_handle);
     aim_free(entry);
     return INDIGO_ERROR_NONE;
@@ -550,7 +576,7 @@ flowtable_entry_stats_get(
 {
     struct flowtable_entry *entry = entry_priv;
     struct stats stats;
-    stats_get(&entry->stats_handle, &stats);
+    ind_ovs_stats_get(&entry->stats_handle, &stats);
     flow_stats->packets = stats.packets;
     flow_stats->bytes = stats.bytes;
     return INDIGO_ERROR_NONE;
@@ -564,7 +590,7 @@ flowtable_entry_hit_status_get(
     struct flowtable_entry *entry = entry_priv;
 
     struct stats stats;
-    stats_get(&entry->stats_handle, &stats);
+    ind_ovs_stats_get(&entry->stats_handle, &stats);
 
     if (stats.packets != entry->last_hit_check_packets) {
         entry->last_hit_check_packets = stats.packets;
@@ -582,11 +608,14 @@ flowtable_stats_get(
     indigo_fi_table_stats_t *table_stats)
 {
     struct flowtable *flowtable = table_priv;
-    struct stats matched_stats, missed_stats;
-    stats_get(&flowtable->matched_stats_handle, &matched_stats);
-    stats_get(&flowtable->missed_stats_handle, &missed_stats);
-    table_stats->lookup_count = matched_stats.packets + missed_stats.packets;
-    table_stats->matched_count = matched_stats.packets;
+    const struct stats_handle *handles[] = {
+        &flowtable->matched_stats_handle,
+        &flowtable->missed_stats_handle,
+    };
+    struct stats stats[2];
+    ind_ovs_stats_get_batch(handles, stats, 2);
+    table_stats->lookup_count = stats[0].packets + stats[1].packets;
+    table_stats->matched_count = stats[0].packets;
     return INDIGO_ERROR_NONE;
 }
 
@@ -0,0 +1,73 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * slab - Allocator for fixed size objects
+ *
+ * Objects are carved out of SLAB_CHUNK_SIZE chunks aligned to their size,
+ * so freeing an object finds its chunk by masking the pointer. Chunks with
+ * free objects are kept on a list, and full chunks aren't tracked at all. A
+ * chunk is returned to the system when all its objects are freed, unless it
+ * is the only chunk with free space left.
+ *
+ * Objects are aligned to 8 bytes. A slab is not thread safe.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+
+#define SLAB_CHUNK_SIZE (64*1024)
+
+struct slab;
+
+/*
+ * Create a slab for objects of the given size
+ *
+ * 'object_size' must leave room for at least one object per chunk.
+ */
+struct slab *slab_create(uint32_t object_size);
+
+/*
+ * Destroy a slab, freeing all its objects
+ */
+void slab_destroy(struct slab *slab);
+
+/*
+ * Allocate an object. The contents are uninitialized. Never fails.
+ */
+void *slab_alloc(struct slab *slab);
+
+/*
+ * Free an object allocated from this slab
+ */
+void slab_free(struct slab *slab, void *object);
+
+/*
+ * Return the number of allocated objects
+ */
+uint32_t slab_count(const struct slab *slab);
+
+/*
+ * Return the number of chunks held
+ */
+uint32_t slab_chunks(const struct slab *slab);
+
+#endif
@@ -0,0 +1,189 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <slab/slab.h>
+#include <AIM/aim.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* Header at the start of each chunk */
+struct slab_chunk {
+    struct slab_chunk *prev, *next; /* slab->partial, if it has free objects */
+    void *free_list; /* freed objects, linked through their first word */
+    uint32_t num_free; /* objects on free_list or never allocated */
+    uint32_t num_fresh; /* objects never allocated, at the end of the chunk */
+    bool on_list;
+};
+
+struct slab {
+    uint32_t object_size;
+    uint32_t objects_per_chunk;
+    uint32_t first_offset; /* of the first object in a chunk */
+    uint32_t count;
+    uint32_t num_chunks;
+    struct slab_chunk *partial; /* chunks with free objects */
+};
+
+static inline struct slab_chunk *
+chunk_of(void *object)
+{
+    return (struct slab_chunk *)((uintptr_t)object & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+}
+
+static void
+list_add_chunk(struct slab *slab, struct slab_chunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = slab->partial;
+    if (slab->partial) {
+        slab->partial->prev = chunk;
+    }
+    slab->partial = chunk;
+    chunk->on_list = true;
+}
+
+static void
+list_remove_chunk(struct slab *slab, struct slab_chunk *chunk)
+{
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        slab->partial = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+    chunk->on_list = false;
+}
+
+static struct slab_chunk *
+chunk_create(struct slab *slab)
+{
+    void *mem;
+    if (posix_memalign(&mem, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE) != 0) {
+        AIM_DIE("Failed to allocate slab chunk");
+    }
+
+    struct slab_chunk *chunk = mem;
+    chunk->free_list = NULL;
+    chunk->num_free = slab->objects_per_chunk;
+    chunk->num_fresh = slab->objects_per_chunk;
+    slab->num_chunks++;
+    list_add_chunk(slab, chunk);
+    return chunk;
+}
+
+static void
+chunk_destroy(struct slab *slab, struct slab_chunk *chunk)
+{
+    if (chunk->on_list) {
+        list_remove_chunk(slab, chunk);
+    }
+    slab->num_chunks--;
+    free(chunk);
+}
+
+struct slab *
+slab_create(uint32_t object_size)
+{
+    struct slab *slab = aim_zmalloc(sizeof(*slab));
+
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+
+    slab->object_size = (object_size + 7) & ~7;
+    slab->first_offset = (sizeof(struct slab_chunk) + 63) & ~63;
+    AIM_TRUE_OR_DIE(slab->first_offset + slab->object_size <= SLAB_CHUNK_SIZE,
+                    "slab object size %u too large", object_size);
+    slab->objects_per_chunk = (SLAB_CHUNK_SIZE - slab->first_offset) / slab->object_size;
+
+    return slab;
+}
+
+void
+slab_destroy(struct slab *slab)
+{
+    /* Full chunks aren't tracked, so all objects must have been freed */
+    AIM_TRUE_OR_DIE(slab->count == 0, "slab destroyed with %u objects allocated", slab->count);
+
+    while (slab->partial) {
+        chunk_destroy(slab, slab->partial);
+    }
+
+    aim_free(slab);
+}
+
+void *
+slab_alloc(struct slab *slab)
+{
+    struct slab_chunk *chunk = slab->partial;
+    if (chunk == NULL) {
+        chunk = chunk_create(slab);
+    }
+
+    void *object;
+    if (chunk->free_list) {
+        object = chunk->free_list;
+        chunk->free_list = *(void **)object;
+    } else {
+        uint32_t index = slab->objects_per_chunk - chunk->num_fresh;
+        object = (char *)chunk + slab->first_offset + index * slab->object_size;
+        chunk->num_fresh--;
+    }
+
+    if (--chunk->num_free == 0) {
+        list_remove_chunk(slab, chunk);
+    }
+
+    slab->count++;
+    return object;
+}
+
+void
+slab_free(struct slab *slab, void *object)
+{
+    struct slab_chunk *chunk = chunk_of(object);
+
+    *(void **)object = chunk->free_list;
+    chunk->free_list = object;
+    slab->count--;
+
+    if (chunk->num_free++ == 0) {
+        list_add_chunk(slab, chunk);
+    }
+
+    /* Keep one chunk around to avoid thrashing on alloc/free pairs */
+    if (chunk->num_free == slab->objects_per_chunk &&
+            (slab->partial != chunk || chunk->next != NULL)) {
+        chunk_destroy(slab, chunk);
+    }
+}
+
+uint32_t
+slab_count(const struct slab *slab)
+{
+    return slab->count;
+}
+
+uint32_t
+slab_chunks(const struct slab *slab)
+{
+    return slab->num_chunks;
+}
@@ -0,0 +1,115 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <AIM/aim.h>
+#include <slab/slab.h>
+#include <assert.h>
+
+#define NUM_OBJECTS 10000
+
+static void
+test_alloc_free(void)
+{
+    struct slab *slab = slab_create(100);
+    void *objects[NUM_OBJECTS];
+    int i;
+
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        objects[i] = slab_alloc(slab);
+        assert(((uintptr_t)objects[i] & 7) == 0);
+        memset(objects[i], i & 0xff, 100);
+    }
+    assert(slab_count(slab) == NUM_OBJECTS);
+
+    /* Objects don't overlap */
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        uint8_t *p = objects[i];
+        assert(p[0] == (i & 0xff) && p[99] == (i & 0xff));
+    }
+
+    uint32_t chunks = slab_chunks(slab);
+    assert(chunks >= NUM_OBJECTS * 100 / SLAB_CHUNK_SIZE);
+
+    /* Freed objects are reused before new chunks are allocated */
+    for (i = 0; i < NUM_OBJECTS; i += 2) {
+        slab_free(slab, objects[i]);
+    }
+    for (i = 0; i < NUM_OBJECTS; i += 2) {
+        objects[i] = slab_alloc(slab);
+    }
+    assert(slab_chunks(slab) == chunks);
+
+    /* Empty chunks are released, except one */
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        slab_free(slab, objects[i]);
+    }
+    assert(slab_count(slab) == 0);
+    assert(slab_chunks(slab) == 1);
+
+    slab_destroy(slab);
+}
+
+/* Random allocs and frees */
+static void
+test_random(void)
+{
+    struct slab *slab = slab_create(24);
+    void **objects = calloc(NUM_OBJECTS, sizeof(*objects));
+    uint32_t count = 0;
+    int i;
+
+    for (i = 0; i < NUM_OBJECTS * 10; i++) {
+        int j = random() % NUM_OBJECTS;
+        if (objects[j]) {
+            assert(*(int *)objects[j] == j);
+            slab_free(slab, objects[j]);
+            objects[j] = NULL;
+            count--;
+        } else {
+            objects[j] = slab_alloc(slab);
+            *(int *)objects[j] = j;
+            count++;
+        }
+        assert(slab_count(slab) == count);
+    }
+
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        if (objects[i]) {
+            assert(*(int *)objects[i] == i);
+            slab_free(slab, objects[i]);
+        }
+    }
+
+    slab_destroy(slab);
+    free(objects);
+}
+
+int aim_main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_alloc_free();
+    test_random();
+
+    return 0;
+}
@@ -20,6 +20,11 @@
 /*
  * This module implements lazily aggregated stats. Multiple threads can
  * increment stats concurrently without bouncing cache lines between them.
+ *
+ * Each stats_writer stores its slots in shared memory segments, so processes
+ * forked after a slot was allocated can increment it. Segments are added as
+ * slots are allocated and are never moved. Each segment is the size of one
+ * 2MB hugepage, see stats_hugepages_set.
  */
 #ifndef STATS_H
 #define STATS_H
@@ -73,6 +78,15 @@ void stats_inc(const struct stats_writer *stats_writer,
  */
 void stats_get(const struct stats_handle *handle, struct stats *result);
 
+/*
+ * Retrieve stats for many handles
+ *
+ * Stores the result for handles[i] in results[i]. Reads each writer's slots
+ * in one pass, which is much cheaper than calling stats_get per handle.
+ */
+void stats_get_batch(const struct stats_handle *const handles[],
+                     struct stats results[], uint32_t count);
+
 /*
  * Clear stats
  */
@@ -88,4 +102,79 @@ struct stats_writer *stats_writer_create(void);
  */
 void stats_writer_destroy(struct stats_writer *stats_writer);
 
+/*
+ * A stats_snapshot holds the aggregated value of every slot at the time it
+ * was last updated. Reading from it costs no more than a single array lookup.
+ *
+ * Clearing a slot (including by stats_alloc) also clears it in every
+ * snapshot. Slots beyond those that existed at the last update are read
+ * directly.
+ */
+struct stats_snapshot;
+
+/*
+ * Create an empty stats_snapshot
+ */
+struct stats_snapshot *stats_snapshot_create(void);
+
+/*
+ * Destroy a stats_snapshot
+ */
+void stats_snapshot_destroy(struct stats_snapshot *snapshot);
+
+/*
+ * Aggregate every slot into 'snapshot'
+ *
+ * Walks each writer's segments sequentially.
+ */
+void stats_snapshot_update(struct stats_snapshot *snapshot);
+
+/*
+ * Retrieve stats from a snapshot
+ *
+ * Stores the result in 'result'.
+ */
+void stats_snapshot_get(const struct stats_snapshot *snapshot,
+                        const struct stats_handle *handle,
+                        struct stats *result);
+
+/*
+ * How segments are backed
+ *
+ * Writers touch random slots on every packet, so with 4KB pages most
+ * increments miss the TLB.
+ */
+enum stats_hugepages {
+    STATS_HUGEPAGES_NONE, /* 4KB pages */
+    STATS_HUGEPAGES_TRANSPARENT, /* madvise(MADV_HUGEPAGE), needs shmem THP enabled */
+    STATS_HUGEPAGES_EXPLICIT, /* MAP_HUGETLB, falling back to transparent */
+};
+
+/*
+ * Set how segments mapped from now on are backed
+ *
+ * Should be called before any stats are allocated. Defaults to
+ * STATS_HUGEPAGES_NONE.
+ */
+void stats_hugepages_set(enum stats_hugepages mode);
+
+/*
+ * Memory used by the stats slots
+ */
+struct stats_usage {
+    uint32_t allocated; /* slots in use */
+    uint32_t slots; /* slots backed by segments */
+    uint32_t segments; /* segments mapped by each writer */
+    uint32_t writers;
+    uint64_t mapped_bytes; /* segments mapped by all writers */
+    uint64_t hugetlb_bytes; /* part of mapped_bytes in explicit hugepages */
+    uint64_t thp_bytes; /* part of mapped_bytes advised to use transparent hugepages */
+    uint64_t free_stack_bytes; /* used to track freed slots */
+};
+
+/*
+ * Retrieve memory usage
+ */
+void stats_usage_get(struct stats_usage *usage);
+
 #endif
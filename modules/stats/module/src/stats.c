@@ -22,49 +22,171 @@
 #include <AIM/aim_list.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <stdbool.h>
 
 #define AIM_LOG_MODULE_NAME stats
 #include <AIM/aim_log.h>
 
-#define MAX_STATS 262144
+/*
+ * Slots are stored in segments of STATS_SEGMENT_SLOTS. When the first slot
+ * of a segment is allocated every writer maps it, and it stays mapped until
+ * the writer is destroyed. A process forked from the main process inherits
+ * the segments mapped so far, which covers every slot it has a handle to.
+ *
+ * A segment is exactly one 2MB hugepage, so with hugepages enabled an
+ * increment needs one TLB entry per segment instead of one per 4KB.
+ */
+#define STATS_SEGMENT_SHIFT 17
+#define STATS_SEGMENT_SLOTS (1 << STATS_SEGMENT_SHIFT)
+#define STATS_SEGMENT_SIZE (STATS_SEGMENT_SLOTS * sizeof(struct stats))
+#define STATS_MAX_SEGMENTS 1024
+
+#define MIN_FREE_STACK_SIZE 1024
+
+/* How a segment mapping is backed */
+enum segment_backing {
+    SEGMENT_PAGES,
+    SEGMENT_THP,
+    SEGMENT_HUGETLB,
+};
 
 struct stats_writer {
     list_links_t links;
-    struct stats *stats;
+    struct stats *segments[STATS_MAX_SEGMENTS];
+    uint8_t backing[STATS_MAX_SEGMENTS]; /* enum segment_backing */
+};
+
+struct stats_snapshot {
+    list_links_t links;
+    struct stats *slots;
+    uint32_t num_slots; /* slots covered by the last update */
+    uint32_t size; /* allocated length of 'slots' */
 };
 
 AIM_LOG_STRUCT_DEFINE(AIM_LOG_OPTIONS_DEFAULT,
                       AIM_LOG_BITS_DEFAULT,
                       NULL, 0);
 /*
- * Free slots are tracked in this stack
+ * Freed slots are tracked in this stack. Slots that have never been
+ * allocated are handed out in order after it is empty.
  */
 static uint32_t *free_stack;
+static uint32_t free_stack_size;
 static uint32_t num_free;
 
+static uint32_t num_slots; /* slots ever allocated */
+static uint32_t num_segments; /* segments mapped by each writer */
+static uint32_t num_allocated; /* slots in use */
+static uint32_t num_writers;
+
+static enum stats_hugepages hugepages_mode = STATS_HUGEPAGES_NONE;
+static uint32_t num_backing[3]; /* segment mappings by enum segment_backing */
+static bool hugetlb_failed; /* logged the fallback to transparent hugepages */
+
 /* List of all stats_writers */
 static list_head_t stats_writers;
 
+/* List of all stats_snapshots */
+static list_head_t stats_snapshots;
+
 void
 __stats_module_init__(void)
 {
     AIM_LOG_STRUCT_REGISTER();
 
-    free_stack = aim_zmalloc(sizeof(*free_stack) * MAX_STATS);
+    list_init(&stats_writers);
+    list_init(&stats_snapshots);
+}
+
+static inline struct stats *
+writer_slot(const struct stats_writer *stats_writer, uint32_t slot)
+{
+    return &stats_writer->segments[slot >> STATS_SEGMENT_SHIFT][slot & (STATS_SEGMENT_SLOTS - 1)];
+}
 
-    /* Init the free stack in descending order */
-    for (num_free = 0; num_free < MAX_STATS; num_free++) {
-        free_stack[num_free] = MAX_STATS-num_free-1;
+/*
+ * Map segment 'idx' of a writer
+ *
+ * Explicit hugepages fail if none are reserved, in which case we fall back
+ * to transparent hugepages. madvise fails if the kernel doesn't support them,
+ * which leaves the segment on 4KB pages.
+ */
+static void
+segment_map(struct stats_writer *stats_writer, uint32_t idx)
+{
+    struct stats *segment = MAP_FAILED;
+    enum segment_backing backing = SEGMENT_PAGES;
+
+    if (hugepages_mode == STATS_HUGEPAGES_EXPLICIT) {
+        segment = mmap(NULL, STATS_SEGMENT_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (segment != MAP_FAILED) {
+            backing = SEGMENT_HUGETLB;
+        } else if (!hugetlb_failed) {
+            AIM_LOG_WARN("Failed to allocate stats segment from hugepages, using transparent hugepages: %s",
+                         strerror(errno));
+            hugetlb_failed = true;
+        }
     }
 
-    list_init(&stats_writers);
+    if (segment == MAP_FAILED) {
+        segment = mmap(NULL, STATS_SEGMENT_SIZE,
+                       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (segment == MAP_FAILED) {
+            AIM_DIE("Failed to allocate stats segment: %s", strerror(errno));
+        }
+
+        if (hugepages_mode != STATS_HUGEPAGES_NONE) {
+            if (madvise(segment, STATS_SEGMENT_SIZE, MADV_HUGEPAGE) == 0) {
+                backing = SEGMENT_THP;
+            } else {
+                AIM_LOG_VERBOSE("Transparent hugepages unavailable for stats segment: %s",
+                                strerror(errno));
+            }
+        }
+    }
+
+    stats_writer->segments[idx] = segment;
+    stats_writer->backing[idx] = backing;
+    num_backing[backing]++;
+}
+
+static void
+segment_unmap(struct stats_writer *stats_writer, uint32_t idx)
+{
+    munmap(stats_writer->segments[idx], STATS_SEGMENT_SIZE);
+    num_backing[stats_writer->backing[idx]]--;
+}
+
+/* Map another segment in every writer */
+static void
+segment_add(void)
+{
+    AIM_TRUE_OR_DIE(num_segments < STATS_MAX_SEGMENTS);
+
+    list_links_t *cur;
+    LIST_FOREACH(&stats_writers, cur) {
+        struct stats_writer *stats_writer = container_of(cur, links, struct stats_writer);
+        segment_map(stats_writer, num_segments);
+    }
+
+    num_segments++;
+    AIM_LOG_VERBOSE("added stats segment %u", num_segments);
 }
 
 void
 stats_alloc(struct stats_handle *handle)
 {
-    AIM_TRUE_OR_DIE(num_free > 0);
-    handle->slot = free_stack[--num_free];
+    if (num_free > 0) {
+        handle->slot = free_stack[--num_free];
+    } else {
+        if (num_slots == num_segments * STATS_SEGMENT_SLOTS) {
+            segment_add();
+        }
+        handle->slot = num_slots++;
+    }
+
+    num_allocated++;
     stats_clear(handle);
     AIM_LOG_TRACE("allocated stats slot %u", handle->slot);
 }
@@ -72,8 +194,15 @@ stats_alloc(struct stats_handle *handle)
 void
 stats_free(struct stats_handle *handle)
 {
-    AIM_TRUE_OR_DIE(num_free < MAX_STATS);
+    AIM_TRUE_OR_DIE(handle->slot < num_slots && num_allocated > 0);
+
+    if (num_free == free_stack_size) {
+        free_stack_size = free_stack_size ? free_stack_size * 2 : MIN_FREE_STACK_SIZE;
+        free_stack = aim_realloc(free_stack, free_stack_size * sizeof(*free_stack));
+    }
+
     free_stack[num_free++] = handle->slot;
+    num_allocated--;
     AIM_LOG_TRACE("freed stats slot %u", handle->slot);
 }
 
@@ -82,7 +211,7 @@ stats_inc(const struct stats_writer *stats_writer,
           const struct stats_handle *handle,
           uint64_t packets, uint64_t bytes)
 {
-    struct stats *stats = &stats_writer->stats[handle->slot];
+    struct stats *stats = writer_slot(stats_writer, handle->slot);
     stats->packets += packets;
     stats->bytes += bytes;
     AIM_LOG_TRACE("increment stats slot %u by %u/%u", handle->slot, (uint32_t)packets, (uint32_t)bytes);
@@ -97,34 +226,123 @@ stats_get(const struct stats_handle *handle, struct stats *result)
     list_links_t *cur;
     LIST_FOREACH(&stats_writers, cur) {
         struct stats_writer *stats_writer = container_of(cur, links, struct stats_writer);
-        struct stats *stats = &stats_writer->stats[handle->slot];
+        struct stats *stats = writer_slot(stats_writer, handle->slot);
         result->bytes += stats->bytes;
         result->packets += stats->packets;
     }
 }
 
+void
+stats_get_batch(const struct stats_handle *const handles[],
+                struct stats results[], uint32_t count)
+{
+    memset(results, 0, count * sizeof(*results));
+
+    list_links_t *cur;
+    LIST_FOREACH(&stats_writers, cur) {
+        struct stats_writer *stats_writer = container_of(cur, links, struct stats_writer);
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            struct stats *stats = writer_slot(stats_writer, handles[i]->slot);
+            results[i].bytes += stats->bytes;
+            results[i].packets += stats->packets;
+        }
+    }
+}
+
 void
 stats_clear(struct stats_handle *handle)
 {
     list_links_t *cur;
     LIST_FOREACH(&stats_writers, cur) {
         struct stats_writer *stats_writer = container_of(cur, links, struct stats_writer);
-        struct stats *stats = &stats_writer->stats[handle->slot];
+        struct stats *stats = writer_slot(stats_writer, handle->slot);
         stats->bytes = 0;
         stats->packets = 0;
     }
+
+    LIST_FOREACH(&stats_snapshots, cur) {
+        struct stats_snapshot *snapshot = container_of(cur, links, struct stats_snapshot);
+        if (handle->slot < snapshot->num_slots) {
+            snapshot->slots[handle->slot].bytes = 0;
+            snapshot->slots[handle->slot].packets = 0;
+        }
+    }
+}
+
+struct stats_snapshot *
+stats_snapshot_create(void)
+{
+    struct stats_snapshot *snapshot = aim_zmalloc(sizeof(*snapshot));
+    list_push(&stats_snapshots, &snapshot->links);
+    return snapshot;
+}
+
+void
+stats_snapshot_destroy(struct stats_snapshot *snapshot)
+{
+    list_remove(&snapshot->links);
+    aim_free(snapshot->slots);
+    aim_free(snapshot);
+}
+
+void
+stats_snapshot_update(struct stats_snapshot *snapshot)
+{
+    if (snapshot->size < num_slots) {
+        snapshot->size = num_segments * STATS_SEGMENT_SLOTS;
+        aim_free(snapshot->slots);
+        snapshot->slots = aim_malloc(snapshot->size * sizeof(*snapshot->slots));
+    }
+
+    snapshot->num_slots = num_slots;
+    memset(snapshot->slots, 0, num_slots * sizeof(*snapshot->slots));
+
+    list_links_t *cur;
+    LIST_FOREACH(&stats_writers, cur) {
+        struct stats_writer *stats_writer = container_of(cur, links, struct stats_writer);
+        uint32_t base;
+        for (base = 0; base < num_slots; base += STATS_SEGMENT_SLOTS) {
+            const struct stats *segment = stats_writer->segments[base >> STATS_SEGMENT_SHIFT];
+            struct stats *dst = &snapshot->slots[base];
+            uint32_t n = num_slots - base;
+            if (n > STATS_SEGMENT_SLOTS) {
+                n = STATS_SEGMENT_SLOTS;
+            }
+
+            uint32_t i;
+            for (i = 0; i < n; i++) {
+                dst[i].bytes += segment[i].bytes;
+                dst[i].packets += segment[i].packets;
+            }
+        }
+    }
+}
+
+void
+stats_snapshot_get(const struct stats_snapshot *snapshot,
+                   const struct stats_handle *handle,
+                   struct stats *result)
+{
+    if (handle->slot < snapshot->num_slots) {
+        *result = snapshot->slots[handle->slot];
+    } else {
+        stats_get(handle, result);
+    }
 }
 
 struct stats_writer *
 stats_writer_create(void)
 {
     struct stats_writer *stats_writer = aim_zmalloc(sizeof(*stats_writer));
-    stats_writer->stats = mmap(NULL, MAX_STATS*sizeof(struct stats),
-                               PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0);
-    if (stats_writer->stats == MAP_FAILED) {
-        AIM_DIE("Failed to allocate stats writer: %s", strerror(errno));
+
+    uint32_t i;
+    for (i = 0; i < num_segments; i++) {
+        segment_map(stats_writer, i);
     }
+
     list_push(&stats_writers, &stats_writer->links);
+    num_writers++;
     return stats_writer;
 }
 
@@ -132,6 +350,31 @@ void
 stats_writer_destroy(struct stats_writer *stats_writer)
 {
     list_remove(&stats_writer->links);
-    munmap(stats_writer->stats, MAX_STATS*sizeof(struct stats));
+    num_writers--;
+
+    uint32_t i;
+    for (i = 0; i < num_segments; i++) {
+        segment_unmap(stats_writer, i);
+    }
+
     aim_free(stats_writer);
 }
+
+void
+stats_hugepages_set(enum stats_hugepages mode)
+{
+    hugepages_mode = mode;
+}
+
+void
+stats_usage_get(struct stats_usage *usage)
+{
+    usage->allocated = num_allocated;
+    usage->slots = num_segments * STATS_SEGMENT_SLOTS;
+    usage->segments = num_segments;
+    usage->writers = num_writers;
+    usage->mapped_bytes = (uint64_t)num_segments * num_writers * STATS_SEGMENT_SIZE;
+    usage->hugetlb_bytes = (uint64_t)num_backing[SEGMENT_HUGETLB] * STATS_SEGMENT_SIZE;
+    usage->thp_bytes = (uint64_t)num_backing[SEGMENT_THP] * STATS_SEGMENT_SIZE;
+    usage->free_stack_bytes = free_stack_size * sizeof(*free_stack);
+}
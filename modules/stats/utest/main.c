@@ -0,0 +1,222 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <AIM/aim.h>
+#include <stats/stats.h>
+#include <assert.h>
+
+/* Matches stats.c */
+#define STATS_SEGMENT_SLOTS (1 << 17)
+
+/* More than a few segments worth */
+#define NUM_HANDLES (4 * STATS_SEGMENT_SLOTS)
+
+static void
+test_grow(void)
+{
+    struct stats_handle *handles = calloc(NUM_HANDLES, sizeof(*handles));
+    struct stats_writer *writer1 = stats_writer_create();
+    struct stats_usage usage;
+    struct stats stats;
+    int i;
+
+    for (i = 0; i < NUM_HANDLES; i++) {
+        stats_alloc(&handles[i]);
+        stats_inc(writer1, &handles[i], i, i * 100);
+    }
+
+    stats_usage_get(&usage);
+    assert(usage.allocated == NUM_HANDLES);
+    assert(usage.slots >= NUM_HANDLES);
+    assert(usage.segments >= 4);
+    assert(usage.writers == 1);
+    uint32_t segments = usage.segments;
+
+    /* A writer created later maps the existing segments */
+    struct stats_writer *writer2 = stats_writer_create();
+    for (i = 0; i < NUM_HANDLES; i++) {
+        stats_inc(writer2, &handles[i], 1, 1);
+    }
+
+    for (i = 0; i < NUM_HANDLES; i++) {
+        stats_get(&handles[i], &stats);
+        assert(stats.packets == i + 1);
+        assert(stats.bytes == i * 100 + 1);
+    }
+
+    stats_usage_get(&usage);
+    assert(usage.writers == 2);
+    assert(usage.mapped_bytes == (uint64_t)usage.slots * sizeof(struct stats) * 2);
+
+    /* Freed slots are reused before the arena grows and come back cleared */
+    for (i = 0; i < NUM_HANDLES; i++) {
+        stats_free(&handles[i]);
+    }
+
+    stats_usage_get(&usage);
+    assert(usage.allocated == 0);
+
+    for (i = 0; i < NUM_HANDLES; i++) {
+        stats_alloc(&handles[i]);
+        stats_get(&handles[i], &stats);
+        assert(stats.packets == 0 && stats.bytes == 0);
+    }
+
+    stats_usage_get(&usage);
+    assert(usage.allocated == NUM_HANDLES);
+    assert(usage.segments == segments);
+
+    for (i = 0; i < NUM_HANDLES; i++) {
+        stats_free(&handles[i]);
+    }
+
+    stats_writer_destroy(writer1);
+    stats_writer_destroy(writer2);
+    free(handles);
+}
+
+static void
+test_clear(void)
+{
+    struct stats_writer *writer = stats_writer_create();
+    struct stats_handle handle;
+    struct stats stats;
+
+    stats_alloc(&handle);
+    stats_inc(writer, &handle, 10, 1000);
+    stats_get(&handle, &stats);
+    assert(stats.packets == 10 && stats.bytes == 1000);
+
+    stats_clear(&handle);
+    stats_get(&handle, &stats);
+    assert(stats.packets == 0 && stats.bytes == 0);
+
+    stats_free(&handle);
+    stats_writer_destroy(writer);
+}
+
+static void
+test_batch(void)
+{
+    struct stats_writer *writer1 = stats_writer_create();
+    struct stats_writer *writer2 = stats_writer_create();
+    struct stats_handle handles[100];
+    const struct stats_handle *handle_ptrs[100];
+    struct stats results[100];
+    struct stats stats;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        stats_alloc(&handles[i]);
+        stats_inc(writer1, &handles[i], i, i * 100);
+        stats_inc(writer2, &handles[i], 1, 1);
+        handle_ptrs[99 - i] = &handles[i];
+    }
+
+    stats_get_batch(handle_ptrs, results, 100);
+    for (i = 0; i < 100; i++) {
+        stats_get(handle_ptrs[i], &stats);
+        assert(results[i].packets == stats.packets);
+        assert(results[i].bytes == stats.bytes);
+        assert(results[i].packets == 99 - i + 1);
+    }
+
+    /* Snapshots don't see later increments but do see clears */
+    struct stats_snapshot *snapshot = stats_snapshot_create();
+    stats_snapshot_update(snapshot);
+
+    stats_inc(writer1, &handles[0], 1000, 1000);
+    stats_snapshot_get(snapshot, &handles[0], &stats);
+    assert(stats.packets == 1 && stats.bytes == 1);
+
+    stats_clear(&handles[1]);
+    stats_snapshot_get(snapshot, &handles[1], &stats);
+    assert(stats.packets == 0 && stats.bytes == 0);
+
+    for (i = 2; i < 100; i++) {
+        stats_snapshot_get(snapshot, &handles[i], &stats);
+        assert(stats.packets == i + 1);
+        assert(stats.bytes == i * 100 + 1);
+    }
+
+    stats_snapshot_update(snapshot);
+    stats_snapshot_get(snapshot, &handles[0], &stats);
+    assert(stats.packets == 1001 && stats.bytes == 1001);
+
+    /* Slots allocated after the update start at zero */
+    struct stats_handle handle;
+    stats_alloc(&handle);
+    stats_snapshot_get(snapshot, &handle, &stats);
+    assert(stats.packets == 0 && stats.bytes == 0);
+
+    stats_snapshot_destroy(snapshot);
+    stats_free(&handle);
+    for (i = 0; i < 100; i++) {
+        stats_free(&handles[i]);
+    }
+    stats_writer_destroy(writer1);
+    stats_writer_destroy(writer2);
+}
+
+/* Works whether or not hugepages are available */
+static void
+test_hugepages(void)
+{
+    enum stats_hugepages modes[] = {
+        STATS_HUGEPAGES_EXPLICIT, STATS_HUGEPAGES_TRANSPARENT, STATS_HUGEPAGES_NONE,
+    };
+    struct stats_usage usage;
+    struct stats stats;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        stats_hugepages_set(modes[i]);
+        struct stats_writer *writer = stats_writer_create();
+        struct stats_handle handle;
+        stats_alloc(&handle);
+        stats_inc(writer, &handle, 3, 300);
+        stats_get(&handle, &stats);
+        assert(stats.packets == 3 && stats.bytes == 300);
+
+        stats_usage_get(&usage);
+        assert(usage.hugetlb_bytes + usage.thp_bytes <= usage.mapped_bytes);
+        if (modes[i] == STATS_HUGEPAGES_NONE) {
+            assert(usage.hugetlb_bytes == 0 && usage.thp_bytes == 0);
+        }
+
+        stats_free(&handle);
+        stats_writer_destroy(writer);
+    }
+}
+
+int aim_main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_grow();
+    test_clear();
+    test_batch();
+    test_hugepages();
+
+    return 0;
+}
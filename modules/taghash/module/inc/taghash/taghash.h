@@ -0,0 +1,138 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * taghash - Growable hash table of (hash, pointer) pairs
+ *
+ * The table stores the 32-bit hash of each entry in a dense array parallel
+ * to the values, so a lookup scans a few adjacent tags and only dereferences
+ * the values whose tag matches. The caller compares the actual keys.
+ * Collisions are resolved with linear probing and removals shift later
+ * entries back, so there are no tombstones.
+ *
+ * The table doubles when it becomes 3/4 full and halves when it falls below
+ * 1/8 full, down to the size given to taghash_init. Resizing only reads the
+ * stored tags, not the entries.
+ */
+
+#ifndef TAGHASH_H
+#define TAGHASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct taghash {
+    uint32_t *tags; /* zero for an empty slot */
+    void **values;
+    uint32_t mask; /* number of slots - 1 */
+    uint32_t shift; /* 32 - log2(number of slots) */
+    uint32_t count;
+    uint32_t min_slots;
+};
+
+/* Position of a lookup, see taghash_first */
+struct taghash_cursor {
+    uint32_t tag;
+    uint32_t index;
+};
+
+/*
+ * Initialize an empty table
+ *
+ * 'min_slots' is rounded up to a power of 2.
+ */
+void taghash_init(struct taghash *t, uint32_t min_slots);
+
+/*
+ * Free the table's memory. The values are untouched.
+ */
+void taghash_cleanup(struct taghash *t);
+
+/*
+ * Add 'value' with the given hash. Duplicates are allowed.
+ */
+void taghash_insert(struct taghash *t, uint32_t hash, void *value);
+
+/*
+ * Remove 'value', which was inserted with the given hash
+ *
+ * Returns false if it was not found.
+ */
+bool taghash_remove(struct taghash *t, uint32_t hash, void *value);
+
+static inline uint32_t
+taghash_tag(uint32_t hash)
+{
+    return hash ? hash : 1;
+}
+
+/*
+ * Return the first slot to probe for a tag
+ *
+ * Uses the high bits of a multiplicative hash, so that callers with weak
+ * hashes don't form long probe sequences.
+ */
+static inline uint32_t
+taghash_home(const struct taghash *t, uint32_t tag)
+{
+    return (uint32_t)(tag * 2654435769u) >> t->shift;
+}
+
+/*
+ * Return the next value from the cursor's position whose hash matches
+ */
+static inline void *
+taghash_next(const struct taghash *t, struct taghash_cursor *cursor)
+{
+    uint32_t i = cursor->index;
+    uint32_t tag;
+    while ((tag = t->tags[i]) != 0) {
+        uint32_t cur = i;
+        i = (i + 1) & t->mask;
+        if (tag == cursor->tag) {
+            cursor->index = i;
+            return t->values[cur];
+        }
+    }
+    cursor->index = i;
+    return NULL;
+}
+
+/*
+ * Return the first value with the given hash, or NULL
+ *
+ * Further values with the same hash are returned by taghash_next. The
+ * table must not be modified in between.
+ */
+static inline void *
+taghash_first(const struct taghash *t, uint32_t hash, struct taghash_cursor *cursor)
+{
+    cursor->tag = taghash_tag(hash);
+    cursor->index = taghash_home(t, cursor->tag);
+    return taghash_next(t, cursor);
+}
+
+static inline uint32_t
+taghash_count(const struct taghash *t)
+{
+    return t->count;
+}
+
+#endif
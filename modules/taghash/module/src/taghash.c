@@ -0,0 +1,146 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <taghash/taghash.h>
+#include <AIM/aim.h>
+
+static uint32_t
+round_up_pow2(uint32_t x)
+{
+    uint32_t n = 1;
+    while (n < x) {
+        n <<= 1;
+    }
+    return n;
+}
+
+static void
+alloc_slots(struct taghash *t, uint32_t num_slots)
+{
+    t->tags = aim_zmalloc(num_slots * sizeof(*t->tags));
+    t->values = aim_malloc(num_slots * sizeof(*t->values));
+    t->mask = num_slots - 1;
+    t->shift = 32 - __builtin_ctz(num_slots);
+}
+
+/* Place an entry in the first empty slot from its home slot */
+static void
+place(struct taghash *t, uint32_t tag, void *value)
+{
+    uint32_t i = taghash_home(t, tag);
+    while (t->tags[i] != 0) {
+        i = (i + 1) & t->mask;
+    }
+    t->tags[i] = tag;
+    t->values[i] = value;
+}
+
+static void
+resize(struct taghash *t, uint32_t num_slots)
+{
+    uint32_t *old_tags = t->tags;
+    void **old_values = t->values;
+    uint32_t old_num_slots = t->mask + 1;
+
+    alloc_slots(t, num_slots);
+
+    uint32_t i;
+    for (i = 0; i < old_num_slots; i++) {
+        if (old_tags[i] != 0) {
+            place(t, old_tags[i], old_values[i]);
+        }
+    }
+
+    aim_free(old_tags);
+    aim_free(old_values);
+}
+
+void
+taghash_init(struct taghash *t, uint32_t min_slots)
+{
+    t->min_slots = round_up_pow2(min_slots < 8 ? 8 : min_slots);
+    t->count = 0;
+    alloc_slots(t, t->min_slots);
+}
+
+void
+taghash_cleanup(struct taghash *t)
+{
+    aim_free(t->tags);
+    aim_free(t->values);
+    t->tags = NULL;
+    t->values = NULL;
+    t->count = 0;
+}
+
+void
+taghash_insert(struct taghash *t, uint32_t hash, void *value)
+{
+    uint32_t num_slots = t->mask + 1;
+    if ((uint64_t)(t->count + 1) * 4 > (uint64_t)num_slots * 3) {
+        resize(t, num_slots * 2);
+    }
+
+    place(t, taghash_tag(hash), value);
+    t->count++;
+}
+
+bool
+taghash_remove(struct taghash *t, uint32_t hash, void *value)
+{
+    uint32_t tag = taghash_tag(hash);
+    uint32_t i = taghash_home(t, tag);
+
+    while (t->tags[i] != tag || t->values[i] != value) {
+        if (t->tags[i] == 0) {
+            return false;
+        }
+        i = (i + 1) & t->mask;
+    }
+
+    /*
+     * Shift back any following entries that would no longer be reachable
+     * from their home slot across the hole at 'i'
+     */
+    uint32_t j = i;
+    while (true) {
+        j = (j + 1) & t->mask;
+        if (t->tags[j] == 0) {
+            break;
+        }
+
+        uint32_t home = taghash_home(t, t->tags[j]);
+        /* Distance from home to j must not be shorter than from home to i */
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->tags[i] = t->tags[j];
+            t->values[i] = t->values[j];
+            i = j;
+        }
+    }
+
+    t->tags[i] = 0;
+    t->count--;
+
+    uint32_t num_slots = t->mask + 1;
+    if (num_slots > t->min_slots && t->count < num_slots / 8) {
+        resize(t, num_slots / 2);
+    }
+
+    return true;
+}
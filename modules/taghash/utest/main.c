@@ -0,0 +1,164 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <AIM/aim.h>
+#include <taghash/taghash.h>
+#include <assert.h>
+
+#define NUM_ENTRIES 100000
+
+struct entry {
+    uint32_t hash;
+    bool present;
+};
+
+static struct entry *
+lookup(struct taghash *t, uint32_t hash, struct entry *want)
+{
+    struct taghash_cursor cursor;
+    struct entry *e;
+    for (e = taghash_first(t, hash, &cursor); e; e = taghash_next(t, &cursor)) {
+        /* Hashes 0 and 1 share a tag */
+        assert(e->hash == hash || (e->hash | hash) == 1);
+        if (e == want) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+test_basic(void)
+{
+    struct taghash t;
+    struct entry a = { 1, true }, b = { 2, true }, c = { 0, true };
+
+    taghash_init(&t, 8);
+    assert(taghash_count(&t) == 0);
+    assert(lookup(&t, 1, &a) == NULL);
+
+    taghash_insert(&t, a.hash, &a);
+    taghash_insert(&t, b.hash, &b);
+    taghash_insert(&t, c.hash, &c);
+    assert(taghash_count(&t) == 3);
+
+    assert(lookup(&t, 1, &a) == &a);
+    assert(lookup(&t, 2, &b) == &b);
+    assert(lookup(&t, 0, &c) == &c);
+    assert(lookup(&t, 1, &b) == NULL);
+
+    assert(taghash_remove(&t, 2, &b));
+    assert(!taghash_remove(&t, 2, &b));
+    assert(!taghash_remove(&t, 1, &b));
+    assert(lookup(&t, 2, &b) == NULL);
+    assert(lookup(&t, 1, &a) == &a);
+    assert(taghash_count(&t) == 2);
+
+    taghash_cleanup(&t);
+}
+
+/* Many entries with the same hash form a single probe sequence */
+static void
+test_collisions(void)
+{
+    struct taghash t;
+    struct entry entries[100];
+    int i;
+
+    taghash_init(&t, 8);
+
+    for (i = 0; i < 100; i++) {
+        entries[i].hash = i % 2 ? 0x1234 : 0x5678;
+        taghash_insert(&t, entries[i].hash, &entries[i]);
+    }
+
+    for (i = 0; i < 100; i += 3) {
+        assert(taghash_remove(&t, entries[i].hash, &entries[i]));
+    }
+
+    for (i = 0; i < 100; i++) {
+        struct entry *e = lookup(&t, entries[i].hash, &entries[i]);
+        assert((e != NULL) == (i % 3 != 0));
+    }
+
+    taghash_cleanup(&t);
+}
+
+/* Random inserts and removes, checked against a shadow array */
+static void
+test_random(void)
+{
+    struct taghash t;
+    struct entry *entries = calloc(NUM_ENTRIES, sizeof(*entries));
+    int i;
+
+    taghash_init(&t, 8);
+
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        /* Few distinct hashes to exercise collisions and wraparound */
+        entries[i].hash = random() % (NUM_ENTRIES / 4);
+    }
+
+    for (i = 0; i < NUM_ENTRIES * 4; i++) {
+        struct entry *e = &entries[random() % NUM_ENTRIES];
+        if (e->present) {
+            assert(taghash_remove(&t, e->hash, e));
+            e->present = false;
+        } else {
+            taghash_insert(&t, e->hash, e);
+            e->present = true;
+        }
+    }
+
+    uint32_t count = 0;
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        struct entry *e = &entries[i];
+        assert((lookup(&t, e->hash, e) != NULL) == e->present);
+        count += e->present;
+    }
+    assert(taghash_count(&t) == count);
+
+    /* Removing everything shrinks the table back down */
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        struct entry *e = &entries[i];
+        if (e->present) {
+            assert(taghash_remove(&t, e->hash, e));
+        }
+    }
+    assert(taghash_count(&t) == 0);
+    assert(t.mask + 1 == t.min_slots);
+
+    taghash_cleanup(&t);
+    free(entries);
+}
+
+int aim_main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_basic();
+    test_collisions();
+    test_random();
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * This module streams the changes in stats counters to local monitoring
+ * agents over a Unix socket, without going through OpenFlow. See
+ * telemetry_format.h for the wire format.
+ *
+ * Owners of stats handles register a telemetry_object for each counter they
+ * want exported. Nothing is read until a client connects.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <AIM/aim_list.h>
+#include <stats/stats.h>
+#include <telemetry/telemetry_format.h>
+
+/*
+ * Embedded in the object owning the stats handle
+ *
+ * Treat as private.
+ */
+struct telemetry_object {
+    struct list_links links;
+    const struct stats_handle *handle;
+    uint64_t id;
+    uint64_t cookie;
+    uint16_t subid;
+    uint8_t type;
+    struct stats last; /* value at the last interval */
+};
+
+/*
+ * Start listening for clients on /var/run/ivs-telemetry.<name>.sock
+ */
+void telemetry_init(const char *name);
+
+/*
+ * Start listening for clients on the given socket path
+ */
+void telemetry_init_path(const char *path);
+
+/*
+ * Export the counter in 'handle'
+ *
+ * See telemetry_record for the meaning of the other arguments.
+ */
+void telemetry_register(struct telemetry_object *object,
+                        const struct stats_handle *handle,
+                        enum telemetry_type type, uint16_t subid,
+                        uint64_t id, uint64_t cookie);
+
+/*
+ * Stop exporting a counter
+ *
+ * Must be called before the stats handle is freed. The final change is sent
+ * in the next interval.
+ */
+void telemetry_unregister(struct telemetry_object *object);
+
+#endif
@@ -0,0 +1,97 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * Wire format of the telemetry socket
+ *
+ * Each interval IVS sends one or more SOCK_SEQPACKET messages on
+ * /var/run/ivs-telemetry.<datapath>.sock. Every message starts with a
+ * telemetry_header followed by 'count' telemetry_records. The last message
+ * of an interval has TELEMETRY_HEADER_LAST set, so an interval with no
+ * changes is a single empty message.
+ *
+ * Records hold the change in a counter since the previous interval, and only
+ * counters that changed are sent. A client sees the changes made after it
+ * connected. All fields are in host byte order.
+ *
+ * This header is used by ivs-ctl and must not include anything but libc.
+ */
+
+#ifndef TELEMETRY_FORMAT_H
+#define TELEMETRY_FORMAT_H
+
+#include <stdint.h>
+
+#define TELEMETRY_MAGIC 0x49565354 /* "IVST" */
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_MAX_MESSAGE_SIZE 65536
+
+/* telemetry_header.flags */
+#define TELEMETRY_HEADER_LAST 1 /* last message of this interval */
+
+struct telemetry_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size; /* sizeof(struct telemetry_record) */
+    uint64_t seq; /* interval number */
+    uint64_t time_ns; /* CLOCK_REALTIME when the counters were read */
+    uint32_t interval_ms;
+    uint16_t flags;
+    uint16_t part; /* index of this message within the interval */
+    uint32_t count; /* records following the header */
+    uint32_t pad;
+};
+
+/* telemetry_record.type */
+enum telemetry_type {
+    TELEMETRY_TYPE_FLOW = 1, /* id: flow id, subid: table id */
+    TELEMETRY_TYPE_PORT = 2, /* id: port number, subid: enum telemetry_port_counter */
+    TELEMETRY_TYPE_VLAN = 3, /* id: VLAN id, subid: enum telemetry_vlan_counter */
+};
+
+enum telemetry_port_counter {
+    TELEMETRY_PORT_RX_UNICAST,
+    TELEMETRY_PORT_TX_UNICAST,
+    TELEMETRY_PORT_RX_BROADCAST,
+    TELEMETRY_PORT_TX_BROADCAST,
+    TELEMETRY_PORT_RX_MULTICAST,
+    TELEMETRY_PORT_TX_MULTICAST,
+    TELEMETRY_PORT_RX_BAD_VLAN,
+};
+
+enum telemetry_vlan_counter {
+    TELEMETRY_VLAN_RX,
+    TELEMETRY_VLAN_TX,
+};
+
+/* telemetry_record.flags */
+#define TELEMETRY_RECORD_REMOVED 1 /* object deleted, this is its final change */
+
+struct telemetry_record {
+    uint8_t type; /* enum telemetry_type */
+    uint8_t flags;
+    uint16_t subid;
+    uint32_t pad;
+    uint64_t id;
+    uint64_t cookie; /* OpenFlow cookie for flows, otherwise 0 */
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+#endif
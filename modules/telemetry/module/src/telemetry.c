@@ -0,0 +1,503 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * Streaming stats export
+ *
+ * Clients connect to a SOCK_SEQPACKET Unix socket. While any client is
+ * connected a timer reads every registered counter each interval
+ * (IVS_TELEMETRY_INTERVAL_MS, default 1000) with one batched read and sends
+ * the counters that changed to all clients.
+ *
+ * The messages of an interval are kept in interval_buf. Each client sends
+ * as many of them as its socket buffer takes and the rest when the socket
+ * becomes writable, so sends never block the main thread and a slow client
+ * doesn't lose records. A client still sending the previous interval when the
+ * next one starts would miss changes, so it is disconnected instead and can
+ * reconnect.
+ */
+
+#include <telemetry/telemetry.h>
+#include <AIM/aim.h>
+#include <AIM/aim_list.h>
+#include <linux/un.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <SocketManager/socketmanager.h>
+#include <debug_counter/debug_counter.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ivs/ivs.h>
+
+#define AIM_LOG_MODULE_NAME telemetry
+#include <AIM/aim_log.h>
+
+AIM_LOG_STRUCT_DEFINE(AIM_LOG_OPTIONS_DEFAULT, AIM_LOG_BITS_DEFAULT, NULL, 0);
+
+#define LISTEN_BACKLOG 5
+#define DEFAULT_INTERVAL_MS 1000
+#define CLIENT_SNDBUF (4*1024*1024)
+#define MAX_RECORDS_PER_MESSAGE \
+    ((TELEMETRY_MAX_MESSAGE_SIZE - sizeof(struct telemetry_header)) / sizeof(struct telemetry_record))
+
+struct client {
+    struct list_links links;
+    int fd;
+    uint32_t offset; /* next message to send in interval_buf */
+    bool write_pending; /* waiting for the socket to become writable */
+};
+
+static void listen_callback(int socket_id, void *cookie, int read_ready, int write_ready, int error_seen);
+static void client_callback(int socket_id, void *cookie, int read_ready, int write_ready, int error_seen);
+static void destroy_client(struct client *client);
+static void publish(void *cookie);
+
+static LIST_DEFINE(clients);
+static LIST_DEFINE(objects);
+static uint32_t num_objects;
+static int listen_socket = -1;
+static uint32_t interval_ms = DEFAULT_INTERVAL_MS;
+static uint64_t seq;
+
+/* Final changes of unregistered objects, sent in the next interval */
+static struct xbuf removed_records;
+
+/* Messages of the latest interval, back to back */
+static struct xbuf interval_buf;
+
+/* Scratch space for the batched read */
+static const struct stats_handle **read_handles;
+static struct stats *read_results;
+static uint32_t read_size;
+
+/* Message being built */
+static struct {
+    struct telemetry_header header;
+    struct telemetry_record records[MAX_RECORDS_PER_MESSAGE];
+} message;
+
+DEBUG_COUNTER(publish_count, "telemetry.publish",
+              "Telemetry intervals sent to clients");
+DEBUG_COUNTER(record_count, "telemetry.record",
+              "Telemetry records sent to clients");
+DEBUG_COUNTER(client_overrun, "telemetry.client_overrun",
+              "Telemetry client disconnected because it fell behind");
+DEBUG_COUNTER(client_send_deferred, "telemetry.client_send_deferred",
+              "Telemetry sends deferred until the client socket was writable");
+
+void
+__telemetry_module_init__(void)
+{
+    AIM_LOG_STRUCT_REGISTER();
+}
+
+void
+telemetry_init(const char *name)
+{
+    char path[UNIX_PATH_MAX];
+    snprintf(path, sizeof(path), "/var/run/ivs-telemetry.%s.sock", name);
+    telemetry_init_path(path);
+}
+
+void
+telemetry_init_path(const char *path)
+{
+    char *s = getenv("IVS_TELEMETRY_INTERVAL_MS");
+    if (s != NULL) {
+        interval_ms = atoi(s);
+        if (interval_ms == 0) {
+            AIM_DIE("Invalid telemetry interval");
+        }
+    }
+
+    xbuf_init(&removed_records);
+    xbuf_init(&interval_buf);
+
+    if (strlen(path) >= UNIX_PATH_MAX) {
+        AIM_DIE("Telemetry socket path too long: %s", path);
+    }
+
+    unlink(path);
+
+    listen_socket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (listen_socket < 0) {
+        perror("socket (telemetry)");
+        abort();
+    }
+
+    struct sockaddr_un saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strcpy(saddr.sun_path, path);
+
+    if (bind(listen_socket, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        perror("bind (telemetry)");
+        abort();
+    }
+
+    if (listen(listen_socket, LISTEN_BACKLOG) < 0) {
+        perror("listen (telemetry)");
+        abort();
+    }
+
+    indigo_error_t rv = ind_soc_socket_register(listen_socket, listen_callback, NULL);
+    if (rv < 0) {
+        AIM_DIE("Failed to register telemetry socket: %s", indigo_strerror(rv));
+    }
+}
+
+void
+telemetry_register(struct telemetry_object *object,
+                   const struct stats_handle *handle,
+                   enum telemetry_type type, uint16_t subid,
+                   uint64_t id, uint64_t cookie)
+{
+    object->handle = handle;
+    object->type = type;
+    object->subid = subid;
+    object->id = id;
+    object->cookie = cookie;
+
+    if (list_empty(&clients)) {
+        memset(&object->last, 0, sizeof(object->last));
+    } else {
+        stats_get(handle, &object->last);
+    }
+
+    list_push(&objects, &object->links);
+    num_objects++;
+}
+
+static uint64_t
+counter_delta(uint64_t cur, uint64_t last)
+{
+    /* A cleared counter starts again from zero */
+    return cur >= last ? cur - last : cur;
+}
+
+void
+telemetry_unregister(struct telemetry_object *object)
+{
+    list_remove(&object->links);
+    num_objects--;
+
+    if (list_empty(&clients)) {
+        return;
+    }
+
+    struct stats stats;
+    stats_get(object->handle, &stats);
+
+    struct telemetry_record *record =
+        xbuf_reserve(&removed_records, sizeof(*record));
+    memset(record, 0, sizeof(*record));
+    record->type = object->type;
+    record->flags = TELEMETRY_RECORD_REMOVED;
+    record->subid = object->subid;
+    record->id = object->id;
+    record->cookie = object->cookie;
+    record->packets = counter_delta(stats.packets, object->last.packets);
+    record->bytes = counter_delta(stats.bytes, object->last.bytes);
+}
+
+/* Read every registered counter into read_results, in list order */
+static void
+read_all(void)
+{
+    if (read_size < num_objects) {
+        read_size = num_objects * 2;
+        read_handles = aim_realloc(read_handles, read_size * sizeof(*read_handles));
+        read_results = aim_realloc(read_results, read_size * sizeof(*read_results));
+    }
+
+    uint32_t i = 0;
+    list_links_t *cur;
+    LIST_FOREACH(&objects, cur) {
+        struct telemetry_object *object = container_of(cur, links, struct telemetry_object);
+        read_handles[i++] = object->handle;
+    }
+
+    ind_ovs_stats_get_batch(read_handles, read_results, num_objects);
+}
+
+static uint32_t
+message_length(const struct telemetry_header *header)
+{
+    return sizeof(*header) + header->count * sizeof(struct telemetry_record);
+}
+
+/* Add the message to interval_buf */
+static void
+flush(bool last)
+{
+    message.header.flags = last ? TELEMETRY_HEADER_LAST : 0;
+    xbuf_append(&interval_buf, &message, message_length(&message.header));
+
+    debug_counter_add(&record_count, message.header.count);
+    message.header.part++;
+    message.header.count = 0;
+}
+
+/*
+ * Send the client's remaining messages of this interval, until its socket
+ * buffer is full
+ *
+ * May destroy the client.
+ */
+static void
+client_send(struct client *client)
+{
+    while (client->offset < xbuf_length(&interval_buf)) {
+        const struct telemetry_header *header =
+            (const void *)((char *)xbuf_data(&interval_buf) + client->offset);
+        uint32_t len = message_length(header);
+
+        if (send(client->fd, header, len, MSG_NOSIGNAL|MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!client->write_pending) {
+                    debug_counter_inc(&client_send_deferred);
+                    ind_soc_data_out_ready(client->fd);
+                    client->write_pending = true;
+                }
+            } else {
+                AIM_LOG_VERBOSE("Failed to send to telemetry client: %s", strerror(errno));
+                destroy_client(client);
+            }
+            return;
+        }
+
+        client->offset += len;
+    }
+
+    if (client->write_pending) {
+        ind_soc_data_out_clear(client->fd);
+        client->write_pending = false;
+    }
+}
+
+static void
+append_record(const struct telemetry_record *record)
+{
+    if (message.header.count == MAX_RECORDS_PER_MESSAGE) {
+        flush(false);
+    }
+
+    message.records[message.header.count++] = *record;
+}
+
+static void
+publish(void *cookie)
+{
+    list_links_t *cur, *next;
+    LIST_FOREACH_SAFE(&clients, cur, next) {
+        struct client *client = container_of(cur, links, struct client);
+        if (client->offset < xbuf_length(&interval_buf)) {
+            AIM_LOG_WARN("Disconnecting telemetry client that fell behind");
+            debug_counter_inc(&client_overrun);
+            destroy_client(client);
+        }
+    }
+
+    if (list_empty(&clients)) {
+        return;
+    }
+
+    struct timespec tp;
+    clock_gettime(CLOCK_REALTIME, &tp);
+
+    read_all();
+    xbuf_reset(&interval_buf);
+
+    message.header.magic = TELEMETRY_MAGIC;
+    message.header.version = TELEMETRY_VERSION;
+    message.header.record_size = sizeof(struct telemetry_record);
+    message.header.seq = seq++;
+    message.header.time_ns = (uint64_t)tp.tv_sec * 1000*1000*1000 + tp.tv_nsec;
+    message.header.interval_ms = interval_ms;
+    message.header.part = 0;
+    message.header.count = 0;
+
+    struct telemetry_record *removed = xbuf_data(&removed_records);
+    uint32_t num_removed = xbuf_length(&removed_records) / sizeof(*removed);
+    uint32_t i;
+    for (i = 0; i < num_removed; i++) {
+        append_record(&removed[i]);
+    }
+    xbuf_reset(&removed_records);
+
+    i = 0;
+    LIST_FOREACH(&objects, cur) {
+        struct telemetry_object *object = container_of(cur, links, struct telemetry_object);
+        struct stats *stats = &read_results[i++];
+
+        if (stats->packets == object->last.packets &&
+                stats->bytes == object->last.bytes) {
+            continue;
+        }
+
+        struct telemetry_record record = {
+            .type = object->type,
+            .subid = object->subid,
+            .id = object->id,
+            .cookie = object->cookie,
+            .packets = counter_delta(stats->packets, object->last.packets),
+            .bytes = counter_delta(stats->bytes, object->last.bytes),
+        };
+        append_record(&record);
+        object->last = *stats;
+    }
+
+    flush(true);
+    debug_counter_inc(&publish_count);
+
+    LIST_FOREACH_SAFE(&clients, cur, next) {
+        struct client *client = container_of(cur, links, struct client);
+        client->offset = 0;
+        client_send(client);
+    }
+}
+
+/*
+ * Record the current value of every counter, so a newly connected client
+ * only sees later changes
+ */
+static void
+start_publishing(void)
+{
+    read_all();
+
+    uint32_t i = 0;
+    list_links_t *cur;
+    LIST_FOREACH(&objects, cur) {
+        struct telemetry_object *object = container_of(cur, links, struct telemetry_object);
+        object->last = read_results[i++];
+    }
+
+    indigo_error_t rv = ind_soc_timer_event_register(publish, NULL, interval_ms);
+    if (rv < 0) {
+        AIM_DIE("Failed to register telemetry timer: %s", indigo_strerror(rv));
+    }
+}
+
+static void
+stop_publishing(void)
+{
+    ind_soc_timer_event_unregister(publish, NULL);
+    xbuf_reset(&removed_records);
+    xbuf_reset(&interval_buf);
+}
+
+static void
+listen_callback(
+    int socket_id,
+    void *cookie,
+    int read_ready,
+    int write_ready,
+    int error_seen)
+{
+    AIM_LOG_TRACE("Accepting telemetry client");
+
+    int fd;
+    if ((fd = accept(listen_socket, NULL, NULL)) < 0) {
+        AIM_LOG_ERROR("Failed to accept on telemetry socket: %s", strerror(errno));
+        return;
+    }
+
+    int soc_flags = fcntl(fd, F_GETFL, 0);
+    if (soc_flags == -1 || fcntl(fd, F_SETFL, soc_flags | O_NONBLOCK) == -1) {
+        AIM_LOG_WARN("Failed to set non-blocking flag for socket: %s", strerror(errno));
+    }
+
+    /*
+     * SO_SNDBUF is capped at net.core.wmem_max, usually far below
+     * CLIENT_SNDBUF. SO_SNDBUFFORCE isn't, but needs CAP_NET_ADMIN.
+     */
+    int sndbuf = CLIENT_SNDBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)) < 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+        AIM_LOG_WARN("Failed to set telemetry socket buffer size: %s", strerror(errno));
+    }
+
+    if (list_empty(&clients)) {
+        start_publishing();
+    }
+
+    struct client *client = aim_zmalloc(sizeof(*client));
+    list_push(&clients, &client->links);
+    client->fd = fd;
+    /* Start with the next interval */
+    client->offset = xbuf_length(&interval_buf);
+
+    indigo_error_t rv = ind_soc_socket_register(fd, client_callback, client);
+    if (rv < 0) {
+        AIM_LOG_ERROR("Failed to register telemetry client socket: %s", indigo_strerror(rv));
+        destroy_client(client);
+        return;
+    }
+}
+
+/*
+ * Clients don't send anything, we only watch for them disconnecting and for
+ * room to send deferred messages
+ */
+static void
+client_callback(
+    int socket_id,
+    void *cookie,
+    int read_ready,
+    int write_ready,
+    int error_seen)
+{
+    struct client *client = cookie;
+    AIM_ASSERT(socket_id == client->fd);
+
+    if (error_seen) {
+        destroy_client(client);
+        return;
+    }
+
+    if (read_ready) {
+        char buf[64];
+        int c = read(client->fd, buf, sizeof(buf));
+        if (c == 0 || (c < 0 && errno != EAGAIN && errno != EINTR)) {
+            destroy_client(client);
+            return;
+        }
+    }
+
+    if (write_ready) {
+        client_send(client);
+    }
+}
+
+static void
+destroy_client(struct client *client)
+{
+    ind_soc_socket_unregister(client->fd);
+    close(client->fd);
+    list_remove(&client->links);
+    aim_free(client);
+
+    if (list_empty(&clients)) {
+        stop_publishing();
+    }
+}
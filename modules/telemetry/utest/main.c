@@ -0,0 +1,281 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <linux/un.h>
+#include <AIM/aim.h>
+#include <SocketManager/socketmanager.h>
+#include <telemetry/telemetry.h>
+#include <ivs/ivs.h>
+
+#define INTERVAL_MS "100"
+
+/* Bigger than the largest client socket buffer */
+#define NUM_BULK_OBJECTS 200000
+
+#define MAX_MESSAGE_RECORDS \
+    ((TELEMETRY_MAX_MESSAGE_SIZE - sizeof(struct telemetry_header)) / sizeof(struct telemetry_record))
+
+struct object {
+    struct stats_handle handle;
+    struct telemetry_object telemetry;
+};
+
+struct interval {
+    uint64_t seq;
+    uint32_t num_records;
+    struct telemetry_record records[16];
+};
+
+static char path[UNIX_PATH_MAX];
+static struct stats_writer *writer;
+
+/* Stands in for the OVSDriver function, which also syncs kernel flow stats */
+void
+ind_ovs_stats_get_batch(const struct stats_handle *const handles[],
+                        struct stats results[], uint32_t count)
+{
+    stats_get_batch(handles, results, count);
+}
+
+static int
+client_connect(void)
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert(fd >= 0);
+
+    struct sockaddr_un saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strcpy(saddr.sun_path, path);
+    assert(connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) == 0);
+
+    return fd;
+}
+
+/* Receive a message, running the event loop while there is none */
+static int
+client_recv(int fd, void *buf, size_t len)
+{
+    while (true) {
+        int n = recv(fd, buf, len, MSG_DONTWAIT);
+        if (n >= 0) {
+            return n;
+        }
+        assert(errno == EAGAIN);
+        ind_soc_select_and_run(10);
+    }
+}
+
+/*
+ * Receive the messages of one interval
+ *
+ * Checks the headers and returns the total number of records. Up to
+ * AIM_ARRAYSIZE(interval->records) of them are stored in 'interval'.
+ */
+static uint32_t
+client_recv_interval(int fd, struct interval *interval)
+{
+    static struct {
+        struct telemetry_header header;
+        struct telemetry_record records[MAX_MESSAGE_RECORDS];
+    } msg;
+    uint32_t total = 0;
+    uint16_t part = 0;
+
+    interval->num_records = 0;
+
+    while (true) {
+        int n = client_recv(fd, &msg, sizeof(msg));
+        assert(n >= (int)sizeof(msg.header));
+        assert(msg.header.magic == TELEMETRY_MAGIC);
+        assert(msg.header.version == TELEMETRY_VERSION);
+        assert(msg.header.record_size == sizeof(struct telemetry_record));
+        assert(n == (int)(sizeof(msg.header) + msg.header.count * sizeof(struct telemetry_record)));
+        assert(msg.header.part == part++);
+        if (msg.header.part == 0) {
+            interval->seq = msg.header.seq;
+        } else {
+            assert(msg.header.seq == interval->seq);
+        }
+
+        uint32_t i;
+        for (i = 0; i < msg.header.count; i++) {
+            if (interval->num_records < AIM_ARRAYSIZE(interval->records)) {
+                interval->records[interval->num_records++] = msg.records[i];
+            }
+        }
+        total += msg.header.count;
+
+        if (msg.header.flags & TELEMETRY_HEADER_LAST) {
+            return total;
+        }
+    }
+}
+
+static void
+object_register(struct object *object, uint64_t id)
+{
+    stats_alloc(&object->handle);
+    telemetry_register(&object->telemetry, &object->handle,
+                       TELEMETRY_TYPE_FLOW, 1, id, id + 100);
+}
+
+static void
+object_unregister(struct object *object)
+{
+    telemetry_unregister(&object->telemetry);
+    stats_free(&object->handle);
+}
+
+static void
+test_deltas(void)
+{
+    struct object objects[3];
+    struct interval interval;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        object_register(&objects[i], i);
+    }
+
+    /* Counts from before the client connected aren't sent */
+    stats_inc(writer, &objects[0].handle, 1, 100);
+
+    int fd = client_connect();
+
+    /* An interval with no changes is one empty message */
+    assert(client_recv_interval(fd, &interval) == 0);
+    uint64_t seq = interval.seq;
+
+    stats_inc(writer, &objects[0].handle, 2, 200);
+    stats_inc(writer, &objects[2].handle, 3, 300);
+    stats_inc(writer, &objects[2].handle, 4, 400);
+
+    /* Only the changed counters, with the change since the last interval */
+    assert(client_recv_interval(fd, &interval) == 2);
+    assert(interval.seq == seq + 1);
+    for (i = 0; i < 2; i++) {
+        struct telemetry_record *record = &interval.records[i];
+        assert(record->type == TELEMETRY_TYPE_FLOW);
+        assert(record->subid == 1);
+        assert(record->flags == 0);
+        assert(record->cookie == record->id + 100);
+        if (record->id == 0) {
+            assert(record->packets == 2 && record->bytes == 200);
+        } else {
+            assert(record->id == 2);
+            assert(record->packets == 7 && record->bytes == 700);
+        }
+    }
+
+    /* Unregistering sends the final change */
+    stats_inc(writer, &objects[1].handle, 5, 500);
+    object_unregister(&objects[1]);
+    assert(client_recv_interval(fd, &interval) == 1);
+    assert(interval.records[0].id == 1);
+    assert(interval.records[0].flags == TELEMETRY_RECORD_REMOVED);
+    assert(interval.records[0].packets == 5);
+
+    assert(client_recv_interval(fd, &interval) == 0);
+
+    close(fd);
+    ind_soc_select_and_run(0);
+
+    object_unregister(&objects[0]);
+    object_unregister(&objects[2]);
+}
+
+/*
+ * An interval bigger than the socket buffer is sent as the client reads it,
+ * while a client that doesn't read is disconnected once it misses an interval
+ */
+static void
+test_slow_client(void)
+{
+    struct object *objects = calloc(NUM_BULK_OBJECTS, sizeof(*objects));
+    struct interval interval;
+    int i;
+
+    for (i = 0; i < NUM_BULK_OBJECTS; i++) {
+        object_register(&objects[i], i);
+    }
+
+    int fd = client_connect();
+    int stalled_fd = client_connect();
+
+    assert(client_recv_interval(fd, &interval) == 0);
+
+    for (i = 0; i < NUM_BULK_OBJECTS; i++) {
+        stats_inc(writer, &objects[i].handle, 1, 64);
+    }
+
+    assert(client_recv_interval(fd, &interval) == NUM_BULK_OBJECTS);
+    assert(client_recv_interval(fd, &interval) == 0);
+    assert(client_recv_interval(fd, &interval) == 0);
+
+    /* The stalled client gets what fit in its socket buffer, then EOF */
+    char buf[TELEMETRY_MAX_MESSAGE_SIZE];
+    int n;
+    while ((n = recv(stalled_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    }
+    assert(n == 0);
+
+    close(stalled_fd);
+    close(fd);
+    ind_soc_select_and_run(0);
+
+    for (i = 0; i < NUM_BULK_OBJECTS; i++) {
+        object_unregister(&objects[i]);
+    }
+    free(objects);
+}
+
+int aim_main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    ind_soc_config_t soc_cfg;
+    memset(&soc_cfg, 0, sizeof(soc_cfg));
+    assert(ind_soc_init(&soc_cfg) >= 0);
+    assert(ind_soc_enable_set(1) >= 0);
+
+    setenv("IVS_TELEMETRY_INTERVAL_MS", INTERVAL_MS, 1);
+    snprintf(path, sizeof(path), "/tmp/ivs-telemetry-utest.%d.sock", getpid());
+    telemetry_init_path(path);
+
+    writer = stats_writer_create();
+
+    test_deltas();
+    test_slow_client();
+
+    stats_writer_destroy(writer);
+    unlink(path);
+    ind_soc_finish();
+
+    return 0;
+}
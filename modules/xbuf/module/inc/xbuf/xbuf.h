@@ -21,22 +21,56 @@
  * xbuf - Expandable contiguous buffer
  *
  * Includes Netlink-compatible attributes.
+ *
+ * By default the backing memory comes from the heap. An xbuf can instead
+ * start in caller-provided storage (a "stub", usually on the stack) and only
+ * move to the heap if it outgrows it, or take its memory from an arena that
+ * is freed in bulk. xbuf_compact and xbuf_steal always leave the contents in
+ * an exact size heap allocation, so a buffer can be built in scratch memory
+ * and then kept.
  */
 
 #ifndef XBUF_H
 #define XBUF_H
 
 #include <assert.h>
+#include <stdbool.h>
 #include <AIM/aim.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 
+struct xbuf_arena_chunk;
+
+/*
+ * Bump allocator for xbufs that are thrown away together
+ *
+ * Memory is carved out of chunks and only returned by xbuf_arena_reset or
+ * xbuf_arena_cleanup. The most recent allocation can grow in place.
+ */
+struct xbuf_arena {
+    struct xbuf_arena_chunk *chunks; /* newest first */
+    char *free; /* next unused byte in the newest chunk */
+    char *end; /* end of the newest chunk */
+    void *last; /* most recent allocation */
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+};
+
+/*
+ * The mode flags share a word with 'allocated' to keep the struct at 16
+ * bytes. An arena xbuf finds its arena in the word before 'data'.
+ */
 struct xbuf {
     void *data;
     uint32_t length;
-    uint32_t allocated;
+    uint32_t allocated : 30;
+    uint32_t stub : 1; /* data is caller-provided storage */
+    uint32_t in_arena : 1; /* data was allocated from an arena */
 };
 
+/* Largest backing memory an xbuf can have */
+#define XBUF_MAX_ALLOCATED (1U << 29)
+
 /**
  * Initialize an xbuf
  *
@@ -44,13 +78,61 @@ struct xbuf {
  */
 void xbuf_init(struct xbuf *xbuf);
 
+/**
+ * Initialize an xbuf in caller-provided storage
+ *
+ * No memory is allocated until the contents exceed 'size' bytes, at which
+ * point they are moved to the heap. 'stub' must outlive the xbuf, or the
+ * xbuf must be compacted or stolen first.
+ */
+void xbuf_init_stub(struct xbuf *xbuf, void *stub, uint32_t size);
+
+/**
+ * Initialize an xbuf whose backing memory comes from an arena
+ *
+ * Allocates the backing memory from the arena. It is freed by
+ * xbuf_arena_reset, so the xbuf must be compacted, stolen or cleaned up
+ * before then.
+ */
+void xbuf_init_arena(struct xbuf *xbuf, struct xbuf_arena *arena);
+
 /**
  * Clean up an xbuf
  *
- * Frees the backing memory.
+ * Frees the backing memory, unless it is a stub or in an arena.
  */
 void xbuf_cleanup(struct xbuf *xbuf);
 
+/**
+ * Initialize an arena
+ *
+ * Memory is allocated in chunks of 'chunk_size' bytes, or larger for
+ * buffers that don't fit in one.
+ */
+void xbuf_arena_init(struct xbuf_arena *arena, uint32_t chunk_size);
+
+/**
+ * Free everything allocated from an arena
+ *
+ * The newest chunk is kept for reuse, so an arena that is reset after each
+ * use stops allocating once it has grown a chunk big enough.
+ */
+void xbuf_arena_reset(struct xbuf_arena *arena);
+
+/**
+ * Free all of an arena's memory
+ */
+void xbuf_arena_cleanup(struct xbuf_arena *arena);
+
+#ifdef XBUF_CONFIG_COUNT_ALLOCATIONS
+/**
+ * Return the number of heap allocations made by xbufs and arenas
+ *
+ * Not synchronized between threads. Only built for the unit test.
+ */
+uint64_t xbuf_allocations(void);
+#endif
+
 /**
  * Return a pointer to the backing memory
  *
@@ -76,7 +158,7 @@ xbuf_length(struct xbuf *xbuf)
  *
  * Most users should use xbuf_resize_check. This function does not
  * check whether the requested size is less than the current size,
- * and so may shrink the buffer.
+ * and so may shrink a heap buffer.
  */
 void xbuf_resize(struct xbuf *xbuf, uint32_t new_len);
 
@@ -94,6 +176,9 @@ xbuf_resize_check(struct xbuf *xbuf, uint32_t new_len)
 
 /**
  * Shrink an xbuf's backing memory to just fit the contents
+ *
+ * A stub or arena xbuf is moved to the heap. Empty contents leave no
+ * memory allocated.
  */
 void xbuf_compact(struct xbuf *xbuf);
 
@@ -107,6 +192,9 @@ void xbuf_compact(struct xbuf *xbuf);
 static inline void *
 xbuf_steal(struct xbuf *xbuf)
 {
+    if (xbuf->stub || xbuf->in_arena) {
+        xbuf_compact(xbuf);
+    }
     void *ptr = xbuf_data(xbuf);
     xbuf->data = NULL;
     xbuf->length = 0;
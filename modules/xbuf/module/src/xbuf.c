@@ -19,26 +19,87 @@
 
 #include <xbuf/xbuf.h>
 #include <AIM/aim_memory.h>
+#include <string.h>
 
 #define XBUF_INITIAL_LEN 64
 
+/* Alignment of arena allocations, enough for any attribute payload */
+#define XBUF_ARENA_ALIGN 8
+
+/* Each arena allocation is preceded by a pointer to its arena */
+#define XBUF_ARENA_HEADER_LEN 8
+
+AIM_STATIC_ASSERT(XBUF_ARENA_HEADER_LEN,
+                  XBUF_ARENA_HEADER_LEN >= sizeof(struct xbuf_arena *) &&
+                  XBUF_ARENA_HEADER_LEN % XBUF_ARENA_ALIGN == 0);
+
+struct xbuf_arena_chunk {
+    struct xbuf_arena_chunk *next;
+    uint64_t size;
+    char data[];
+};
+
+#ifdef XBUF_CONFIG_COUNT_ALLOCATIONS
+static uint64_t xbuf_allocation_count;
+#define XBUF_COUNT_ALLOCATION() xbuf_allocation_count++
+#else
+#define XBUF_COUNT_ALLOCATION()
+#endif
+
 void
 xbuf_init(struct xbuf *xbuf)
 {
     xbuf->data = NULL;
     xbuf->length = 0;
     xbuf->allocated = 0;
+    xbuf->stub = false;
+    xbuf->in_arena = false;
     xbuf_resize(xbuf, XBUF_INITIAL_LEN);
 }
 
+void
+xbuf_init_stub(struct xbuf *xbuf, void *stub, uint32_t size)
+{
+    AIM_TRUE_OR_DIE(size <= XBUF_MAX_ALLOCATED, "xbuf stub too large");
+    xbuf->data = stub;
+    xbuf->length = 0;
+    xbuf->allocated = size;
+    xbuf->stub = true;
+    xbuf->in_arena = false;
+}
+
+static void *arena_alloc(struct xbuf_arena *arena, uint32_t len);
+
+void
+xbuf_init_arena(struct xbuf *xbuf, struct xbuf_arena *arena)
+{
+    xbuf->data = arena_alloc(arena, XBUF_INITIAL_LEN);
+    xbuf->length = 0;
+    xbuf->allocated = XBUF_INITIAL_LEN;
+    xbuf->stub = false;
+    xbuf->in_arena = true;
+}
+
 void
 xbuf_cleanup(struct xbuf *xbuf)
 {
-    aim_free(xbuf->data);
+    if (!xbuf->stub && !xbuf->in_arena) {
+        aim_free(xbuf->data);
+    }
     xbuf->data = NULL;
     xbuf->length = 0;
     xbuf->allocated = 0;
+    xbuf->stub = false;
+    xbuf->in_arena = false;
+}
+
+#ifdef XBUF_CONFIG_COUNT_ALLOCATIONS
+uint64_t
+xbuf_allocations(void)
+{
+    return xbuf_allocation_count;
 }
+#endif
 
 /* From http://locklessinc.com/articles/next_pow2/ */
 static inline int
@@ -53,18 +114,172 @@ next_pow2(uint32_t x)
     return x + 1;
 }
 
+static inline uint32_t
+arena_align(uint32_t len)
+{
+    return (len + XBUF_ARENA_ALIGN - 1) & ~(XBUF_ARENA_ALIGN - 1);
+}
+
+static inline struct xbuf_arena *
+arena_of(struct xbuf *xbuf)
+{
+    return *(struct xbuf_arena **)((char *)xbuf->data - XBUF_ARENA_HEADER_LEN);
+}
+
+static void *
+arena_alloc(struct xbuf_arena *arena, uint32_t len)
+{
+    uint32_t total = XBUF_ARENA_HEADER_LEN + arena_align(len);
+
+    if (arena->end - arena->free < total) {
+        uint32_t size = total > arena->chunk_size ? total : arena->chunk_size;
+        struct xbuf_arena_chunk *chunk = aim_malloc(sizeof(*chunk) + size);
+        AIM_TRUE_OR_DIE(chunk != NULL, "failed to allocate xbuf arena chunk");
+        XBUF_COUNT_ALLOCATION();
+        chunk->next = arena->chunks;
+        chunk->size = size;
+        arena->chunks = chunk;
+        arena->num_chunks++;
+        arena->free = chunk->data;
+        arena->end = chunk->data + size;
+    }
+
+    *(struct xbuf_arena **)arena->free = arena;
+    void *ptr = arena->free + XBUF_ARENA_HEADER_LEN;
+    arena->free += total;
+    arena->last = ptr;
+    return ptr;
+}
+
+/* Arena memory is never shrunk */
+static void
+xbuf_resize_arena(struct xbuf *xbuf, uint32_t new_len)
+{
+    struct xbuf_arena *arena = arena_of(xbuf);
+    uint32_t allocated = next_pow2(new_len);
+
+    if (allocated <= xbuf->allocated) {
+        return;
+    }
+
+    if (xbuf->data == arena->last && arena->end - (char *)xbuf->data >= allocated) {
+        arena->free = (char *)xbuf->data + arena_align(allocated);
+    } else {
+        void *data = arena_alloc(arena, allocated);
+        memcpy(data, xbuf->data, xbuf->length);
+        xbuf->data = data;
+    }
+
+    xbuf->allocated = allocated;
+}
+
 void
 xbuf_resize(struct xbuf *xbuf, uint32_t new_len)
 {
+    AIM_TRUE_OR_DIE(new_len <= XBUF_MAX_ALLOCATED, "xbuf too large");
+
+    if (xbuf->in_arena) {
+        xbuf_resize_arena(xbuf, new_len);
+        return;
+    }
+
+    if (xbuf->stub) {
+        if (new_len <= xbuf->allocated) {
+            return;
+        }
+        uint32_t allocated = next_pow2(new_len);
+        void *data = aim_malloc(allocated);
+        AIM_TRUE_OR_DIE(data != NULL, "failed to allocate xbuf");
+        memcpy(data, xbuf->data, xbuf->length);
+        xbuf->data = data;
+        xbuf->allocated = allocated;
+        xbuf->stub = false;
+        XBUF_COUNT_ALLOCATION();
+        return;
+    }
+
     xbuf->allocated = next_pow2(new_len);
     xbuf->data = aim_realloc(xbuf->data, xbuf->allocated);
     AIM_TRUE_OR_DIE(xbuf->data != NULL, "failed to allocate xbuf");
+    XBUF_COUNT_ALLOCATION();
 }
 
 void
 xbuf_compact(struct xbuf *xbuf)
 {
+    if (xbuf->stub || xbuf->in_arena) {
+        void *data = NULL;
+        if (xbuf->length > 0) {
+            data = aim_malloc(xbuf->length);
+            AIM_TRUE_OR_DIE(data != NULL, "failed to allocate xbuf");
+            memcpy(data, xbuf->data, xbuf->length);
+            XBUF_COUNT_ALLOCATION();
+        }
+
+        /* Give back the arena space if nothing was allocated after it */
+        if (xbuf->in_arena) {
+            struct xbuf_arena *arena = arena_of(xbuf);
+            if (xbuf->data == arena->last) {
+                arena->free = (char *)xbuf->data - XBUF_ARENA_HEADER_LEN;
+                arena->last = NULL;
+            }
+        }
+
+        xbuf->data = data;
+        xbuf->allocated = xbuf->length;
+        xbuf->stub = false;
+        xbuf->in_arena = false;
+        return;
+    }
+
     xbuf->allocated = xbuf->length;
     xbuf->data = aim_realloc(xbuf->data, xbuf->allocated);
     AIM_TRUE_OR_DIE(xbuf->allocated == 0 || xbuf->data != NULL, "failed to allocate xbuf");
+    if (xbuf->allocated > 0) {
+        XBUF_COUNT_ALLOCATION();
+    }
+}
+
+void
+xbuf_arena_init(struct xbuf_arena *arena, uint32_t chunk_size)
+{
+    arena->chunks = NULL;
+    arena->free = NULL;
+    arena->end = NULL;
+    arena->last = NULL;
+    arena->chunk_size = arena_align(chunk_size);
+    arena->num_chunks = 0;
+}
+
+void
+xbuf_arena_reset(struct xbuf_arena *arena)
+{
+    struct xbuf_arena_chunk *chunk = arena->chunks;
+    if (chunk == NULL) {
+        return;
+    }
+
+    while (chunk->next != NULL) {
+        struct xbuf_arena_chunk *next = chunk->next->next;
+        aim_free(chunk->next);
+        chunk->next = next;
+    }
+
+    arena->free = chunk->data;
+    arena->end = chunk->data + chunk->size;
+    arena->last = NULL;
+    arena->num_chunks = 1;
+}
+
+void
+xbuf_arena_cleanup(struct xbuf_arena *arena)
+{
+    struct xbuf_arena_chunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        struct xbuf_arena_chunk *next = chunk->next;
+        aim_free(chunk);
+        chunk = next;
+    }
+
+    xbuf_arena_init(arena, arena->chunk_size);
 }
@@ -24,6 +24,7 @@
 #include <xbuf/xbuf.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <inttypes.h>
 
 static void
 test_basic(void)
@@ -31,6 +32,9 @@ test_basic(void)
     struct xbuf a;
     xbuf_init(&a);
 
+    /* The mode flags shouldn't make the struct bigger */
+    assert(sizeof(a) == sizeof(void *) + 2 * sizeof(uint32_t));
+
     /* Should be initialized to be empty, but with some backing memory */
     assert(xbuf_length(&a) == 0);
     assert(xbuf_data(&a) != NULL);
@@ -254,6 +258,188 @@ test_iteration(void)
     xbuf_cleanup(&a);
 }
 
+static void
+test_stub(void)
+{
+    struct xbuf a;
+    char stub[16];
+    uint64_t allocations = xbuf_allocations();
+    xbuf_init_stub(&a, stub, sizeof(stub));
+
+    /* Should use the stub until it overflows */
+    xbuf_append(&a, "0123456789abcdef", 16);
+    assert(xbuf_data(&a) == stub);
+    assert(a.allocated == 16);
+    assert(xbuf_allocations() == allocations);
+
+    /* Should move the contents to the heap */
+    xbuf_append(&a, "g", 1);
+    assert(xbuf_data(&a) != stub);
+    assert(xbuf_length(&a) == 17);
+    assert(a.allocated == 32);
+    assert(memcmp(xbuf_data(&a), "0123456789abcdefg", 17) == 0);
+    assert(xbuf_allocations() == allocations + 1);
+    xbuf_cleanup(&a);
+
+    /* Stealing should copy the stub to the heap */
+    xbuf_init_stub(&a, stub, sizeof(stub));
+    xbuf_append(&a, "abcd", 4);
+    char *data = xbuf_steal(&a);
+    assert(data != stub);
+    assert(memcmp(data, "abcd", 4) == 0);
+    aim_free(data);
+
+    /* Compacting an empty stub should leave nothing allocated */
+    xbuf_init_stub(&a, stub, sizeof(stub));
+    xbuf_compact(&a);
+    assert(xbuf_data(&a) == NULL);
+    assert(a.allocated == 0);
+    xbuf_cleanup(&a);
+}
+
+static void
+test_arena(void)
+{
+    struct xbuf_arena arena;
+    struct xbuf a, b;
+    xbuf_arena_init(&arena, 1024);
+
+    /* The initial memory should come from the arena */
+    xbuf_init_arena(&a, &arena);
+    assert(arena.num_chunks == 1);
+    assert(a.allocated == 64);
+    xbuf_append(&a, "abcd", 4);
+
+    /* The most recent allocation should grow in place */
+    char *data = xbuf_data(&a);
+    xbuf_append_zeroes(&a, 124);
+    assert(xbuf_data(&a) == data);
+    assert(a.allocated == 128);
+
+    /* Growing an earlier allocation should copy it */
+    xbuf_init_arena(&b, &arena);
+    xbuf_append(&b, "efgh", 4);
+    xbuf_append_zeroes(&a, 1);
+    assert(xbuf_data(&a) != data);
+    assert(a.allocated == 256);
+    assert(memcmp(xbuf_data(&a), "abcd", 4) == 0);
+    assert(memcmp(xbuf_data(&b), "efgh", 4) == 0);
+    assert(arena.num_chunks == 1);
+
+    /* Should start a new chunk when full, sized for large buffers */
+    xbuf_append_zeroes(&b, 1000);
+    assert(arena.num_chunks == 2);
+    assert(memcmp(xbuf_data(&b), "efgh", 4) == 0);
+
+    /* Compacting should move the contents to the heap */
+    xbuf_compact(&a);
+    assert(!a.in_arena);
+    assert(a.allocated == 129);
+    assert(memcmp(xbuf_data(&a), "abcd", 4) == 0);
+    xbuf_cleanup(&b);
+
+    /* Reset should keep only the newest chunk */
+    xbuf_arena_reset(&arena);
+    assert(arena.num_chunks == 1);
+    assert(memcmp(xbuf_data(&a), "abcd", 4) == 0);
+    xbuf_cleanup(&a);
+
+    /* Stealing should copy to the heap */
+    xbuf_init_arena(&a, &arena);
+    xbuf_append(&a, "ijkl", 4);
+    data = xbuf_steal(&a);
+    assert(memcmp(data, "ijkl", 4) == 0);
+    aim_free(data);
+
+    xbuf_arena_cleanup(&arena);
+    assert(arena.num_chunks == 0);
+}
+
+/* Stand-in for translating a flow's OpenFlow actions */
+static void
+translate_actions(struct xbuf *xbuf, int num_actions)
+{
+    int i;
+    for (i = 0; i < num_actions; i++) {
+        uint32_t port = i;
+        xbuf_append_attr(xbuf, 0, &port, sizeof(port));
+    }
+}
+
+/*
+ * Count heap allocations for the flow-add and upcall patterns
+ *
+ * A flow-add translates apply and write action lists and compacts them.
+ * An upcall collects stats handles in a buffer reused for each packet.
+ */
+static void
+test_allocation_counts(void)
+{
+    const int num_flows = 1000;
+    struct xbuf apply[num_flows], write[num_flows];
+    uint64_t allocations;
+    int i;
+
+    /* Heap: two initial allocations, growth and one compaction per flow */
+    allocations = xbuf_allocations();
+    for (i = 0; i < num_flows; i++) {
+        xbuf_init(&apply[i]);
+        xbuf_init(&write[i]);
+        translate_actions(&apply[i], 10);
+        xbuf_compact(&apply[i]);
+        xbuf_compact(&write[i]);
+    }
+    printf("flow-add, heap: %.2f allocations per flow\n",
+           (xbuf_allocations() - allocations) / (double)num_flows);
+    assert(xbuf_allocations() - allocations == (uint64_t)num_flows * 4);
+
+    for (i = 0; i < num_flows; i++) {
+        xbuf_cleanup(&apply[i]);
+        xbuf_cleanup(&write[i]);
+    }
+
+    /* Arena: only the compacted non-empty list, after the first chunk */
+    struct xbuf_arena arena;
+    xbuf_arena_init(&arena, 4096);
+    allocations = xbuf_allocations();
+    for (i = 0; i < num_flows; i++) {
+        xbuf_init_arena(&apply[i], &arena);
+        xbuf_init_arena(&write[i], &arena);
+        translate_actions(&apply[i], 10);
+        xbuf_compact(&apply[i]);
+        xbuf_compact(&write[i]);
+        xbuf_arena_reset(&arena);
+    }
+    printf("flow-add, arena: %.2f allocations per flow\n",
+           (xbuf_allocations() - allocations) / (double)num_flows);
+    assert(xbuf_allocations() - allocations == (uint64_t)num_flows + 1);
+
+    for (i = 0; i < num_flows; i++) {
+        assert(xbuf_length(&apply[i]) == 80);
+        assert(xbuf_data(&write[i]) == NULL);
+        xbuf_cleanup(&apply[i]);
+        xbuf_cleanup(&write[i]);
+    }
+    xbuf_arena_cleanup(&arena);
+
+    /* Upcall: the stub holds a typical packet's stats handles */
+    struct xbuf stats;
+    uint32_t stub[32];
+    xbuf_init_stub(&stats, stub, sizeof(stub));
+    allocations = xbuf_allocations();
+    for (i = 0; i < 100000; i++) {
+        xbuf_reset(&stats);
+        int j;
+        for (j = 0; j < 8; j++) {
+            uint32_t handle = j;
+            xbuf_append(&stats, &handle, sizeof(handle));
+        }
+    }
+    printf("upcall, stub: %"PRIu64" allocations\n", xbuf_allocations() - allocations);
+    assert(xbuf_allocations() == allocations);
+    xbuf_cleanup(&stats);
+}
+
 int aim_main(int argc, char* argv[])
 {
     (void) argc;
@@ -263,6 +449,9 @@ int aim_main(int argc, char* argv[])
     test_attrs();
     test_nesting();
     test_iteration();
+    test_stub();
+    test_arena();
+    test_allocation_counts();
 
     return 0;
 }
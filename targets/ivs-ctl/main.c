@@ -37,6 +37,7 @@
 #include <sys/socket.h>
 #include <linux/un.h>
 #include "openvswitch.h"
+#include <telemetry/telemetry_format.h>
 
 static int transact(struct nl_sock *sk, struct nl_msg *msg);
 
@@ -54,9 +55,11 @@ static void help(void)
     fprintf(stderr, "  add-internal-port INTERFACE: add an internal port to the datapath\n");
     fprintf(stderr, "  del-port INTERFACE: delete a port from the datapath\n");
     fprintf(stderr, "  cli ...: run an internal CLI command\n");
+    fprintf(stderr, "  upcall-latency [per-thread|clear]: show upcall latency histograms\n");
     fprintf(stderr, "  dump-flows: print information about each kernel flow\n");
     fprintf(stderr, "  list-ports: print the name of each port\n");
     fprintf(stderr, "  trace: explains the forwarding decision for each new flow\n");
+    fprintf(stderr, "  telemetry: stream changes in flow, port and VLAN counters\n");
 }
 
 static void
@@ -595,6 +598,111 @@ trace(int argc, char **argv)
     fclose(f);
 }
 
+static const char *telemetry_port_counter_names[] = {
+    [TELEMETRY_PORT_RX_UNICAST] = "rx_unicast",
+    [TELEMETRY_PORT_TX_UNICAST] = "tx_unicast",
+    [TELEMETRY_PORT_RX_BROADCAST] = "rx_broadcast",
+    [TELEMETRY_PORT_TX_BROADCAST] = "tx_broadcast",
+    [TELEMETRY_PORT_RX_MULTICAST] = "rx_multicast",
+    [TELEMETRY_PORT_TX_MULTICAST] = "tx_multicast",
+    [TELEMETRY_PORT_RX_BAD_VLAN] = "rx_bad_vlan",
+};
+
+static void
+print_telemetry_record(const struct telemetry_header *hdr,
+                       const struct telemetry_record *record)
+{
+    printf("%"PRIu64".%03u ", hdr->time_ns / 1000000000,
+           (unsigned)(hdr->time_ns / 1000000 % 1000));
+
+    switch (record->type) {
+    case TELEMETRY_TYPE_FLOW:
+        printf("flow table=%u id=%"PRIu64" cookie=0x%"PRIx64,
+               record->subid, record->id, record->cookie);
+        break;
+    case TELEMETRY_TYPE_PORT:
+        printf("port %"PRIu64" %s", record->id,
+               record->subid <= TELEMETRY_PORT_RX_BAD_VLAN ?
+                   telemetry_port_counter_names[record->subid] : "unknown");
+        break;
+    case TELEMETRY_TYPE_VLAN:
+        printf("vlan %"PRIu64" %s", record->id,
+               record->subid == TELEMETRY_VLAN_RX ? "rx" : "tx");
+        break;
+    default:
+        printf("unknown type=%u id=%"PRIu64" subid=%u",
+               record->type, record->id, record->subid);
+        break;
+    }
+
+    printf(" packets=+%"PRIu64" bytes=+%"PRIu64"%s\n",
+           record->packets, record->bytes,
+           record->flags & TELEMETRY_RECORD_REMOVED ? " removed" : "");
+}
+
+/*
+ * Reference reader for the telemetry socket
+ *
+ * Prints one line per changed counter each interval.
+ */
+static void
+telemetry(void)
+{
+    char path[UNIX_PATH_MAX];
+    snprintf(path, sizeof(path), "/var/run/ivs-telemetry.%s.sock", datapath_name);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    struct sockaddr_un saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strcpy(saddr.sun_path, path);
+
+    if (connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    static char buf[TELEMETRY_MAX_MESSAGE_SIZE];
+    while (1) {
+        int c = recv(fd, buf, sizeof(buf), 0);
+        if (c < 0) {
+            if (errno != EINTR) {
+                perror("recv");
+                exit(1);
+            }
+            continue;
+        } else if (c == 0) {
+            break;
+        }
+
+        const struct telemetry_header *hdr = (const void *)buf;
+        if (c < sizeof(*hdr) || hdr->magic != TELEMETRY_MAGIC ||
+                hdr->version != TELEMETRY_VERSION ||
+                hdr->record_size != sizeof(struct telemetry_record) ||
+                c != sizeof(*hdr) + hdr->count * sizeof(struct telemetry_record)) {
+            fprintf(stderr, "Invalid telemetry message\n");
+            exit(1);
+        }
+
+        const struct telemetry_record *records = (const void *)(hdr + 1);
+        int i;
+        for (i = 0; i < hdr->count; i++) {
+            print_telemetry_record(hdr, &records[i]);
+        }
+
+        if (hdr->flags & TELEMETRY_HEADER_LAST) {
+            fflush(stdout);
+        }
+    }
+
+    close(fd);
+}
+
 static struct nl_sock *
 create_genl_socket(void)
 {
@@ -672,6 +780,13 @@ main(int argc, char *argv[])
         del_dp(datapath_name);
     } else if (!strcmp(cmd, "cli")) {
         cli(argc-1, argv+1);
+    } else if (!strcmp(cmd, "upcall-latency")) {
+        if (argc > 2) {
+            fprintf(stderr, "Wrong number of arguments for the %s command (try help)\n", cmd);
+            return 1;
+        }
+        char *cli_argv[] = { "ovsdriver", "upcall-latency", argc == 2 ? argv[1] : NULL };
+        cli(argc == 2 ? 3 : 2, cli_argv);
     } else if (!strcmp(cmd, "dump-flows")) {
         if (argc != 1) {
             fprintf(stderr, "Wrong number of arguments for the %s command (try help)\n", cmd);
@@ -686,6 +801,12 @@ main(int argc, char *argv[])
         list_ports(datapath_name);
     } else if (!strcmp(cmd, "trace")) {
         trace(argc-1, argv+1);
+    } else if (!strcmp(cmd, "telemetry")) {
+        if (argc != 1) {
+            fprintf(stderr, "Wrong number of arguments for the %s command (try help)\n", cmd);
+            return 1;
+        }
+        telemetry();
     } else {
         fprintf(stderr, "Unknown command '%s' (try help)\n", cmd);
         return 1;
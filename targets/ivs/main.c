@@ -49,6 +49,7 @@
 #include <sys/prctl.h>
 #include <execinfo.h>
 #include <packet_trace/packet_trace.h>
+#include <telemetry/telemetry.h>
 
 #define AIM_LOG_MODULE_NAME ivs
 #include <AIM/aim_log.h>
@@ -869,6 +870,7 @@ aim_main(int argc, char* argv[])
     ind_ovs_enable();
 
     packet_trace_init(datapath_name);
+    telemetry_init(datapath_name);
 
     ind_soc_select_and_run(-1);
 
@@ -0,0 +1,245 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * Benchmark the kflow lookup structures
+ *
+ * Models the OVSDriver kflow table: objects the size of a kflow holding an
+ * OVS key, hashed with murmur, stored in a taghash and allocated from a
+ * slab. For comparison the same operations are timed on the previous
+ * layout, a fixed array of 8192 chained buckets with malloc'd kflows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <AIM/aim.h>
+#include <murmur/murmur.h>
+#include <taghash/taghash.h>
+#include <slab/slab.h>
+
+#ifdef USE_CALLGRIND
+#include <valgrind/callgrind.h>
+#else
+#define CALLGRIND_START_INSTRUMENTATION
+#define CALLGRIND_STOP_INSTRUMENTATION
+#endif
+
+/* Roughly the size of struct ind_ovs_kflow and a typical OVS key */
+#define KFLOW_HEADER_SIZE 320
+#define KEY_SIZE 128
+#define NUM_BUCKETS 8192
+
+struct fake_kflow {
+    struct fake_kflow *next; /* bucket chain, unused by the taghash */
+    uint32_t hash;
+    char header[KFLOW_HEADER_SIZE];
+    uint8_t key[KEY_SIZE];
+};
+
+const int num_iters = 3;
+const int num_flows = 1000*1000;
+const int num_lookups_per_flow = 5;
+const uint32_t salt = 42;
+
+struct result {
+    uint64_t add, lookup, delete;
+};
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ((uint64_t)tp.tv_sec * 1000*1000*1000) + tp.tv_nsec;
+}
+
+static void
+make_random_key(uint8_t *key)
+{
+    int i;
+    for (i = 0; i < KEY_SIZE; i++) {
+        key[i] = random();
+    }
+}
+
+static void
+benchmark_taghash(uint8_t *keys, struct result *result)
+{
+    struct taghash t;
+    struct slab *slab = slab_create(sizeof(struct fake_kflow));
+    struct fake_kflow **kflows = calloc(num_flows, sizeof(*kflows));
+    int i, j;
+
+    taghash_init(&t, 8192);
+
+    uint64_t start_time = monotonic_ns();
+
+    for (i = 0; i < num_flows; i++) {
+        struct fake_kflow *kflow = slab_alloc(slab);
+        memcpy(kflow->key, &keys[i * KEY_SIZE], KEY_SIZE);
+        kflow->hash = murmur_hash(kflow->key, KEY_SIZE, salt);
+        taghash_insert(&t, kflow->hash, kflow);
+        kflows[i] = kflow;
+    }
+
+    uint64_t add_time = monotonic_ns();
+
+    CALLGRIND_START_INSTRUMENTATION;
+
+    for (i = 0; i < num_lookups_per_flow; i++) {
+        for (j = 0; j < num_flows; j++) {
+            const uint8_t *key = &keys[j * KEY_SIZE];
+            uint32_t hash = murmur_hash(key, KEY_SIZE, salt);
+            struct taghash_cursor cursor;
+            struct fake_kflow *kflow;
+            for (kflow = taghash_first(&t, hash, &cursor); kflow;
+                    kflow = taghash_next(&t, &cursor)) {
+                if (!memcmp(kflow->key, key, KEY_SIZE)) {
+                    break;
+                }
+            }
+            if (kflow == NULL) {
+                abort();
+            }
+        }
+    }
+
+    CALLGRIND_STOP_INSTRUMENTATION;
+
+    uint64_t lookup_time = monotonic_ns();
+
+    for (i = 0; i < num_flows; i++) {
+        if (!taghash_remove(&t, kflows[i]->hash, kflows[i])) {
+            abort();
+        }
+        slab_free(slab, kflows[i]);
+    }
+
+    uint64_t end_time = monotonic_ns();
+
+    result->add += add_time - start_time;
+    result->lookup += lookup_time - add_time;
+    result->delete += end_time - lookup_time;
+
+    taghash_cleanup(&t);
+    slab_destroy(slab);
+    free(kflows);
+}
+
+static void
+benchmark_buckets(uint8_t *keys, struct result *result)
+{
+    struct fake_kflow **buckets = calloc(NUM_BUCKETS, sizeof(*buckets));
+    struct fake_kflow **kflows = calloc(num_flows, sizeof(*kflows));
+    int i, j;
+
+    uint64_t start_time = monotonic_ns();
+
+    for (i = 0; i < num_flows; i++) {
+        struct fake_kflow *kflow = malloc(sizeof(*kflow));
+        memcpy(kflow->key, &keys[i * KEY_SIZE], KEY_SIZE);
+        kflow->hash = murmur_hash(kflow->key, KEY_SIZE, salt);
+        struct fake_kflow **bucket = &buckets[kflow->hash % NUM_BUCKETS];
+        kflow->next = *bucket;
+        *bucket = kflow;
+        kflows[i] = kflow;
+    }
+
+    uint64_t add_time = monotonic_ns();
+
+    for (i = 0; i < num_lookups_per_flow; i++) {
+        for (j = 0; j < num_flows; j++) {
+            const uint8_t *key = &keys[j * KEY_SIZE];
+            uint32_t hash = murmur_hash(key, KEY_SIZE, salt);
+            struct fake_kflow *kflow;
+            for (kflow = buckets[hash % NUM_BUCKETS]; kflow; kflow = kflow->next) {
+                if (!memcmp(kflow->key, key, KEY_SIZE)) {
+                    break;
+                }
+            }
+            if (kflow == NULL) {
+                abort();
+            }
+        }
+    }
+
+    uint64_t lookup_time = monotonic_ns();
+
+    /* Singly linked, so deleting walks the chain like a lookup */
+    for (i = 0; i < num_flows; i++) {
+        struct fake_kflow **prev = &buckets[kflows[i]->hash % NUM_BUCKETS];
+        while (*prev != kflows[i]) {
+            prev = &(*prev)->next;
+        }
+        *prev = kflows[i]->next;
+        free(kflows[i]);
+    }
+
+    uint64_t end_time = monotonic_ns();
+
+    result->add += add_time - start_time;
+    result->lookup += lookup_time - add_time;
+    result->delete += end_time - lookup_time;
+
+    free(buckets);
+    free(kflows);
+}
+
+static void
+report(const char *name, const struct result *result)
+{
+    fprintf(stderr, "%s: add %.1f ns, lookup %.1f ns, delete %.1f ns\n", name,
+            (result->add*1.0)/(num_flows*num_iters),
+            (result->lookup*1.0)/(num_flows*num_lookups_per_flow*num_iters),
+            (result->delete*1.0)/(num_flows*num_iters));
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    CALLGRIND_STOP_INSTRUMENTATION;
+
+    struct result taghash_result = { 0 }, buckets_result = { 0 };
+    uint8_t *keys = malloc((size_t)num_flows * KEY_SIZE);
+
+    int i;
+    for (i = 0; i < num_iters; i++) {
+        int j;
+        for (j = 0; j < num_flows; j++) {
+            make_random_key(&keys[j * KEY_SIZE]);
+        }
+
+        benchmark_taghash(keys, &taghash_result);
+        benchmark_buckets(keys, &buckets_result);
+    }
+
+    fprintf(stderr, "%d kflows, %d byte keys\n", num_flows, KEY_SIZE);
+    report("taghash+slab", &taghash_result);
+    report("8192 buckets+malloc", &buckets_result);
+
+    free(keys);
+
+    return 0;
+}
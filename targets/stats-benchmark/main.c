@@ -0,0 +1,181 @@
+/****************************************************************
+ *
+ *        Copyright 2015, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ****************************************************************/
+
+/*
+ * Benchmark stats increments
+ *
+ * Models the upcall processes: several processes forked after the stats
+ * were allocated, each incrementing random slots through its own writer.
+ * The same run is timed with the writer arrays on 4KB pages (the previous
+ * layout), transparent hugepages and explicit hugepages. The hugepage modes
+ * fall back if the kernel can't provide them, so check the reported backing.
+ * Explicit hugepages need vm.nr_hugepages reserved, and transparent
+ * hugepages for these shared mappings need
+ * /sys/kernel/mm/transparent_hugepage/shmem_enabled set to "advise".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <AIM/aim.h>
+#include <stats/stats.h>
+
+const int num_handles = 1024*1024;
+const int num_writers = 4;
+const int num_incs = 20*1000*1000;
+
+static struct stats_handle *handles;
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ((uint64_t)tp.tv_sec * 1000*1000*1000) + tp.tv_nsec;
+}
+
+static void
+run_writer(struct stats_writer *writer, uint32_t seed, uint64_t *elapsed)
+{
+    uint32_t x = seed;
+    int i;
+
+    uint64_t start_time = monotonic_ns();
+
+    for (i = 0; i < num_incs; i++) {
+        /* xorshift32 */
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        stats_inc(writer, &handles[x % num_handles], 1, 64);
+    }
+
+    *elapsed = monotonic_ns() - start_time;
+}
+
+static void
+benchmark(const char *name, enum stats_hugepages mode)
+{
+    struct stats_writer *writers[num_writers];
+    int i;
+
+    stats_hugepages_set(mode);
+
+    for (i = 0; i < num_writers; i++) {
+        writers[i] = stats_writer_create();
+    }
+
+    /* Fault in every page before timing */
+    for (i = 0; i < num_handles; i++) {
+        int j;
+        for (j = 0; j < num_writers; j++) {
+            stats_inc(writers[j], &handles[i], 0, 0);
+        }
+    }
+
+    struct stats_usage usage;
+    stats_usage_get(&usage);
+
+    uint64_t *elapsed = mmap(NULL, num_writers * sizeof(*elapsed),
+                             PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (elapsed == MAP_FAILED) {
+        abort();
+    }
+
+    for (i = 0; i < num_writers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            abort();
+        } else if (pid == 0) {
+            run_writer(writers[i], 2463534242u + i, &elapsed[i]);
+            _exit(0);
+        }
+    }
+
+    for (i = 0; i < num_writers; i++) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            abort();
+        }
+    }
+
+    /* Every increment from the children must be visible here */
+    struct stats_snapshot *snapshot = stats_snapshot_create();
+    stats_snapshot_update(snapshot);
+    uint64_t total_packets = 0;
+    for (i = 0; i < num_handles; i++) {
+        struct stats stats;
+        stats_snapshot_get(snapshot, &handles[i], &stats);
+        total_packets += stats.packets;
+        stats_clear(&handles[i]);
+    }
+    if (total_packets != (uint64_t)num_incs * num_writers) {
+        abort();
+    }
+    stats_snapshot_destroy(snapshot);
+
+    uint64_t total_elapsed = 0;
+    for (i = 0; i < num_writers; i++) {
+        total_elapsed += elapsed[i];
+    }
+
+    fprintf(stderr, "%s: %.2f ns per increment, %.1f M increments/s total "
+            "(%"PRIu64" KB mapped, %"PRIu64" KB hugepages, %"PRIu64" KB advised for THP)\n",
+            name, (total_elapsed * 1.0) / ((uint64_t)num_incs * num_writers),
+            (num_writers * 1000.0 * num_incs) / (total_elapsed / num_writers),
+            usage.mapped_bytes / 1024, usage.hugetlb_bytes / 1024,
+            usage.thp_bytes / 1024);
+
+    munmap(elapsed, num_writers * sizeof(*elapsed));
+
+    for (i = 0; i < num_writers; i++) {
+        stats_writer_destroy(writers[i]);
+    }
+}
+
+int aim_main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    handles = calloc(num_handles, sizeof(*handles));
+
+    int i;
+    for (i = 0; i < num_handles; i++) {
+        stats_alloc(&handles[i]);
+    }
+
+    fprintf(stderr, "%d slots, %d writer processes, %d increments each\n",
+            num_handles, num_writers, num_incs);
+    benchmark("4KB pages", STATS_HUGEPAGES_NONE);
+    benchmark("transparent hugepages", STATS_HUGEPAGES_TRANSPARENT);
+    benchmark("explicit hugepages", STATS_HUGEPAGES_EXPLICIT);
+
+    for (i = 0; i < num_handles; i++) {
+        stats_free(&handles[i]);
+    }
+    free(handles);
+
+    return 0;
+}